@@ -0,0 +1,293 @@
+#include "CompressedBlock.h"
+#include "MultiMap.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+using namespace std;
+
+/////////////////////////////
+// CompressedBlock Implementations
+/////////////////////////////
+
+// Compresses rows [begin, end) (at most 65535 of them), each column in whichever way takes the
+// fewest bytes. A row with fewer than numFields fields (a deleted row) takes its missing values
+// from the first row that has them, since they will never be read.
+CompressedBlock::CompressedBlock(const vector<vector<string> >& rows, int begin, int end, int numFields)
+{
+	static const string none;
+	m_size = end - begin;
+	m_columns.resize(numFields);
+	vector<const string*> values(m_size);
+	vector<unsigned long long> indexes(m_size);
+	for (int f = 0; f < numFields; ++f)
+	{
+		Column& column = m_columns[f];
+		const string* filler = &none;
+		for (int i = begin; i < end; ++i)
+			if (f < rows[i].size())
+			{
+				filler = &rows[i][f];
+				break;
+			}
+
+		// Measure the values every way at once
+		unordered_map<string, unsigned int> distinct;
+		bool integers = true;
+		unsigned long long smallest = ~0ULL, largest = 0;
+		size_t length = 0, distinctLength = 0;
+		int runs = 0;
+		for (int i = 0; i < m_size; ++i)
+		{
+			const vector<string>& row = rows[begin + i];
+			values[i] = f < row.size() ? &row[f] : filler;
+			length += values[i]->size();
+			auto inserted = distinct.insert(make_pair(*values[i], (unsigned int)distinct.size()));
+			if (inserted.second)
+				distinctLength += values[i]->size();
+			indexes[i] = inserted.first->second;
+			runs += i == 0 || indexes[i] != indexes[i - 1];
+			if (integers)
+				integers = isInteger(*values[i]);
+			if (integers)
+			{
+				unsigned long long n = strtoull(values[i]->c_str(), nullptr, 10);
+				smallest = min(smallest, n);
+				largest = max(largest, n);
+			}
+		}
+		auto packedBytes = [](size_t count, int bits) {
+			return MultiMap::allocationSize((count * bits + 63) / 64 * sizeof(unsigned long long));
+		};
+		size_t dictionaryBytes = MultiMap::stringHeapSize(distinctLength)
+			+ MultiMap::allocationSize((distinct.size() + 1) * sizeof(unsigned int));
+		int indexBits = distinct.empty() ? 0 : bitsFor(distinct.size() - 1);
+		size_t best = MultiMap::stringHeapSize(length) + MultiMap::allocationSize((m_size + 1) * sizeof(unsigned int));
+		column.encoding = en_plain;
+		if (dictionaryBytes + packedBytes(m_size, indexBits) <= best)
+		{
+			best = dictionaryBytes + packedBytes(m_size, indexBits);
+			column.encoding = en_dictionary;
+		}
+		if (dictionaryBytes + MultiMap::allocationSize(runs * sizeof(unsigned short)) + packedBytes(runs, indexBits) < best)
+		{
+			best = dictionaryBytes + MultiMap::allocationSize(runs * sizeof(unsigned short)) + packedBytes(runs, indexBits);
+			column.encoding = en_runs;
+		}
+		if (integers && m_size > 0 && packedBytes(m_size, bitsFor(largest - smallest)) < best)
+			column.encoding = en_integers;
+
+		// Then encode them the chosen way
+		column.bits = 0;
+		column.base = 0;
+		switch (column.encoding)
+		{
+		case en_integers:
+			column.base = smallest;
+			column.bits = bitsFor(largest - smallest);
+			for (int i = 0; i < m_size; ++i)
+				indexes[i] = strtoull(values[i]->c_str(), nullptr, 10) - smallest;
+			pack(indexes, column.bits, column.packed);
+			break;
+		case en_runs:
+			for (int i = 0, run = 0; i < m_size; ++i)
+			{
+				if (i + 1 < m_size && indexes[i + 1] == indexes[i])
+					continue;
+				column.runEnds.push_back(i + 1);
+				indexes[run++] = indexes[i];
+			}
+			indexes.resize(runs);
+			// then pack the runs' indexes, as for a dictionary
+			[[fallthrough]];
+		case en_dictionary:
+		{
+			column.bits = indexBits;
+			vector<const string*> dictionary(distinct.size());
+			for (auto it = distinct.begin(); it != distinct.end(); ++it)
+				dictionary[it->second] = &it->first;
+			column.bytes.reserve(distinctLength);
+			column.starts.reserve(dictionary.size() + 1);
+			for (int d = 0; d < dictionary.size(); ++d)
+			{
+				column.starts.push_back(column.bytes.size());
+				column.bytes += *dictionary[d];
+			}
+			column.starts.push_back(column.bytes.size());
+			pack(indexes, column.bits, column.packed);
+			indexes.resize(m_size);
+			break;
+		}
+		case en_plain:
+			column.bytes.reserve(length);
+			column.starts.reserve(m_size + 1);
+			for (int i = 0; i < m_size; ++i)
+			{
+				column.starts.push_back(column.bytes.size());
+				column.bytes += *values[i];
+			}
+			column.starts.push_back(column.bytes.size());
+			break;
+		}
+
+		column.allocated = MultiMap::allocationSize(column.packed.capacity() * sizeof(unsigned long long))
+			+ MultiMap::allocationSize(column.runEnds.capacity() * sizeof(unsigned short))
+			+ MultiMap::stringHeapSize(column.bytes.capacity())
+			+ MultiMap::allocationSize(column.starts.capacity() * sizeof(unsigned int));
+	}
+}
+
+int CompressedBlock::size() const
+{
+	return m_size;
+}
+
+// Decompresses row i.
+void CompressedBlock::getRow(int i, vector<string>& row) const
+{
+	row.resize(m_columns.size());
+	for (int f = 0; f < m_columns.size(); ++f)
+		decompress(i, f, row[f]);
+}
+
+// Returns row i's value of a field, decompressed into one of a few buffers per thread, so the
+// reference stays valid until this thread has read three more values (from any block).
+const string& CompressedBlock::value(int i, int field) const
+{
+	const int BUFFERS = 4;
+	thread_local string buffers[BUFFERS];
+	thread_local int next = 0;
+	string& buffer = buffers[next];
+	next = (next + 1) % BUFFERS;
+	decompress(i, field, buffer);
+	return buffer;
+}
+
+// Sets value to row i's value of a field.
+void CompressedBlock::decompress(int i, int field, string& value) const
+{
+	const Column& column = m_columns[field];
+	if (column.encoding == en_integers)
+	{
+		char digits[24];
+		char* end = digits + sizeof(digits), * p = end;
+		unsigned long long n = column.base + unpack(column.packed, column.bits, i);
+		do
+			*--p = '0' + n % 10;
+		while (n /= 10);
+		value.assign(p, end);
+		return;
+	}
+
+	int entry = i;
+	if (column.encoding == en_dictionary)
+		entry = unpack(column.packed, column.bits, i);
+	else if (column.encoding == en_runs)
+	{
+		int run = upper_bound(column.runEnds.begin(), column.runEnds.end(), i) - column.runEnds.begin();
+		entry = unpack(column.packed, column.bits, run);
+	}
+	value.assign(column.bytes, column.starts[entry], column.starts[entry + 1] - column.starts[entry]);
+}
+
+// Clears selected[i] for every row i whose value of a field fails the test. Returns false,
+// doing nothing, unless the field is dictionary (or run) coded.
+// --- The test runs once per distinct value rather than once per row, and the rows are then
+// filtered by their indexes alone, or a whole run at a time, without touching their values.
+bool CompressedBlock::filter(int field, const function<bool(const string&)>& test,
+	unsigned char* selected) const
+{
+	const Column& column = m_columns[field];
+	if (column.encoding != en_dictionary && column.encoding != en_runs)
+		return false;
+	vector<unsigned char> passes(column.starts.size() - 1);
+	string value;
+	for (int d = 0; d < passes.size(); ++d)
+	{
+		value.assign(column.bytes, column.starts[d], column.starts[d + 1] - column.starts[d]);
+		passes[d] = test(value);
+	}
+
+	if (column.encoding == en_runs)
+	{
+		for (int r = 0, begin = 0; r < column.runEnds.size(); begin = column.runEnds[r++])
+			if (!passes[unpack(column.packed, column.bits, r)])
+				memset(selected + begin, 0, column.runEnds[r] - begin);
+		return true;
+	}
+	for (int i = 0; i < m_size; ++i)
+		selected[i] &= passes[unpack(column.packed, column.bits, i)];
+	return true;
+}
+
+// Returns the bytes we have allocated, including the block itself (as allocated by new).
+size_t CompressedBlock::bytes() const
+{
+	size_t bytes = MultiMap::allocationSize(sizeof(CompressedBlock))
+		+ MultiMap::allocationSize(m_columns.capacity() * sizeof(Column));
+	for (int f = 0; f < m_columns.size(); ++f)
+		bytes += m_columns[f].allocated;
+	return bytes;
+}
+
+// Returns the bytes allocated for a field's values (not counting its share of bytes' others).
+size_t CompressedBlock::fieldBytes(int field) const
+{
+	return m_columns[field].allocated;
+}
+
+
+/////////////////////////////
+// CompressedBlock Helper Functions
+/////////////////////////////
+
+// Returns true if value is a non-negative integer below 10^18 written without leading zeros,
+// so that it is written the same way again after being read as a number.
+bool CompressedBlock::isInteger(const string& value)
+{
+	if (value.empty() || value.size() > 18 || (value[0] == '0' && value.size() > 1))
+		return false;
+	for (size_t i = 0; i < value.size(); ++i)
+		if (value[i] < '0' || value[i] > '9')
+			return false;
+	return true;
+}
+
+// Returns the # of bits needed to write every number from 0 to largest.
+int CompressedBlock::bitsFor(unsigned long long largest)
+{
+	int bits = 0;
+	for (; largest > 0; largest >>= 1)
+		++bits;
+	return bits;
+}
+
+// Packs each number into bits bits, one after another, low bits first; a number may straddle
+// two words.
+void CompressedBlock::pack(const vector<unsigned long long>& numbers, int bits,
+	vector<unsigned long long>& packed)
+{
+	packed.assign((numbers.size() * bits + 63) / 64, 0);
+	if (bits == 0)
+		return;
+	for (size_t i = 0; i < numbers.size(); ++i)
+	{
+		size_t bit = i * bits, word = bit / 64;
+		int shift = bit % 64;
+		packed[word] |= numbers[i] << shift;
+		if (shift + bits > 64)
+			packed[word + 1] |= numbers[i] >> (64 - shift);
+	}
+}
+
+unsigned long long CompressedBlock::unpack(const vector<unsigned long long>& packed, int bits, int i)
+{
+	if (bits == 0)
+		return 0;
+	size_t bit = (size_t)i * bits, word = bit / 64;
+	int shift = bit % 64;
+	unsigned long long n = packed[word] >> shift;
+	if (shift + bits > 64)
+		n |= packed[word + 1] << (64 - shift);
+	return bits == 64 ? n : n & ((1ULL << bits) - 1);
+}
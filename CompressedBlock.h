@@ -0,0 +1,58 @@
+// A sealed block of rows, stored a column at a time, each column compressed in whichever of a
+// few lightweight ways takes the fewest bytes for its values:
+//   integers    non-negative integers without leading zeros, as their offsets from the
+//               smallest, each packed into as few bits as the largest needs (frame of reference)
+//   dictionary  each distinct value once, and each row's index into them, bit-packed
+//   runs        as dictionary, but one index per run of equal values (run-length encoding)
+//   plain       the values' bytes end to end, and where each one starts
+// Values come back exactly as they went in. A block never changes once built: to change one
+// of its rows, build a new block.
+
+#ifndef COMPRESSEDBLOCK_H
+#define COMPRESSEDBLOCK_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+class CompressedBlock
+{
+public:
+	CompressedBlock(const std::vector<std::vector<std::string> >& rows, int begin, int end, // O(NF)
+		int numFields);
+	int size() const;							// O(1)
+	void getRow(int i, std::vector<std::string>& row) const;		// O(F)
+	const std::string& value(int i, int field) const;			// O(L), O(L + log R) for runs
+	bool filter(int field, const std::function<bool(const std::string&)>& test, // O(D + N) (D = # distinct values)
+		unsigned char* selected) const;
+	size_t bytes() const;							// O(F)
+	size_t fieldBytes(int field) const;					// O(1)
+
+private:
+	enum Encoding { en_integers, en_dictionary, en_runs, en_plain };
+
+	struct Column
+	{
+		Encoding encoding;
+		int bits;				// per packed number
+		unsigned long long base;		// the smallest integer
+		std::vector<unsigned long long> packed;	// integers' offsets, or dictionary indexes
+		std::vector<unsigned short> runEnds;	// the row after each run
+		std::string bytes;			// the dictionary's values (or each row's, if plain), end to end
+		std::vector<unsigned int> starts;	// where each of them starts, and where the last ends
+		size_t allocated;			// by all of the above
+	};
+
+	int m_size;
+	std::vector<Column> m_columns;
+
+private:
+	void decompress(int i, int field, std::string& value) const;
+	static bool isInteger(const std::string& value);
+	static int bitsFor(unsigned long long largest);
+	static void pack(const std::vector<unsigned long long>& numbers, int bits,
+		std::vector<unsigned long long>& packed);
+	static unsigned long long unpack(const std::vector<unsigned long long>& packed, int bits, int i);
+};
+
+#endif // COMPRESSEDBLOCK_H
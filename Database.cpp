@@ -1,10 +1,19 @@
 #include "Database.h"
 #include "MultiMap.h"
+#include "HashIndex.h"
+#include "Metrics.h"
+#include "RowStore.h"
+#include "CompressedBlock.h"
 #include "http.h"
 #include <iostream> // needed for any I/O
 #include <fstream>  // needed in addition to <iostream> for file I/O
 #include <sstream>  // needed in addition to <iostream> for string stream I/O
-#include <unordered_set>
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 using namespace std;
 
 /////////////////////////////
@@ -14,32 +23,92 @@ using namespace std;
 Database::Database()
 {
 	m_fieldIndex = nullptr;
+	m_hashIndex = nullptr;
+	m_cacheCapacity = m_cacheBytes = 0;
+	m_cacheHits = m_cacheMisses = 0;
+	m_blocksSkipped = 0;
+	m_memoryBudget = m_rowBytes = 0;
+	m_schemaVersion = 0;
+	m_numDeleted = 0;
+	m_rowsVersion = 0;
+	m_adaptiveScans = ADAPTIVE_SCANS;
+	m_stats = nullptr;
+	m_store = nullptr;
+	m_storeCache = 0;
+	m_compressed = false;
+	m_loading = m_loadCancelled = false;
+	m_loadBytes = m_loadTotalBytes = 0;
+	m_loadRows = 0;
 }
 
 Database::~Database()
 {
+	cancelLoad();
 	clearFieldIndex();
+	delete m_store;
+	for (int i = 0; i < m_blocks.size(); ++i)
+		delete m_blocks[i];
 }
 
 // Runs through the new schema, creates an index for each indexable field, and assigns
 // the schema. Returns false if there are no indexable fields, otherwise true.
 bool Database::specifySchema(const vector<FieldDescriptor>& schema)
 {
+	return specifySchema(schema, vector<vector<string> >());
+}
+
+// Same as above, but also creates a composite index over each listed tuple of field names,
+// which orders rows by the first field, then the second, and so on. A composite index can
+// answer criteria on any leading prefix of its fields with a single range walk. Returns false
+// if a composite names fewer than two fields or a field that isn't in the schema, or if
+// there are no indexable fields nor composites.
+bool Database::specifySchema(const vector<FieldDescriptor>& schema,
+	const vector<vector<string> >& compositeIndexes)
+{
+	lock_guard<recursive_mutex> loaderLock(m_loaderLock); // so no load starts once cancelled
+	cancelLoad(); // its rows would not fit the new schema
+	lock_guard<recursive_mutex> lock(m_lock);
 	clearAll();
+	m_schemaVersion++; // invalidates every PreparedQuery
 
 	for (int i = 0; i < schema.size(); ++i)
 	{
-		if (schema[i].index == it_indexed)
+		if (schema[i].index == it_indexed || schema[i].index == it_both)
 		{
 			if (!m_fieldIndex)
 				m_fieldIndex = new MultiMap*[schema.size()]();
 			m_fieldIndex[i] = new MultiMap;
 		}
+		if (schema[i].index == it_hashed || schema[i].index == it_both)
+		{
+			if (!m_hashIndex)
+				m_hashIndex = new HashIndex*[schema.size()]();
+			m_hashIndex[i] = new HashIndex;
+		}
 	}
-	if (!m_fieldIndex) // no indexable field
-		return false;
-
 	m_schema = schema;
+	m_fieldScans.assign(schema.size(), 0);
+	resetColumns();
+
+	for (int i = 0; i < compositeIndexes.size(); ++i)
+	{
+		CompositeIndex composite;
+		for (int j = 0; j < compositeIndexes[i].size(); ++j)
+			composite.fields.push_back(fieldNumber(compositeIndexes[i][j]));
+		if (composite.fields.size() < 2 || find(composite.fields.begin(), composite.fields.end(), -1) != composite.fields.end())
+		{
+			clearAll();
+			return false;
+		}
+		composite.index = new MultiMap(MultiMap::compareComposite);
+		m_composites.push_back(composite);
+	}
+
+	if (!m_fieldIndex && !m_hashIndex && m_composites.empty()) // no indexable field
+	{
+		clearAll();
+		return false;
+	}
 	return true;
 }
 
@@ -49,17 +118,220 @@ bool Database::specifySchema(const vector<FieldDescriptor>& schema)
 // Otherwise returns true.
 bool Database::addRow(const vector<string>& rowOfData)
 {
+	lock_guard<recursive_mutex> lock(m_lock);
 	if (m_schema.empty() || m_schema.size() != rowOfData.size())
 		return false;
+	if (m_memoryBudget > 0 && memoryUsed() + rowCost(rowOfData) > m_memoryBudget)
+		return false;
 
 	m_rows.push_back(rowOfData);
-	for (int i = 0; i < rowOfData.size(); ++i)
-		if (m_schema[i].index == it_indexed) // i-th field of rowOfData is indexed
-			m_fieldIndex[i]->insert(rowOfData[i], m_rows.size() - 1);
+	m_rowBytes += rowBytes(m_rows.back());
+	m_deleted.push_back(false);
+	indexRow(m_rows.size() - 1, true);
+	updateColumns(m_rows.size() - 1);
+	cachePatch(m_rows.size() - 1);
+	spillRows();
+	sealBlocks();
+
+	return true;
+}
+
+// Adds a batch of rows, taking ownership of their contents (rows is left empty). Row storage
+// is grown once, and each index receives all of its new keys in one sorted batch rather than
+// one tree walk per row. Returns false, adding nothing, if the schema is empty or any row does
+// not match the # of fields in the schema. Otherwise returns true.
+// --- Cached results are dropped rather than patched row by row.
+bool Database::addRows(vector<vector<string> >&& rows)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	if (m_schema.empty())
+		return false;
+	for (int i = 0; i < rows.size(); ++i)
+		if (rows[i].size() != m_schema.size())
+			return false;
+	if (m_memoryBudget > 0)
+	{
+		size_t cost = 0;
+		for (int i = 0; i < rows.size(); ++i)
+			cost += rowCost(rows[i]);
+		if (memoryUsed() + cost > m_memoryBudget)
+			return false;
+	}
+
+	int firstRow = m_rows.size();
+	m_rows.reserve(firstRow + rows.size());
+	for (int i = 0; i < rows.size(); ++i)
+	{
+		m_rowBytes += rowBytes(rows[i]);
+		m_rows.push_back(std::move(rows[i]));
+	}
+	m_deleted.resize(m_rows.size(), false);
+	rows.clear();
+
+	vector<pair<string, unsigned int> > entries;
+	for (int j = 0; j < m_schema.size(); ++j)
+	{
+		if (hashIndex(j))
+			for (int i = firstRow; i < m_rows.size(); ++i)
+				m_hashIndex[j]->insert(m_rows[i][j], i);
+		if (!treeIndex(j))
+			continue;
+		entries.clear();
+		entries.reserve(m_rows.size() - firstRow);
+		for (int i = firstRow; i < m_rows.size(); ++i)
+			entries.push_back(make_pair(m_rows[i][j], (unsigned int)i));
+		m_fieldIndex[j]->insertAll(entries);
+	}
+	for (int j = 0; j < m_composites.size(); ++j)
+	{
+		entries.clear();
+		entries.reserve(m_rows.size() - firstRow);
+		for (int i = firstRow; i < m_rows.size(); ++i)
+			entries.push_back(make_pair(compositeKey(m_composites[j], m_rows[i]), (unsigned int)i));
+		m_composites[j].index->insertAll(entries);
+	}
+	for (int i = firstRow; i < m_rows.size(); ++i)
+		updateColumns(i);
+	if (m_rows.size() > firstRow)
+		clearCache();
+	spillRows();
+	sealBlocks();
+
+	return true;
+}
+
+// Deletes a row: its values are removed from every index and cached result, and its storage
+// freed, but it leaves a tombstone behind, so that every other row keeps its #. Returns false
+// if there is no such row (or it has already been deleted).
+bool Database::deleteRow(int rowNum)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	if (rowNum < 0 || rowNum >= m_rows.size() || m_deleted[rowNum])
+		return false;
+
+	indexRow(rowNum, false);
+	cacheRemove(rowNum);
+	if (m_store && rowNum < m_store->size())
+		m_store->erase(rowNum);
+	m_rowBytes -= rowBytes(m_rows[rowNum]);
+	vector<string>().swap(m_rows[rowNum]);
+	m_deleted[rowNum] = true;
+	m_numDeleted++;
+	m_rowsVersion++;
+	return true;
+}
+
+// Replaces a row's values, moving its entries in every index and cached result to match, and
+// keeping its #. Returns false if there is no such row, or the new row of data does not match
+// the # of fields in the schema, or the row is kept on disk and can't be written.
+bool Database::updateRow(int rowNum, const vector<string>& rowOfData)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	if (rowNum < 0 || rowNum >= m_rows.size() || m_deleted[rowNum] || rowOfData.size() != m_schema.size())
+		return false;
+	if (m_memoryBudget > 0 && memoryUsed() + rowCost(rowOfData) > m_memoryBudget)
+		return false;
 
+	indexRow(rowNum, false);
+	cacheRemove(rowNum);
+	if (m_store && rowNum < m_store->size())
+	{
+		if (!m_store->replace(rowNum, rowOfData))
+		{
+			indexRow(rowNum, true); // the old row is still there
+			cachePatch(rowNum);
+			return false;
+		}
+	}
+	else
+	{
+		int block = rowNum / SCAN_BLOCK;
+		bool sealed = block < m_blocks.size() && m_blocks[block];
+		if (sealed)
+			unsealBlock(block);
+		m_rowBytes -= rowBytes(m_rows[rowNum]);
+		m_rows[rowNum] = rowOfData;
+		m_rowBytes += rowBytes(m_rows[rowNum]);
+		if (sealed)
+			sealBlock(block);
+	}
+	indexRow(rowNum, true);
+	updateColumns(rowNum);
+	cachePatch(rowNum);
+	m_rowsVersion++;
 	return true;
 }
 
+// Reclaims the space left by deleted rows: the remaining rows are renumbered in order, closing
+// the gaps, and every index is rebuilt over the new row #s. Row #s from earlier searches, and
+// open cursors, are no longer valid afterwards.
+// --- Rebuilding from scratch is a single sorted, balanced build per index (see addRows), which
+// is cheaper than erasing and reinserting every row whose # changes, and undoes any imbalance
+// left by the deletions. Rows kept on disk are instead copied to a new file beside the old one
+// (the file name with ".compact" added, or back again), and compressed rows into new blocks,
+// LOAD_CHUNK rows at a time, so that they never all have to be in memory at once.
+void Database::compact()
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	if (m_numDeleted == 0)
+		return;
+
+	vector<vector<string> > oldRows;
+	vector<bool> deleted;
+	vector<CompressedBlock*> blocks;
+	oldRows.swap(m_rows);
+	deleted.swap(m_deleted);
+	blocks.swap(m_blocks);
+	RowStore* oldStore = m_store;
+	m_store = nullptr;
+	if (oldStore)
+	{
+		m_store = new RowStore;
+		if (!m_store->open(oldStore->filename() == m_storeFile ? m_storeFile + ".compact" : m_storeFile, m_storeCache))
+		{
+			delete m_store; // so the rows come back into memory
+			m_store = nullptr;
+		}
+	}
+	clearRows();
+
+	for (int i = 0; i < m_schema.size(); ++i)
+	{
+		if (treeIndex(i))
+			m_fieldIndex[i]->clear();
+		if (hashIndex(i))
+			m_hashIndex[i]->clear();
+	}
+	for (int i = 0; i < m_composites.size(); ++i)
+		m_composites[i].index->clear();
+	resetColumns();
+	m_rowsVersion++;
+	size_t budget = m_memoryBudget;
+	m_memoryBudget = 0; // these rows were all here already, so they must go back
+	vector<vector<string> > rows;
+	for (int i = 0; i < oldRows.size(); ++i)
+	{
+		if (deleted[i])
+			continue;
+		if (oldStore && i < oldStore->size())
+			rows.push_back(oldStore->get(i));
+		else if (i / SCAN_BLOCK < blocks.size() && blocks[i / SCAN_BLOCK])
+		{
+			rows.push_back(vector<string>());
+			blocks[i / SCAN_BLOCK]->getRow(i % SCAN_BLOCK, rows.back());
+		}
+		else
+			rows.push_back(std::move(oldRows[i]));
+		if ((m_store || m_compressed) && rows.size() == LOAD_CHUNK)
+			addRows(std::move(rows));
+	}
+	addRows(std::move(rows));
+	m_memoryBudget = budget;
+	delete oldStore;
+	for (int i = 0; i < blocks.size(); ++i)
+		delete blocks[i];
+}
+
 // Copies the contents of the URL to a string (using the HTTP class). The 1st line should contain
 // the schema, and subsequent lines should contain the rows of data. Assigns the new schema, adds
 // all the new rows of data, and adds new index entries where appropriate.
@@ -71,42 +343,8 @@ bool Database::loadFromURL(string url)
 	if (!HTTP().get(url, page))
 		return false;
 
-	// Check 1st line for proper schema
 	istringstream iss(page);
-	vector<FieldDescriptor> schema;
-	string line, word;
-	getline(iss, line);
-	istringstream iss1(line);
-	while (getline(iss1, word, ',')) // splitting by commas
-	{
-		FieldDescriptor temp;
-		if (word.back() == '*')
-		{
-			temp.index = it_indexed;
-			word.pop_back();
-		}
-		else
-			temp.index = it_none;
-		temp.name = word;
-		schema.push_back(temp);
-	}
-	if (!specifySchema(schema)) // no indexed fields
-		return false;
-
-	// Process the rest of the lines
-	vector<string> row;
-	while (getline(iss, line))
-	{
-		row.clear();
-		istringstream issLine(line);
-		while (getline(issLine, word, ','))
-			row.push_back(word);
-		if (row.size() != m_schema.size()) // num data fields in row != schema
-			return false;
-		addRow(row); // add current row to m_rows (and m_fieldIndex if needed)
-	}
-
-	return true;
+	return loadFromStream(iss);
 }
 
 // Copies the contents of the file to a string. The 1st line should contain the schema, and 
@@ -114,191 +352,2116 @@ bool Database::loadFromURL(string url)
 // rows of data, and adds new index entries where appropriate.
 // Returns false if URL fails to load, if schema has no indexable fields, or if the # of fields on
 // a row does not match the # of fields in the schema. Otherwise, returns true.
+// --- Once rows are kept on disk, the file is loaded a chunk at a time, as in the background,
+// so that its rows never all have to be in memory at once.
 bool Database::loadFromFile(string filename)
 {
+	bool stored;
+	{
+		lock_guard<recursive_mutex> lock(m_lock);
+		stored = m_store != nullptr;
+	}
+	if (stored)
+		return loadFromFileAsync(filename).get();
+
 	ifstream inf(filename);
 	if (!inf)
 		return false;
 
-	// Check 1st line for proper schema
-	vector<FieldDescriptor> schema;
-	string line, word;
-	getline(inf, line);
-	istringstream iss1(line);
-	while (getline(iss1, word, ',')) // splitting by commas
+	return loadFromStream(inf);
+}
+
+// Adds the rows of the page at the URL to those already loaded. Its 1st line must name the same
+// fields as our schema (any index markers are ignored, since the schema already decides what is
+// indexed), unless there is no schema yet, in which case it becomes the schema as in
+// loadFromURL. Returns false, adding nothing, if the URL fails to load, if the header does not
+// match, or if the # of fields on a row does not match the # of fields in the schema.
+bool Database::appendFromURL(string url)
+{
+	return appendFromSources(vector<string>(1, url), true);
+}
+
+// Same as above, but for a file.
+bool Database::appendFromFile(string filename)
+{
+	return appendFromSources(vector<string>(1, filename), false);
+}
+
+// Adds the rows of every page, in the order listed, as if by appendFromURL. Returns false,
+// adding nothing, if any page fails to load or doesn't match (see appendFromSources).
+bool Database::appendFromURLs(const vector<string>& urls)
+{
+	return appendFromSources(urls, true);
+}
+
+// Adds the rows of every file, in the order listed, as if by appendFromFile. Returns false,
+// adding nothing, if any file fails to load or doesn't match (see appendFromSources).
+bool Database::appendFromFiles(const vector<string>& filenames)
+{
+	return appendFromSources(filenames, false);
+}
+
+// Loads a file like loadFromFile, but returns as soon as its schema has been read, and adds its
+// rows in the background, LOAD_CHUNK rows at a time. Rows are searchable as soon as their chunk
+// has been added. The future becomes true once every row has been added, or false if the file
+// can't be opened, its schema is invalid, a row doesn't match the schema, or the load is
+// cancelled (the rows added by then stay). Only one load runs at a time: this cancels any
+// other, as do specifySchema and every other load.
+// --- Each chunk is read and parsed without the lock, so queries only ever wait for a chunk to
+// be indexed, never for I/O.
+future<bool> Database::loadFromFileAsync(string filename)
+{
+	lock_guard<recursive_mutex> loaderLock(m_loaderLock);
+	cancelLoad();
+	promise<bool> result;
+	future<bool> done = result.get_future();
+
+	ifstream in(filename);
+	string header;
+	ParsedSource parsed;
+	if (!in || !getline(in, header))
 	{
-		FieldDescriptor temp;
-		if (word.back() == '*')
-		{
-			temp.index = it_indexed;
-			word.pop_back();
-		}
-		else
-			temp.index = it_none;
-		temp.name = word;
-		schema.push_back(temp);
+		result.set_value(false);
+		return done;
 	}
-	if (!specifySchema(schema)) // no indexed fields
-		return false;
-	
-	// Process the rest of the lines
-	vector<string> row;
-	while (getline(inf, line))
-	{
-		row.clear();
-		istringstream issLine(line);
-		while (getline(issLine, word, ','))
-			row.push_back(word);
-		if (row.size() != m_schema.size()) // num data fields in row != schema
-			return false;
-		addRow(row); // add current row to m_rows (and m_fieldIndex if needed)
+	istringstream iss(header);
+	lock_guard<recursive_mutex> lock(m_lock);
+	if (!parseStream(iss, parsed) || !specifySchema(parsed.schema, parsed.composites))
+	{
+		result.set_value(false);
+		return done;
 	}
 
-	return true;
+	m_loading = true; // before the counters, which getLoadProgress (holding m_lock) reads together
+	m_loadCancelled = false;
+	m_loadTotalBytes = ifstream(filename, ios::binary | ios::ate).tellg();
+	m_loadBytes = header.size() + 1;
+	m_loadRows = 0;
+	m_loader = thread([this](ifstream in, promise<bool> result) { loadInBackground(in, result); },
+		std::move(in), std::move(result));
+	return done;
 }
 
+// Returns how far the current (or last) background load has got. The loader only updates its
+// progress while holding the lock, so the counts always agree with each other and with done.
+Database::LoadProgress Database::getLoadProgress() const
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	LoadProgress progress;
+	progress.bytesParsed = m_loadBytes;
+	progress.totalBytes = m_loadTotalBytes;
+	progress.rowsIndexed = m_loadRows;
+	progress.done = !m_loading;
+	return progress;
+}
+
+// Stops a background load after the chunk it is adding, and waits for it to stop.
+// --- The loader takes m_lock for each chunk, so this must never be called with m_lock held
+// unless the load was already cancelled (with m_loaderLock held since, so none can start).
+void Database::cancelLoad()
+{
+	lock_guard<recursive_mutex> loaderLock(m_loaderLock);
+	if (!m_loader.joinable())
+		return;
+	m_loadCancelled = true;
+	m_loader.join();
+}
+
+// Returns the # of row #s in use, which counts deleted rows until the next compact.
 int Database::getNumRows() const
 {
+	lock_guard<recursive_mutex> lock(m_lock);
 	return m_rows.size();
 }
 
+// Returns false if there is no such row, or it has been deleted.
 bool Database::getRow(int rowNum, vector<string>& row) const
 {
-	if (rowNum < 0 || rowNum > getNumRows())
+	lock_guard<recursive_mutex> lock(m_lock);
+	if (rowNum < 0 || rowNum >= getNumRows() || m_deleted[rowNum])
 		return false;
 
-	row = m_rows[rowNum];
+	int block = rowNum / SCAN_BLOCK;
+	if (block < m_blocks.size() && m_blocks[block])
+		m_blocks[block]->getRow(rowNum % SCAN_BLOCK, row);
+	else
+		row = this->row(rowNum);
 	return true;
 }
 
 int Database::search(const vector<SearchCriterion>& searchCriteria,
 	const vector<SortCriterion>& sortCriteria, vector<int>& results)
 {
+	lock_guard<recursive_mutex> lock(m_lock);
 	results.clear();
-	if (searchCriteria.empty()) // no search criteria
-		return ERROR_RESULT;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	Metrics::add(Metrics::db_searches);
 
-	// Search
-	//	The result of our query is the intersection of all search criteria. To do this, 
-	//	for each search criteria, we plug our results into the unordered_set cur_query.
-	//	For each subsequent search criteria, we replace prev_query with cur_query, clear
-	//	cur_query, then check if each new value exists within prev_query: if it does, we 
-	//	have an intersection, and we enter the value into cur_query.
-	unordered_set<int> cur_query, prev_query;
-	for (int i = 0; i < searchCriteria.size(); ++i)
+	// Cache lookup
+	string key;
+	if (m_cacheCapacity > 0)
 	{
-		if (searchCriteria[i].minValue == "" && searchCriteria[i].maxValue == "")
-			return ERROR_RESULT; // lacks both min AND max values
-
-		// Find fieldName within m_schema
-		prev_query = cur_query;
-		cur_query.clear();
-		int j = 0;
-		for (; j < m_schema.size(); ++j)
+		key = cacheKey(searchCriteria, sortCriteria);
+		if (cacheLookup(key, results))
 		{
-			if (searchCriteria[i].fieldName == m_schema[j].name)
+			if (m_stats)
 			{
-				if (m_schema[j].index == it_none) // field name is non-indexed
-					return ERROR_RESULT;
-
-				// Find all rows between minValue and maxValue, inclusive.
-				// If minValue or maxValue is empty, min and max iterators will be set to the
-				// smallest and largest nodes, respectively.
-				MultiMap::Iterator min = m_fieldIndex[j]->findEqualOrSuccessor(searchCriteria[i].minValue),
-					max = m_fieldIndex[j]->findEqualOrPredecessor(searchCriteria[i].maxValue);
-				for (; min.valid(); min.next())
-				{
-					bool add = true;
-					if (i > 0) // only check the previous query if this is not our first
-					{
-						unordered_set<int>::const_iterator found = prev_query.find(min.getValue());
-						if (found == prev_query.end()) // not found, so no intersection
-							add = false;
-					}
-					if (add)
-						cur_query.insert(min.getValue()); // inserts row # to current unordered_set
-					if (min.getKey() == max.getKey() && min.getValue() == max.getValue())
-						break;
-				}
-				break;
+				m_stats->cacheHit = true;
+				m_stats->results = results.size();
 			}
+			return results.size();
 		}
-		if (j == m_schema.size()) // no fieldName match found
-			return ERROR_RESULT;
 	}
-	
-	// Sort
-	for (auto it = cur_query.begin(); it != cur_query.end(); ++it)
-		results.push_back(*it);
-	if (!sortCriteria.empty())
-		quicksort(results, 0, cur_query.size(), sortCriteria);
 
-	return cur_query.size();
+	PreparedQuery query;
+	if (!prepare(searchCriteria, sortCriteria, query))
+		return ERROR_RESULT;
+	if (m_stats)
+	{
+		m_stats->planSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		describe(query, *m_stats);
+	}
+	int numResults = search(query, results);
+	if (m_cacheCapacity > 0 && numResults != ERROR_RESULT)
+		cacheStore(key, query, results);
+
+	return numResults;
+}
+
+// Same as above, but also reports in stats how the search was run (see QueryStats).
+// --- m_stats is only set for the duration of this search, and every counter is behind a
+// check of it, so that searches nobody asked about cost no more than a predictable branch.
+int Database::search(const vector<SearchCriterion>& searchCriteria,
+	const vector<SortCriterion>& sortCriteria, vector<int>& results, QueryStats& stats)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	stats = QueryStats();
+	m_stats = &stats;
+	int numResults = search(searchCriteria, sortCriteria, results);
+	m_stats = nullptr;
+	return numResults;
 }
 
+// Returns the rows matching any one of the alternatives, each a list of search criteria that
+// must all hold (as in the search above), sorted by the sort criteria. Without sort criteria,
+// rows come in row # order, unless there is just one alternative, which is simply searched as
+// above. Returns ERROR_RESULT if there are no alternatives, or if any one of them is invalid
+// (see prepare).
+// --- Each alternative is planned and run on its own, so each walks only its own driving range,
+// once. Their row #s are then sorted and unioned pairwise, halving the # of lists each round,
+// which removes the duplicates that more than one alternative matches.
+int Database::search(const vector<vector<SearchCriterion> >& anyOf,
+	const vector<SortCriterion>& sortCriteria, vector<int>& results)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	results.clear();
+	if (anyOf.size() == 1)
+		return search(anyOf[0], sortCriteria, results);
+	Metrics::add(Metrics::db_searches);
 
-/////////////////////////////
-// Database Helper Functions
-/////////////////////////////
+	vector<PreparedQuery> queries(anyOf.size());
+	for (int i = 0; i < anyOf.size(); ++i)
+		if (!prepare(anyOf[i], vector<SortCriterion>(), queries[i]))
+			return ERROR_RESULT;
+	if (queries.empty())
+		return ERROR_RESULT;
 
-void Database::clearAll()
+	vector<vector<int> > lists(queries.size());
+	for (int i = 0; i < queries.size(); ++i)
+	{
+		search(queries[i], lists[i]);
+		sort(lists[i].begin(), lists[i].end());
+	}
+	while (lists.size() > 1)
+	{
+		vector<vector<int> > merged((lists.size() + 1) / 2);
+		for (int i = 0; i + 1 < lists.size(); i += 2)
+			set_union(lists[i].begin(), lists[i].end(), lists[i + 1].begin(), lists[i + 1].end(), back_inserter(merged[i / 2]));
+		if (lists.size() % 2 == 1)
+			merged.back().swap(lists.back());
+		lists.swap(merged);
+	}
+	results.swap(lists[0]);
+
+	vector<PreparedQuery::SortKey> sortKeys;
+	resolveSortKeys(sortCriteria, sortKeys);
+	if (!sortKeys.empty())
+		quicksort(results, 0, results.size(), sortKeys);
+	return results.size();
+}
+
+// Runs many searches at once: sets results[i] to the rows that search would return for
+// queries[i] and sortCriteria[i] (sortCriteria may also be empty, leaving every query
+// unsorted), in the same order. Returns false, with no results, if any query is invalid (see
+// prepare), or if there are sort criteria for some queries but not all.
+// --- Queries driven by ranges of the same index are run together (see runTogether), so that
+// where their ranges overlap, the index is walked once rather than once per query; so are
+// equalities on the same hash key. Identical queries are run once. The walks, and then the
+// sorts, are spread over as many threads as the hardware offers: they only read, and our lock
+// keeps everything they read still until they are done.
+bool Database::searchBatch(const vector<vector<SearchCriterion> >& queries,
+	const vector<vector<SortCriterion> >& sortCriteria, vector<vector<int> >& results)
 {
-	clearSchema();
-	clearRows();
-	clearFieldIndex();
+	lock_guard<recursive_mutex> lock(m_lock);
+	results.assign(queries.size(), vector<int>());
+	if (!sortCriteria.empty() && sortCriteria.size() != queries.size())
+		return false;
+	Metrics::add(Metrics::db_searches, queries.size());
+
+	// Find each query's first duplicate, and prepare the rest unless the cache has them
+	const vector<SortCriterion> unsorted;
+	vector<PreparedQuery> prepared(queries.size());
+	vector<string> keys(queries.size());
+	vector<int> original(queries.size()); // the first query identical to each query
+	vector<int> pending;	// the queries to run
+	unordered_map<string, int> seen;
+	for (int i = 0; i < queries.size(); ++i)
+	{
+		const vector<SortCriterion>& sorts = sortCriteria.empty() ? unsorted : sortCriteria[i];
+		keys[i] = cacheKey(queries[i], sorts);
+		original[i] = seen.insert(make_pair(keys[i], i)).first->second;
+		if (original[i] != i || (m_cacheCapacity > 0 && cacheLookup(keys[i], results[i])))
+			continue;
+		if (!prepare(queries[i], sorts, prepared[i]))
+		{
+			results.assign(queries.size(), vector<int>());
+			return false;
+		}
+		pending.push_back(i);
+	}
+	Metrics::add(Metrics::db_queries, pending.size());
+
+	// Group the queries by what drives them: an index range, a hash key, or a scan of their own
+	unordered_map<string, vector<int> > groups;
+	for (int i = 0; i < pending.size(); ++i)
+	{
+		const PreparedQuery::Range& driver = prepared[pending[i]].ranges[0];
+		string group = to_string(driver.field) + (driver.scanned ? "s" + to_string(pending[i])
+			: driver.hashed ? "h" + driver.minValue : "t" + to_string(driver.composite));
+		groups[group].push_back(pending[i]);
+	}
+	vector<const vector<int>*> tasks;
+	for (auto it = groups.begin(); it != groups.end(); ++it)
+		tasks.push_back(&it->second);
+	vector<int> blocksSkipped(tasks.size());
+	runInParallel(tasks.size(), [&](int i) { blocksSkipped[i] = runTogether(prepared, *tasks[i], results); });
+	runInParallel(pending.size(), [&](int i) { sortResults(prepared[pending[i]], results[pending[i]]); });
+
+	for (int i = 0; i < tasks.size(); ++i)
+		m_blocksSkipped += blocksSkipped[i];
+	for (int i = 0; i < pending.size(); ++i)
+	{
+		noteScans(prepared[pending[i]]);
+		if (m_cacheCapacity > 0)
+			cacheStore(keys[pending[i]], prepared[pending[i]], results[pending[i]]);
+	}
+	for (int i = 0; i < queries.size(); ++i)
+		if (original[i] != i)
+			results[i] = results[original[i]];
+	return true;
 }
 
-void Database::clearSchema()
+// Resolves every criterion's field name to its position in the schema, and picks the criterion
+// that drives the query, so that the query can later be run any number of times without
+// repeating this work. Returns false if there are no search criteria, if a criterion lacks
+// both bounds, or if it names a field that is missing. Sort criteria naming a missing field
+// are ignored, as they have no effect on the ordering.
+// --- Each index can count the rows in a range in O(log N), so the planner simply picks the
+// criterion matching the fewest rows to drive the query. Walking it and checking every other
+// criterion against the row never does more work than intersecting every criterion's range.
+// A composite index range is a candidate too (see compositeRange). An equality on a field with
+// a hash index is always looked up there, in O(1) rather than O(log N). A criterion no index
+// can serve costs a scan of every row, so it only drives the query if no other criterion can.
+bool Database::prepare(const vector<SearchCriterion>& searchCriteria,
+	const vector<SortCriterion>& sortCriteria, PreparedQuery& query) const
 {
-	m_schema.clear();
+	lock_guard<recursive_mutex> lock(m_lock);
+	query.ranges.clear();
+	query.sortKeys.clear();
+	query.schemaVersion = m_schemaVersion;
+	if (searchCriteria.empty()) // no search criteria
+		return false;
+
+	int best = 0;
+	for (int i = 0; i < searchCriteria.size(); ++i)
+	{
+		const SearchCriterion& sc = searchCriteria[i];
+		if (sc.minValue == "" && sc.maxValue == "")
+			return false; // lacks both min AND max values
+		int field = fieldNumber(sc.fieldName);
+		if (field < 0) // no match
+			return false;
+
+		PreparedQuery::Range range;
+		range.field = field;
+		range.minValue = sc.minValue;
+		range.maxValue = sc.maxValue;
+		range.minExclusive = sc.minExclusive && sc.minValue != "";
+		range.maxExclusive = sc.maxExclusive && sc.maxValue != "";
+		range.composite = -1;
+		range.hashed = sc.minValue == sc.maxValue && !range.minExclusive && !range.maxExclusive && hashIndex(field);
+		range.scanned = !range.hashed && !treeIndex(field); // non-indexed, or a range over a hash-only index
+		range.minKey = 0;
+		range.maxKey = ~0ULL;
+		range.keyed = (sc.minValue == "" || MultiMap::numericKey(sc.minValue, range.minKey))
+			&& (sc.maxValue == "" || MultiMap::numericKey(sc.maxValue, range.maxKey));
+		if (range.hashed)
+			range.estimate = hashIndex(field)->count(sc.minValue);
+		else if (!range.scanned)
+			range.estimate = treeIndex(field)->countRange(sc.minValue, sc.maxValue, range.minExclusive, range.maxExclusive);
+		else
+			range.estimate = m_rows.size();
+		query.ranges.push_back(range);
+		if (range.estimate < query.ranges[best].estimate || (query.ranges[best].scanned && !range.scanned))
+			best = i;
+	}
+
+	// A composite index whose leading field has a criterion bounds a superset of the matching
+	// rows too; if it is the tightest, it drives the query and every criterion is rechecked.
+	PreparedQuery::Range composite, range;
+	composite.estimate = query.ranges[best].estimate;
+	for (int i = 0; i < m_composites.size(); ++i)
+		if (compositeRange(i, query, range) && range.estimate < composite.estimate)
+			composite = range;
+	if (composite.estimate < query.ranges[best].estimate)
+		query.ranges.insert(query.ranges.begin(), composite);
+	else
+		std::swap(query.ranges[0], query.ranges[best]);
+
+	resolveSortKeys(sortCriteria, query.sortKeys);
+	return true;
 }
 
-void Database::clearRows()
+// Runs a query built by prepare. Returns the number of matching rows, or ERROR_RESULT if the
+// schema has been respecified since the query was prepared.
+int Database::search(const PreparedQuery& query, vector<int>& results)
 {
-	m_rows.clear();
+	lock_guard<recursive_mutex> lock(m_lock);
+	results.clear();
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	ResultCursor cursor;
+	if (!search(query, cursor))
+		return ERROR_RESULT;
+	noteScans(query);
+
+	if (cursor.m_done) // fully materialized, so take the whole buffer
+		results.swap(cursor.m_buffer);
+	else
+	{
+		vector<int> batch;
+		while (cursor.next(batch, CURSOR_CHUNK))
+			results.insert(results.end(), batch.begin(), batch.end());
+	}
+	m_blocksSkipped += cursor.m_blocksSkipped;
+	if (m_stats)
+	{
+		m_stats->blocksSkipped += cursor.m_blocksSkipped;
+		m_stats->results = results.size();
+		m_stats->scanSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count() - m_stats->sortSeconds;
+	}
+	return results.size();
 }
 
-void Database::clearFieldIndex()
+// Opens a cursor over the results of a query built by prepare. Returns false if the schema has
+// been respecified since the query was prepared.
+// --- Results stream straight off the driving criterion's index range when the query is
+// unsorted, or when it is sorted first by the driver's field: the index already yields that
+// order (walked backwards for descending), so only rows sharing a key need sorting by the
+// remaining sort keys. Any other sort needs every result before the first can be returned,
+// so those are collected and sorted up front.
+bool Database::search(const PreparedQuery& query, ResultCursor& cursor) const
 {
-	for (int i = 0; i < m_schema.size(); ++i)
-		delete m_fieldIndex[i];
-	delete m_fieldIndex;
-	m_fieldIndex = nullptr;
+	lock_guard<recursive_mutex> lock(m_lock);
+	cursor.close();
+	if (query.schemaVersion != m_schemaVersion || query.ranges.empty())
+		return false;
+	Metrics::add(Metrics::db_queries);
+
+	cursor.m_db = this;
+	cursor.m_query = query;
+	cursor.m_tieKeys.clear();
+	cursor.m_reverse = false;
+	cursor.m_pos = 0;
+	cursor.m_blocksSkipped = 0;
+	cursor.m_rowsVersion = m_rowsVersion;
+	if (query.ranges[0].hashed)
+		cursor.m_done = !hashIndex(query.ranges[0].field)->count(query.ranges[0].minValue);
+	else if (query.ranges[0].scanned)
+		cursor.m_done = m_rows.empty();
+	else
+		cursor.m_done = !findRange(query.ranges[0], cursor.m_cur, cursor.m_last);
+	if (m_stats && !cursor.m_done && !query.ranges[0].scanned)
+		m_stats->nodesVisited++; // the first key; refill counts the rest
+
+	const vector<PreparedQuery::SortKey>& sortKeys = query.sortKeys;
+	if (sortKeys.empty())
+		return true;
+	if (sortKeys[0].field == query.ranges[0].field && query.ranges[0].composite < 0 && !query.ranges[0].scanned)
+	{
+		if (sortKeys[0].ordering == ot_descending)
+		{
+			std::swap(cursor.m_cur, cursor.m_last);
+			cursor.m_reverse = true;
+		}
+		cursor.m_tieKeys.assign(sortKeys.begin() + 1, sortKeys.end());
+		return true;
+	}
+
+	while (cursor.refill()) // walks the whole range into the buffer
+		;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	quicksort(cursor.m_buffer, 0, cursor.m_buffer.size(), sortKeys);
+	if (m_stats)
+		m_stats->sortSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return true;
 }
 
-// Compares two rows of data by the specified field name, and by the ordering (ascending/descending),
-// defined in sortCriteria. Returns 1 if the 1st row belongs after the 2nd, or -1 if vice versa.
-// If the two rows being compared are equal, we check the next sortCritera.
-int Database::compare(int a, int b, const vector<SortCriterion>& sortCriteria)
+// Computes a COUNT, MIN, MAX, SUM or AVG of fieldName over the rows matching every search
+// criterion (or over every row, if there are none). MIN and MAX follow the index ordering;
+// SUM and AVG treat values that are not numbers as 0. The count of an empty result is 0,
+// and its other aggregates are left empty. Returns false if the criteria are invalid (see
+// prepare) or fieldName is not in the schema (COUNT ignores fieldName).
+// --- When there is at most one criterion, and it is on fieldName itself (or we only count),
+// the answer comes straight from the index without touching row storage: COUNT is a range
+// count, MIN/MAX are the two ends of the range, and SUM/AVG walk it, parsing each distinct
+// key only once.
+bool Database::aggregate(const vector<SearchCriterion>& searchCriteria, AggregateType type,
+	const string& fieldName, AggregateResult& result)
 {
-	for (int i = 0; i < sortCriteria.size(); ++i)
+	lock_guard<recursive_mutex> lock(m_lock);
+	result.group = result.value = "";
+	result.count = 0;
+	result.number = 0;
+
+	PreparedQuery query;
+	query.ranges.clear();
+	if (!searchCriteria.empty() && !prepare(searchCriteria, vector<SortCriterion>(), query))
+		return false;
+	int field = fieldNumber(fieldName);
+	if (field < 0 && type != ag_count)
+		return false;
+
+	// Index-only plan
+	if (query.ranges.size() == 1 && query.ranges[0].hashed && type == ag_count)
 	{
-		for (int j = 0; j < m_schema.size(); ++j)
+		result.count = query.ranges[0].estimate; // a hash lookup is exact
+		finish(result, type);
+		return true;
+	}
+	bool rangeOnField = query.ranges.size() == 1 && query.ranges[0].composite < 0 && !query.ranges[0].hashed
+		&& !query.ranges[0].scanned && (type == ag_count || query.ranges[0].field == field);
+	bool wholeIndex = query.ranges.empty() && field >= 0 && treeIndex(field);
+	if (rangeOnField || wholeIndex)
+	{
+		PreparedQuery::Range range;
+		if (rangeOnField)
+			range = query.ranges[0];
+		else
+		{
+			range.field = field; // both bounds empty, so the whole index
+			range.composite = -1;
+			range.hashed = range.scanned = range.keyed = false;
+		}
+		MultiMap::Iterator first, last;
+		if (findRange(range, first, last))
 		{
-			if (m_schema[j].name == sortCriteria[i].fieldName)
+			if (type != ag_sum && type != ag_avg)
 			{
-				if (sortCriteria[i].ordering == ot_ascending)
-				{
-					if (m_rows[a][j] > m_rows[b][j])
-						return 1;
-					if (m_rows[a][j] < m_rows[b][j])
-						return -1;
-				}
-				else if (sortCriteria[i].ordering == ot_descending)
+				result.count = m_fieldIndex[range.field]->countRange(range.minValue, range.maxValue,
+					range.minExclusive, range.maxExclusive);
+				if (type != ag_count)
+					result.value = type == ag_min ? first.getKey() : last.getKey();
+			}
+			else
+			{
+				const string* key = nullptr;
+				double number = 0;
+				for (;; first.next())
 				{
-					if (m_rows[a][j] < m_rows[b][j])
-						return 1;
-					if (m_rows[a][j] > m_rows[b][j])
-						return -1;
+					result.count++;
+					if (key != &first.getKey()) // a new BSTNode, so parse its key
+					{
+						key = &first.getKey();
+						number = atof(key->c_str());
+					}
+					result.number += number;
+					if (first == last)
+						break;
 				}
-				break; // elements are equal, check the next sortCriteria
 			}
 		}
+		finish(result, type);
+		return true;
+	}
+
+	// General plan: find the matching rows, then read the field from each one
+	if (query.ranges.empty())
+	{
+		for (int i = 0; i < m_rows.size(); ++i)
+		{
+			if (m_deleted[i])
+				continue;
+			result.count++;
+			if (type != ag_count)
+				accumulate(result, type, value(i, field));
+		}
+	}
+	else
+	{
+		vector<int> rows;
+		search(query, rows);
+		for (int i = 0; i < rows.size(); ++i)
+		{
+			result.count++;
+			if (type != ag_count)
+				accumulate(result, type, value(rows[i], field));
+		}
+	}
+	finish(result, type);
+	return true;
+}
+
+// Same as above, but computes one aggregate per distinct key of the indexed field groupBy,
+// in ascending key order. Groups with no matching rows are left out. Returns false if groupBy
+// is not an indexed field, or for any reason the ungrouped version would.
+// --- We walk groupBy's index in order, so each group's rows arrive together and no hashing
+// is needed. If one of the criteria is on groupBy itself, we only walk its range.
+bool Database::aggregate(const vector<SearchCriterion>& searchCriteria, AggregateType type,
+	const string& fieldName, const string& groupBy, vector<AggregateResult>& groups)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	groups.clear();
+
+	PreparedQuery query;
+	query.ranges.clear();
+	if (!searchCriteria.empty() && !prepare(searchCriteria, vector<SortCriterion>(), query))
+		return false;
+	int field = fieldNumber(fieldName), groupField = fieldNumber(groupBy);
+	if ((field < 0 && type != ag_count) || groupField < 0 || !treeIndex(groupField))
+		return false;
+
+	PreparedQuery::Range range;
+	range.field = groupField;
+	range.composite = -1;
+	range.hashed = range.scanned = range.keyed = false;
+	for (int i = 0; i < query.ranges.size(); ++i)
+	{
+		if (query.ranges[i].composite < 0 && query.ranges[i].field == groupField)
+		{
+			range = query.ranges[i];
+			range.hashed = range.scanned = range.keyed = false; // walk groupField's tree index, not its hash index
+			break;
+		}
+	}
+
+	MultiMap::Iterator first, last;
+	if (!findRange(range, first, last))
+		return true;
+	AggregateResult group;
+	group.count = 0;
+	for (;; first.next())
+	{
+		if (group.count > 0 && first.getKey() != group.group) // the previous group is complete
+		{
+			finish(group, type);
+			groups.push_back(group);
+			group.count = 0;
+		}
+		int row = first.getValue();
+		if (matches(row, query, 0))
+		{
+			if (group.count == 0) // first row of a new group
+			{
+				group.group = first.getKey();
+				group.value = "";
+				group.number = 0;
+			}
+			group.count++;
+			if (type != ag_count)
+				accumulate(group, type, value(row, field));
+		}
+		if (first == last)
+			break;
+	}
+	if (group.count > 0)
+	{
+		finish(group, type);
+		groups.push_back(group);
+	}
+	return true;
+}
+
+// Sets the maximum number of bytes the result cache may hold, evicting least recently used
+// entries as needed. A capacity of 0 (the default) disables caching.
+void Database::setCacheCapacity(size_t bytes)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	m_cacheCapacity = bytes;
+	cacheEvict();
+}
+
+int Database::getCacheHits() const
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	return m_cacheHits;
+}
+
+int Database::getCacheMisses() const
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	return m_cacheMisses;
+}
+
+// Returns the # of blocks of rows that searches (other than through a cursor) have skipped
+// over without checking a single row, thanks to zone maps.
+int Database::getBlocksSkipped() const
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	return m_blocksSkipped;
+}
+
+// Measures every allocation we make, field by field and index by index (see MemoryUsage).
+// totalBytes is what a memory budget is checked against.
+Database::MemoryUsage Database::memoryUsage() const
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	MemoryUsage usage;
+	usage.rowBytes = MultiMap::allocationSize(m_rows.capacity() * sizeof(vector<string>));
+	usage.fieldBytes.assign(m_schema.size(), 0);
+	usage.stringHeapBytes = 0;
+	usage.overheadBytes = usage.rowBytes - m_rows.size() * sizeof(vector<string>);
+	for (int i = 0; i < m_rows.size(); ++i)
+	{
+		const vector<string>& row = m_rows[i];
+		size_t buffer = MultiMap::allocationSize(row.capacity() * sizeof(string));
+		usage.rowBytes += buffer;
+		usage.overheadBytes += buffer - row.size() * sizeof(string);
+		for (int j = 0; j < row.size(); ++j)
+		{
+			size_t heap = MultiMap::stringHeapSize(row[j].capacity());
+			usage.rowBytes += heap;
+			usage.fieldBytes[j] += sizeof(string) + heap;
+			usage.stringHeapBytes += heap;
+			if (heap > 0)
+				usage.overheadBytes += heap - (row[j].size() + 1);
+		}
+	}
+
+	usage.columnBytes = MultiMap::allocationSize((m_deleted.capacity() + 7) / 8);
+	for (int i = 0; i < m_columns.size(); ++i)
+		usage.columnBytes += MultiMap::allocationSize(m_columns[i].keys.capacity() * sizeof(unsigned long long))
+			+ 2 * MultiMap::allocationSize(m_columns[i].blockMin.capacity() * sizeof(unsigned long long));
+	usage.rowBytes += MultiMap::allocationSize(m_blocks.capacity() * sizeof(CompressedBlock*));
+	for (int i = 0; i < m_blocks.size(); ++i)
+	{
+		if (!m_blocks[i])
+			continue;
+		usage.rowBytes += m_blocks[i]->bytes();
+		for (int j = 0; j < m_schema.size(); ++j)
+			usage.fieldBytes[j] += m_blocks[i]->fieldBytes(j);
+	}
+	if (m_store)
+	{
+		size_t bytes = m_store->bytes();
+		usage.rowBytes += bytes;
+		usage.overheadBytes += bytes;
+	}
+	usage.cacheBytes = m_cacheBytes;
+	usage.totalBytes = usage.rowBytes + usage.columnBytes + usage.cacheBytes;
+
+	for (int i = 0; i < m_schema.size() + m_composites.size(); ++i)
+	{
+		IndexMemory index;
+		index.depth = 0;
+		if (i < m_schema.size() && hashIndex(i))
+		{
+			HashIndex::Usage u = hashIndex(i)->usage();
+			index.name = m_schema[i].name;
+			index.kind = "hash";
+			index.bytes = u.bytes;
+			index.keys = u.keys;
+			index.values = u.values;
+			index.valuesPerKey = u.keys > 0 ? (double)u.values / u.keys : 0;
+			usage.indexes.push_back(index);
+			usage.stringHeapBytes += u.stringHeapBytes;
+			usage.overheadBytes += u.overheadBytes;
+			usage.totalBytes += u.bytes;
+		}
+		const MultiMap* tree = i < m_schema.size() ? treeIndex(i) : m_composites[i - m_schema.size()].index;
+		if (!tree)
+			continue;
+		if (i < m_schema.size())
+		{
+			index.name = m_schema[i].name;
+			index.kind = "tree";
+		}
+		else
+		{
+			const vector<int>& fields = m_composites[i - m_schema.size()].fields;
+			index.name = "(";
+			for (int j = 0; j < fields.size(); ++j)
+				index.name += (j > 0 ? "," : "") + m_schema[fields[j]].name;
+			index.name += ")";
+			index.kind = "composite";
+		}
+		MultiMap::Usage u = tree->usage();
+		index.bytes = u.bytes;
+		index.keys = u.keys;
+		index.values = u.values;
+		index.depth = u.depth;
+		index.valuesPerKey = u.keys > 0 ? (double)u.values / u.keys : 0;
+		usage.indexes.push_back(index);
+		usage.stringHeapBytes += u.stringHeapBytes;
+		usage.overheadBytes += u.overheadBytes;
+		usage.totalBytes += u.bytes;
+	}
+	return usage;
+}
+
+// Keeps rows in the named file from now on (emptying it first), with up to cacheBytes of it
+// cached in memory, and moves the rows already added there. An empty filename brings the rows
+// back into memory (regardless of any memory budget) and deletes the file, as does destroying
+// the database. Returns false, leaving the rows in memory, if the file can't be created.
+// --- Only the rows move: the indexes, numeric columns and cached results stay in memory (as
+// does each row's place in m_rows, now empty), so a search walks its index as before and only
+// reads the pages holding the rows it tests, sorts or returns. A numeric criterion tested
+// against its column, or a row skipped by its zone map, reads nothing at all.
+bool Database::storeRowsOnDisk(const string& filename, size_t cacheBytes)
+{
+	lock_guard<recursive_mutex> loaderLock(m_loaderLock); // so no load starts once cancelled
+	cancelLoad(); // it would add rows behind our back
+	lock_guard<recursive_mutex> lock(m_lock);
+	if (m_store)
+	{
+		for (int i = 0; i < m_store->size(); ++i)
+		{
+			if (m_deleted[i])
+				continue;
+			m_rows[i] = m_store->get(i);
+			m_rowBytes += rowBytes(m_rows[i]);
+		}
+		delete m_store;
+		m_store = nullptr;
+	}
+	if (filename.empty())
+	{
+		sealBlocks();
+		return true;
+	}
+
+	m_store = new RowStore;
+	if (!m_store->open(filename, cacheBytes))
+	{
+		delete m_store;
+		m_store = nullptr;
+		sealBlocks();
+		return false;
+	}
+	m_storeFile = filename;
+	m_storeCache = cacheBytes;
+	unsealBlocks();
+	spillRows();
+	return true;
+}
+
+// Compresses each full block of SCAN_BLOCK rows kept in memory, now and whenever one fills up
+// later, or decompresses them all again if on is false (regardless of any memory budget).
+// Rows kept on disk are not compressed.
+// --- Updating a row decompresses its block and compresses it again; deleting one leaves its
+// values in its block until the next compact.
+void Database::setCompression(bool on)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	m_compressed = on;
+	if (on)
+		sealBlocks();
+	else
+		unsealBlocks();
+}
+
+// Caps the bytes we may use (see memoryUsage), or lifts the cap if bytes is 0. Once the cap is
+// set, addRow, addRows, updateRow and every load fail, changing nothing, if what they add
+// might not fit; rows already present stay, even if they use more.
+// --- A load also stops parsing as soon as the rows it has read would not fit on their own,
+// so that an oversized file fails after reading about a budget's worth, not all of it.
+void Database::setMemoryBudget(size_t bytes)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	m_memoryBudget = bytes;
+}
+
+// Sets how many full scans a criterion on a field without a BST index may force before one is
+// built for it. 0 turns adaptive indexing off.
+void Database::setAdaptiveIndexing(int scans)
+{
+	lock_guard<recursive_mutex> lock(m_lock);
+	m_adaptiveScans = scans;
+}
+
+
+/////////////////////////////
+// ResultCursor Implementations
+/////////////////////////////
+
+Database::ResultCursor::ResultCursor()
+{
+	m_db = nullptr;
+	m_reverse = false;
+	m_done = true;
+	m_bufferPos = 0;
+	m_pos = 0;
+	m_blocksSkipped = 0;
+	m_rowsVersion = 0;
+}
+
+// Fills batch with up to maxRows more results. Returns the number of rows in batch, which is
+// 0 once the results are exhausted.
+int Database::ResultCursor::next(vector<int>& batch, int maxRows)
+{
+	batch.clear();
+	if (!m_db)
+		return 0;
+	lock_guard<recursive_mutex> lock(m_db->m_lock);
+	if (m_db->m_schemaVersion != m_query.schemaVersion || m_db->m_rowsVersion != m_rowsVersion)
+		close(); // the rows (or index entries) we were walking are gone
+
+	while (batch.size() < maxRows)
+	{
+		if (m_bufferPos < m_buffer.size())
+			batch.push_back(m_buffer[m_bufferPos++]);
+		else if (!refill())
+			break;
+	}
+	return batch.size();
+}
+
+// Sets rowNum to the next result. Returns false once the results are exhausted.
+bool Database::ResultCursor::next(int& rowNum)
+{
+	if (!m_db)
+		return false;
+	lock_guard<recursive_mutex> lock(m_db->m_lock);
+	if (m_db->m_schemaVersion != m_query.schemaVersion || m_db->m_rowsVersion != m_rowsVersion)
+		close();
+
+	while (m_bufferPos == m_buffer.size())
+		if (!refill())
+			return false;
+	rowNum = m_buffer[m_bufferPos++];
+	return true;
+}
+
+// Stops the cursor early, releasing its buffered results.
+void Database::ResultCursor::close()
+{
+	m_done = true;
+	m_buffer.clear();
+	m_bufferPos = 0;
+}
+
+// Walks the driving criterion's index range a little further, replacing the buffer with the
+// rows that satisfy every other criterion. Returns false if the range was already exhausted.
+// --- If rows sharing a key must be sorted by further sort keys, we walk exactly one key's
+// worth of rows at a time; otherwise at most CURSOR_CHUNK rows, so a batch is never held up
+// for long by rows that don't match.
+bool Database::ResultCursor::refill()
+{
+	if (m_done)
+		return false;
+	if (m_bufferPos == m_buffer.size())
+	{
+		m_buffer.clear();
+		m_bufferPos = 0;
+	}
+
+	const PreparedQuery::Range& driver = m_query.ranges[0];
+	if (driver.scanned)
+	{
+		// Nothing narrows the rows down, so filter the next block of rows
+		size_t end = min(m_pos + SCAN_BLOCK, m_db->m_rows.size()), matched = m_buffer.size();
+		if (!m_db->scanBlock(m_query, m_pos, end, m_buffer))
+			m_blocksSkipped++;
+		Metrics::add(Metrics::db_rows_matched, m_buffer.size() - matched);
+		m_pos = end;
+		m_done = m_pos >= m_db->m_rows.size();
+		return true;
+	}
+
+	// A hash index's rows are found afresh each time, since inserts may move them
+	const vector<unsigned int>* hashRows = driver.hashed ? m_db->hashIndex(driver.field)->find(driver.minValue) : nullptr;
+	if (driver.hashed && (!hashRows || m_pos >= hashRows->size()))
+	{
+		m_done = true;
+		return false;
+	}
+
+	const string* key = driver.hashed ? nullptr : &m_cur.getKey();
+	size_t matched = m_buffer.size();
+	for (int walked = 1; ; ++walked)
+	{
+		int row = hashRows ? (*hashRows)[m_pos] : m_cur.getValue();
+		if (m_db->m_stats)
+		{
+			m_db->m_stats->rowsExamined++;
+			m_db->m_stats->criteria[0].checked++;
+			m_db->m_stats->criteria[0].passed++;
+		}
+		if (m_db->matches(row, m_query, 1))
+			m_buffer.push_back(row);
+		if (hashRows ? m_pos + 1 == hashRows->size() : m_cur == m_last)
+		{
+			m_done = true;
+			break;
+		}
+		if (hashRows)
+			m_pos++;
+		else
+		{
+			const string* from = &m_cur.getKey();
+			if (m_reverse)
+				m_cur.prev();
+			else
+				m_cur.next();
+			if (m_db->m_stats && &m_cur.getKey() != from)
+				m_db->m_stats->nodesVisited++;
+		}
+		if (m_tieKeys.empty() ? walked >= CURSOR_CHUNK : !hashRows && &m_cur.getKey() != key)
+			break; // (all of a hash index's rows share one key)
+	}
+	Metrics::add(Metrics::db_rows_matched, m_buffer.size() - matched);
+	if (!m_tieKeys.empty())
+		m_db->quicksort(m_buffer, m_bufferPos, m_buffer.size(), m_tieKeys);
+	return true;
+}
+
+
+/////////////////////////////
+// Database Helper Functions
+/////////////////////////////
+
+// Reads a schema and rows of data (see parseStream), replaces our schema with it, and loads
+// the rows as a single batch. Returns false if the schema is invalid or has no indexes, or if
+// any row doesn't match the schema (no rows are added).
+bool Database::loadFromStream(istream& in)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	lock_guard<recursive_mutex> loaderLock(m_loaderLock);
+	cancelLoad(); // before taking m_lock, which the loader needs to stop
+	ParsedSource parsed;
+	{
+		lock_guard<recursive_mutex> lock(m_lock);
+		parsed.limit = m_memoryBudget; // (the rows we have now are about to go)
+	}
+	if (!parseStream(in, parsed))
+		return false;
+	lock_guard<recursive_mutex> lock(m_lock); // only once parsed, so queries go on meanwhile
+	if (!specifySchema(parsed.schema, parsed.composites))
+		return false;
+	int numRows = parsed.rows.size();
+	if (!addRows(std::move(parsed.rows)))
+		return false;
+	noteLoad(numRows, parsed.bytes, start);
+	return true;
+}
+
+// Reads the schema from the 1st line, then every following line as a row of data. A trailing
+// '*' marks a field as indexed, a trailing '#' as hashed (and both, as both), and a parenthesized
+// list of fields with a trailing '*', eg. (lastname,firstname)*, declares a composite index.
+// Returns false if a composite index is malformed. Touches nothing but parsed, so that several
+// streams may be parsed at once.
+bool Database::parseStream(istream& in, ParsedSource& parsed) const
+{
+	// Check 1st line for proper schema
+	vector<FieldDescriptor>& schema = parsed.schema;
+	vector<vector<string> >& composites = parsed.composites;
+	vector<string> words;
+	string line;
+	getline(in, line);
+	parsed.bytes = line.size() + 1;
+	splitLine(line, words);
+	for (int i = 0; i < words.size(); ++i)
+	{
+		if (!words[i].empty() && words[i][0] == '(') // composite index, up to the closing ')'
+		{
+			vector<string> fields(1, words[i].substr(1));
+			while (fields.back().find(')') == string::npos && ++i < words.size())
+				fields.push_back(words[i]);
+			string& last = fields.back();
+			if (last.size() < 2 || last.substr(last.size() - 2) != ")*")
+				return false;
+			last.erase(last.size() - 2);
+			composites.push_back(fields);
+			continue;
+		}
+
+		FieldDescriptor temp;
+		bool tree = false, hashed = false;
+		while (!words[i].empty() && (words[i].back() == '*' || words[i].back() == '#'))
+		{
+			(words[i].back() == '*' ? tree : hashed) = true;
+			words[i].pop_back();
+		}
+		temp.index = tree ? (hashed ? it_both : it_indexed) : (hashed ? it_hashed : it_none);
+		temp.name = words[i];
+		schema.push_back(temp);
+	}
+
+	// Process the rest of the lines
+	vector<vector<string> >& rows = parsed.rows;
+	size_t stored = 0;
+	while (getline(in, line))
+	{
+		parsed.bytes += line.size() + 1;
+		rows.push_back(vector<string>());
+		splitLine(line, rows.back());
+		stored += sizeof(vector<string>) + rowBytes(rows.back());
+		if (parsed.limit > 0 && stored > parsed.limit)
+			return false;
+	}
+	return true;
+}
+
+// Loads and parses a file (or, if url is true, a web page). Returns false if it can't be loaded.
+bool Database::readSource(const string& source, bool url, ParsedSource& parsed) const
+{
+	if (!url)
+	{
+		ifstream inf(source);
+		return inf && parseStream(inf, parsed);
+	}
+
+	static mutex httpLock; // HTTP fetches into a single static buffer, so one page at a time
+	string page;
+	{
+		lock_guard<mutex> lock(httpLock);
+		if (!HTTP().get(source, page))
+			return false;
+	}
+	istringstream iss(page);
+	return parseStream(iss, parsed);
+}
+
+// Runs on the background load's thread: reads the rest of the file a chunk of lines at a time,
+// and adds each chunk's rows (and counts them in the load's progress) while holding the lock.
+void Database::loadInBackground(ifstream& in, promise<bool>& result)
+{
+	bool ok = true;
+	vector<vector<string> > rows;
+	string line;
+	for (;;)
+	{
+		if (m_loadCancelled)
+		{
+			ok = false;
+			break;
+		}
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		long long bytes = 0;
+		while (rows.size() < LOAD_CHUNK && getline(in, line))
+		{
+			bytes += line.size() + 1;
+			rows.push_back(vector<string>());
+			splitLine(line, rows.back());
+		}
+		if (rows.empty())
+			break;
+		int numRows = rows.size();
+		{
+			lock_guard<recursive_mutex> lock(m_lock);
+			ok = addRows(std::move(rows)); // (leaves rows empty)
+			m_loadBytes += bytes;
+			if (ok)
+				m_loadRows += numRows;
+		}
+		if (!ok)
+			break;
+		noteLoad(numRows, bytes, start);
+	}
+	{
+		lock_guard<recursive_mutex> lock(m_lock);
+		m_loading = false;
+	}
+	result.set_value(ok);
+}
+
+// Loads and parses every source, then adds all of their rows, in the order listed, as one batch.
+// If we have no schema yet, the 1st source's header becomes it. Returns false, adding nothing,
+// if a source fails to load, if a header names different fields than the schema, or if a row
+// doesn't match the schema.
+// --- The sources are read and parsed on as many threads as the hardware offers, each taking
+// the next unclaimed source, so a long list is bounded by I/O rather than by a serial parse.
+// Parsing touches nothing shared. The rows are then indexed by a single addRows call, which
+// gives each index one sorted batch for all of them.
+bool Database::appendFromSources(const vector<string>& sources, bool urls)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	vector<ParsedSource> parsed(sources.size());
+	{
+		lock_guard<recursive_mutex> lock(m_lock);
+		size_t used = memoryUsed();
+		for (int i = 0; i < parsed.size() && m_memoryBudget > 0; ++i)
+			parsed[i].limit = used < m_memoryBudget ? m_memoryBudget - used : 1;
+	}
+	runInParallel(sources.size(), [&](int i) { parsed[i].ok = readSource(sources[i], urls, parsed[i]); });
+
+	lock_guard<recursive_mutex> loaderLock(m_loaderLock); // (specifySchema may cancel a load)
+	lock_guard<recursive_mutex> lock(m_lock); // only once parsed, so queries go on meanwhile
+	if (parsed.empty())
+		return true;
+	const vector<FieldDescriptor>& expected = m_schema.empty() ? parsed[0].schema : m_schema;
+	size_t numRows = 0;
+	long long bytes = 0;
+	for (int i = 0; i < parsed.size(); ++i)
+	{
+		if (!parsed[i].ok || parsed[i].schema.size() != expected.size())
+			return false;
+		for (int j = 0; j < expected.size(); ++j)
+			if (parsed[i].schema[j].name != expected[j].name)
+				return false;
+		for (int j = 0; j < parsed[i].rows.size(); ++j)
+			if (parsed[i].rows[j].size() != expected.size())
+				return false;
+		numRows += parsed[i].rows.size();
+		bytes += parsed[i].bytes;
+	}
+	if (m_schema.empty() && !specifySchema(parsed[0].schema, parsed[0].composites))
+		return false;
+
+	vector<vector<string> > rows;
+	rows.reserve(numRows);
+	for (int i = 0; i < parsed.size(); ++i)
+		for (int j = 0; j < parsed[i].rows.size(); ++j)
+			rows.push_back(std::move(parsed[i].rows[j]));
+	if (!addRows(std::move(rows)))
+		return false;
+	noteLoad(numRows, bytes, start);
+	return true;
+}
+
+// Returns the bytes a row allocates itself: its array of strings, and their heap buffers.
+size_t Database::rowBytes(const vector<string>& row)
+{
+	size_t bytes = MultiMap::allocationSize(row.capacity() * sizeof(string));
+	for (int i = 0; i < row.size(); ++i)
+		bytes += MultiMap::stringHeapSize(row[i].capacity());
+	return bytes;
+}
+
+// Returns at most the bytes that adding the row would allocate: the row itself, its place in
+// m_rows, its numeric keys, and an entry in each index as if each of its keys were new.
+size_t Database::rowCost(const vector<string>& row) const
+{
+	size_t bytes = sizeof(vector<string>) + (m_store ? sizeof(long long) + sizeof(unsigned int) : rowBytes(row));
+	for (int i = 0; i < row.size(); ++i)
+	{
+		if (treeIndex(i))
+			bytes += MultiMap::entryBytes(row[i].size());
+		if (hashIndex(i))
+			bytes += HashIndex::entryBytes(row[i].size());
+		if (m_columns[i].numeric)
+			bytes += sizeof(unsigned long long);
+	}
+	for (int i = 0; i < m_composites.size(); ++i)
+	{
+		size_t length = m_composites[i].fields.size() - 1; // the separators
+		for (int j = 0; j < m_composites[i].fields.size(); ++j)
+			length += row[m_composites[i].fields[j]].size();
+		bytes += MultiMap::entryBytes(length);
+	}
+	return bytes;
+}
+
+// Returns memoryUsage's totalBytes, but in O(F + C), from the sizes we keep up to date.
+size_t Database::memoryUsed() const
+{
+	size_t bytes = MultiMap::allocationSize(m_rows.capacity() * sizeof(vector<string>)) + m_rowBytes
+		+ MultiMap::allocationSize((m_deleted.capacity() + 7) / 8) + m_cacheBytes
+		+ (m_store ? m_store->bytes() : 0) + MultiMap::allocationSize(m_blocks.capacity() * sizeof(CompressedBlock*));
+	for (int i = 0; i < m_columns.size(); ++i)
+		bytes += MultiMap::allocationSize(m_columns[i].keys.capacity() * sizeof(unsigned long long))
+			+ 2 * MultiMap::allocationSize(m_columns[i].blockMin.capacity() * sizeof(unsigned long long));
+	for (int i = 0; i < m_schema.size(); ++i)
+	{
+		if (treeIndex(i))
+			bytes += treeIndex(i)->bytes();
+		if (hashIndex(i))
+			bytes += hashIndex(i)->bytes();
+	}
+	for (int i = 0; i < m_composites.size(); ++i)
+		bytes += m_composites[i].index->bytes();
+	return bytes;
+}
+
+// Counts a load's rows, bytes and time (since start) in the process-wide metrics.
+void Database::noteLoad(int rows, long long bytes, chrono::steady_clock::time_point start)
+{
+	Metrics::add(Metrics::db_rows_loaded, rows);
+	Metrics::add(Metrics::db_bytes_loaded, bytes);
+	Metrics::add(Metrics::db_load_nanoseconds,
+		chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
+
+// Splits a line into its comma-separated fields, ignoring a trailing '\r' left by files with
+// Windows line endings. As with getline, a trailing comma does not start an empty field.
+void Database::splitLine(const string& line, vector<string>& fields) const
+{
+	fields.clear();
+	size_t end = line.size();
+	if (end > 0 && line[end - 1] == '\r')
+		--end;
+	for (size_t begin = 0; begin < end; )
+	{
+		size_t comma = line.find(',', begin);
+		if (comma == string::npos || comma > end)
+			comma = end;
+		fields.push_back(line.substr(begin, comma - begin));
+		begin = comma + 1;
+	}
+}
+
+void Database::clearAll()
+{
+	clearCache();
+	clearFieldIndex(); // must precede clearSchema, which tells us which fields are indexed
+	clearSchema();
+	clearRows();
+}
+
+void Database::clearSchema()
+{
+	m_schema.clear();
+}
+
+void Database::clearRows()
+{
+	m_rowBytes = 0;
+	m_rows.clear();
+	m_deleted.clear();
+	m_numDeleted = 0;
+	if (m_store)
+		m_store->clear();
+	for (int i = 0; i < m_blocks.size(); ++i)
+		delete m_blocks[i];
+	m_blocks.clear();
+}
+
+void Database::clearFieldIndex()
+{
+	for (int i = 0; i < m_composites.size(); ++i)
+		delete m_composites[i].index;
+	m_composites.clear();
+	m_columns.clear();
+
+	if (m_hashIndex)
+	{
+		for (int i = 0; i < m_schema.size(); ++i)
+			delete m_hashIndex[i];
+		delete[] m_hashIndex;
+		m_hashIndex = nullptr;
+	}
+
+	if (!m_fieldIndex)
+		return;
+	for (int i = 0; i < m_schema.size(); ++i)
+		delete m_fieldIndex[i];
+	delete[] m_fieldIndex;
+	m_fieldIndex = nullptr;
+}
+
+void Database::clearCache()
+{
+	m_cache.clear();
+	m_cacheIndex.clear();
+	m_cacheBytes = 0;
+}
+
+// Returns a row's fields, from the row store if it holds the row, or decompressed if its block
+// is compressed. The reference is only good until this thread reads another row (or a few, from
+// the row store), or the rows change.
+const vector<string>& Database::row(int rowNum) const
+{
+	if (m_store && rowNum < m_store->size())
+		return m_store->get(rowNum);
+	int block = rowNum / SCAN_BLOCK;
+	if (block < m_blocks.size() && m_blocks[block])
+	{
+		thread_local vector<string> decompressed;
+		m_blocks[block]->getRow(rowNum % SCAN_BLOCK, decompressed);
+		return decompressed;
+	}
+	return m_rows[rowNum];
+}
+
+// Moves every row not yet in the row store (if any) there, leaving its place in m_rows empty.
+// Rows stay in memory if the file can't be written.
+void Database::spillRows()
+{
+	if (!m_store)
+		return;
+	for (int i = m_store->size(); i < m_rows.size() && m_store->append(m_rows[i]); ++i)
+	{
+		m_rowBytes -= rowBytes(m_rows[i]);
+		vector<string>().swap(m_rows[i]);
+	}
+}
+
+// Returns a row's value of a field, decompressing it if need be. The reference is only good
+// until this thread reads a few more values (see CompressedBlock::value), or the rows change.
+const string& Database::value(int rowNum, int field) const
+{
+	if (m_store && rowNum < m_store->size())
+		return m_store->get(rowNum)[field];
+	int block = rowNum / SCAN_BLOCK;
+	if (block < m_blocks.size() && m_blocks[block])
+		return m_blocks[block]->value(rowNum % SCAN_BLOCK, field);
+	return m_rows[rowNum][field];
+}
+
+// Compresses every full block of rows not yet compressed, if compression is on (and the rows
+// are kept in memory).
+void Database::sealBlocks()
+{
+	if (!m_compressed || m_store)
+		return;
+	for (int block = 0; (block + 1) * SCAN_BLOCK <= m_rows.size(); ++block)
+		if (block >= m_blocks.size() || !m_blocks[block])
+			sealBlock(block);
+}
+
+// Compresses a block of rows, leaving their places in m_rows empty.
+void Database::sealBlock(int block)
+{
+	if (block >= m_blocks.size())
+		m_blocks.resize(block + 1, nullptr);
+	int begin = block * SCAN_BLOCK;
+	m_blocks[block] = new CompressedBlock(m_rows, begin, begin + SCAN_BLOCK, m_schema.size());
+	m_rowBytes += m_blocks[block]->bytes();
+	for (int i = begin; i < begin + SCAN_BLOCK; ++i)
+	{
+		m_rowBytes -= rowBytes(m_rows[i]);
+		vector<string>().swap(m_rows[i]);
+	}
+}
+
+void Database::unsealBlocks()
+{
+	for (int block = 0; block < m_blocks.size(); ++block)
+		if (m_blocks[block])
+			unsealBlock(block);
+	vector<CompressedBlock*>().swap(m_blocks);
+}
+
+// Decompresses a block of rows back into m_rows (but not its deleted rows).
+void Database::unsealBlock(int block)
+{
+	int begin = block * SCAN_BLOCK;
+	for (int i = begin; i < begin + SCAN_BLOCK; ++i)
+	{
+		if (m_deleted[i])
+			continue;
+		m_blocks[block]->getRow(i - begin, m_rows[i]);
+		m_rowBytes += rowBytes(m_rows[i]);
+	}
+	m_rowBytes -= m_blocks[block]->bytes();
+	delete m_blocks[block];
+	m_blocks[block] = nullptr;
+}
+
+// Adds the row's values to every index (or removes them, if add is false).
+void Database::indexRow(int rowNum, bool add)
+{
+	const vector<string>& row = this->row(rowNum);
+	for (int i = 0; i < row.size(); ++i)
+	{
+		if (treeIndex(i)) // i-th field of row is indexed
+		{
+			if (add)
+				m_fieldIndex[i]->insert(row[i], rowNum);
+			else
+				m_fieldIndex[i]->erase(row[i], rowNum);
+		}
+		if (hashIndex(i))
+		{
+			if (add)
+				m_hashIndex[i]->insert(row[i], rowNum);
+			else
+				m_hashIndex[i]->erase(row[i], rowNum);
+		}
+	}
+	for (int i = 0; i < m_composites.size(); ++i)
+	{
+		if (add)
+			m_composites[i].index->insert(compositeKey(m_composites[i], row), rowNum);
+		else
+			m_composites[i].index->erase(compositeKey(m_composites[i], row), rowNum);
+	}
+}
+
+// Looks a query up in the cache by its key, setting results to its cached results. Returns
+// false if they are not cached.
+bool Database::cacheLookup(const string& key, vector<int>& results)
+{
+	auto found = m_cacheIndex.find(key);
+	if (found == m_cacheIndex.end())
+	{
+		m_cacheMisses++;
+		Metrics::add(Metrics::db_cache_misses);
+		return false;
+	}
+	m_cache.splice(m_cache.begin(), m_cache, found->second); // now most recently used
+	results = found->second->results;
+	m_cacheHits++;
+	Metrics::add(Metrics::db_cache_hits);
+	return true;
+}
+
+// Builds a canonical key for a query. Since the result set is the intersection of all search
+// criteria, their order doesn't matter, so we sort them first; sort criteria order does matter.
+// Each string is length-prefixed so that no two distinct queries can produce the same key.
+string Database::cacheKey(const vector<SearchCriterion>& searchCriteria,
+	const vector<SortCriterion>& sortCriteria) const
+{
+	vector<SearchCriterion> sorted(searchCriteria);
+	sort(sorted.begin(), sorted.end(), [](const SearchCriterion& a, const SearchCriterion& b) {
+		if (a.fieldName != b.fieldName)
+			return a.fieldName < b.fieldName;
+		if (a.minValue != b.minValue)
+			return a.minValue < b.minValue;
+		if (a.maxValue != b.maxValue)
+			return a.maxValue < b.maxValue;
+		return a.minExclusive + 2 * a.maxExclusive < b.minExclusive + 2 * b.maxExclusive;
+	});
+
+	string key;
+	for (int i = 0; i < sorted.size(); ++i)
+	{
+		key += to_string(sorted[i].fieldName.size()) + ':' + sorted[i].fieldName;
+		key += (sorted[i].minExclusive ? '(' : '[') + to_string(sorted[i].minValue.size()) + ':' + sorted[i].minValue;
+		key += to_string(sorted[i].maxValue.size()) + ':' + sorted[i].maxValue + (sorted[i].maxExclusive ? ')' : ']');
+	}
+	key += '|';
+	for (int i = 0; i < sortCriteria.size(); ++i)
+		key += to_string(sortCriteria[i].fieldName.size()) + ':' + sortCriteria[i].fieldName
+			+ (sortCriteria[i].ordering == ot_ascending ? '+' : '-');
+	return key;
+}
+
+// Inserts a result set at the front of the cache, then evicts from the back until we are
+// within capacity. The byte count is an estimate of the entry's heap footprint.
+void Database::cacheStore(const string& key, const PreparedQuery& query, const vector<int>& results)
+{
+	CacheEntry entry;
+	entry.key = key;
+	entry.query = query;
+	entry.results = results;
+	entry.bytes = sizeof(CacheEntry) + 2 * key.size() + results.size() * sizeof(int)
+		+ query.ranges.size() * sizeof(PreparedQuery::Range) + query.sortKeys.size() * sizeof(PreparedQuery::SortKey);
+	if (entry.bytes > m_cacheCapacity)
+		return; // would evict everything else and still not fit
+
+	m_cacheBytes += entry.bytes;
+	m_cache.push_front(entry);
+	m_cacheIndex[key] = m_cache.begin();
+	cacheEvict();
+}
+
+// Adds a newly inserted row to every cached result set whose criteria it satisfies. Unsorted
+// results simply get the row appended; sorted results get it inserted at its sorted position,
+// so that neither requires re-running the query.
+void Database::cachePatch(int rowNum)
+{
+	for (auto it = m_cache.begin(); it != m_cache.end(); ++it)
+	{
+		if (!matches(rowNum, it->query, 0))
+			continue;
+		vector<int>& r = it->results;
+		int lo = 0, hi = r.size();
+		if (!it->query.sortKeys.empty())
+		{
+			while (lo < hi) // first position whose row belongs after rowNum
+			{
+				int mid = (lo + hi) / 2;
+				if (compare(r[mid], rowNum, it->query.sortKeys) > 0)
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+		}
+		r.insert(r.begin() + lo, rowNum);
+		it->bytes += sizeof(int);
+		m_cacheBytes += sizeof(int);
+	}
+	cacheEvict();
+}
+
+// Removes a row that is being deleted (or updated) from every cached result set holding it.
+void Database::cacheRemove(int rowNum)
+{
+	for (auto it = m_cache.begin(); it != m_cache.end(); ++it)
+	{
+		vector<int>::iterator found = find(it->results.begin(), it->results.end(), rowNum);
+		if (found == it->results.end())
+			continue;
+		it->results.erase(found);
+		it->bytes -= sizeof(int);
+		m_cacheBytes -= sizeof(int);
+	}
+}
+
+void Database::cacheEvict()
+{
+	while (m_cacheBytes > m_cacheCapacity && !m_cache.empty())
+	{
+		m_cacheBytes -= m_cache.back().bytes;
+		m_cacheIndex.erase(m_cache.back().key);
+		m_cache.pop_back();
+	}
+}
+
+// Returns the field's BST index, or nullptr if it has none.
+MultiMap* Database::treeIndex(int field) const
+{
+	return m_fieldIndex ? m_fieldIndex[field] : nullptr;
+}
+
+// Returns the field's hash index, or nullptr if it has none.
+HashIndex* Database::hashIndex(int field) const
+{
+	return m_hashIndex ? m_hashIndex[field] : nullptr;
+}
+
+// Returns the position of the named field within m_schema, or -1 if there is none.
+int Database::fieldNumber(const string& fieldName) const
+{
+	for (int i = 0; i < m_schema.size(); ++i)
+		if (m_schema[i].name == fieldName)
+			return i;
+	return -1;
+}
+
+// Counts a full scan against every field whose criterion could not be served by an index,
+// since an index on any one of them would have spared it. A field whose count reaches the
+// adaptive threshold gets a BST index, which queries prepared from then on will use.
+// --- Building the index costs about as much as a few scans (one sorted, balanced build; see
+// MultiMap::insertAll), so it pays for itself if the field stays hot. Already-prepared
+// queries stay valid, and simply go on scanning.
+void Database::noteScans(const PreparedQuery& query)
+{
+	if (!query.ranges[0].scanned || m_adaptiveScans <= 0)
+		return;
+	for (int i = 0; i < query.ranges.size(); ++i)
+	{
+		int field = query.ranges[i].field;
+		if (query.ranges[i].scanned && !treeIndex(field) && ++m_fieldScans[field] >= m_adaptiveScans)
+			buildIndex(field);
+	}
+}
+
+// Builds a BST index over every row's value of the field, and marks it as indexed in the schema.
+void Database::buildIndex(int field)
+{
+	if (!m_fieldIndex)
+		m_fieldIndex = new MultiMap*[m_schema.size()]();
+	m_fieldIndex[field] = new MultiMap;
+	vector<pair<string, unsigned int> > entries;
+	entries.reserve(m_rows.size());
+	for (int i = 0; i < m_rows.size(); ++i)
+		if (!m_deleted[i])
+			entries.push_back(make_pair(value(i, field), (unsigned int)i));
+	m_fieldIndex[field]->insertAll(entries);
+	m_schema[field].index = m_schema[field].index == it_hashed ? it_both : it_indexed;
+}
+
+// Resolves each sort criterion's field name to its position in the schema, skipping any that
+// name a missing field, as they have no effect on the ordering.
+void Database::resolveSortKeys(const vector<SortCriterion>& sortCriteria, vector<PreparedQuery::SortKey>& sortKeys) const
+{
+	sortKeys.clear();
+	for (int i = 0; i < sortCriteria.size(); ++i)
+	{
+		int field = fieldNumber(sortCriteria[i].fieldName);
+		if (field < 0)
+			continue;
+		PreparedQuery::SortKey sortKey;
+		sortKey.field = field;
+		sortKey.ordering = sortCriteria[i].ordering;
+		sortKeys.push_back(sortKey);
+	}
+}
+
+// Sets first and last to the first and last values of the range's index whose keys lie
+// within [minValue, maxValue] (or the exclusive equivalent). Returns false if no key does.
+bool Database::findRange(const PreparedQuery::Range& range, MultiMap::Iterator& first,
+	MultiMap::Iterator& last) const
+{
+	const MultiMap* index = range.composite >= 0 ? m_composites[range.composite].index : m_fieldIndex[range.field];
+	first = range.minExclusive ? index->findSuccessor(range.minValue) : index->findEqualOrSuccessor(range.minValue);
+	last = range.maxExclusive ? index->findPredecessor(range.maxValue) : index->findEqualOrPredecessor(range.maxValue);
+	return first.valid() && last.valid() && index->compareKeys(first.getKey(), last.getKey()) <= 0;
+}
+
+// Builds a composite index's key for a row: its fields' values, in the composite's order.
+string Database::compositeKey(const CompositeIndex& composite, const vector<string>& row) const
+{
+	string key = row[composite.fields[0]];
+	for (int i = 1; i < composite.fields.size(); ++i)
+		key += MultiMap::COMPOSITE_SEPARATOR + row[composite.fields[i]];
+	return key;
+}
+
+// Sets range to the narrowest range of a composite index holding every row that could match
+// the query's ranges. Returns false if the composite's leading field has no criterion.
+// --- The lower bound is the tuple of the leading fields' minimums, up to the first field
+// without one; since a prefix sorts before its extensions, no matching row is smaller. The
+// upper bound is built the same way from the maximums, but if it stops short of the last
+// field it ends in COMPOSITE_MAX, so it sorts after every extension of that prefix.
+bool Database::compositeRange(int composite, const PreparedQuery& query, PreparedQuery::Range& range) const
+{
+	const vector<int>& fields = m_composites[composite].fields;
+	range.field = fields[0];
+	range.composite = composite;
+	range.hashed = range.scanned = range.keyed = false;
+	range.minValue = range.maxValue = "";
+
+	bool minOpen = true, maxOpen = true; // still extending each bound
+	for (int i = 0; i < fields.size() && (minOpen || maxOpen); ++i)
+	{
+		const PreparedQuery::Range* criterion = nullptr;
+		for (int j = 0; j < query.ranges.size() && !criterion; ++j)
+			if (query.ranges[j].composite < 0 && query.ranges[j].field == fields[i])
+				criterion = &query.ranges[j];
+		if (!criterion && i == 0)
+			return false;
+
+		if (minOpen && criterion && criterion->minValue != "")
+			range.minValue += (i > 0 ? string(1, MultiMap::COMPOSITE_SEPARATOR) : "") + criterion->minValue;
+		else
+			minOpen = false;
+		if (maxOpen && criterion && criterion->maxValue != "")
+			range.maxValue += (i > 0 ? string(1, MultiMap::COMPOSITE_SEPARATOR) : "") + criterion->maxValue;
+		else
+		{
+			if (maxOpen && i > 0)
+				range.maxValue += MultiMap::COMPOSITE_MAX;
+			maxOpen = false;
+		}
+	}
+
+	range.estimate = m_composites[composite].index->countRange(range.minValue, range.maxValue);
+	return true;
+}
+
+// Starts a numeric column for every field without a BST index, each one empty until rows are
+// added, and numeric until a value turns out not to be a number.
+void Database::resetColumns()
+{
+	m_columns.assign(m_schema.size(), NumericColumn());
+	for (int i = 0; i < m_schema.size(); ++i)
+		m_columns[i].numeric = !treeIndex(i);
+}
+
+// Sets a row's keys in the numeric columns, appending them if the row is new. A column is
+// dropped for good as soon as one of its values is not a number, since its keys could no
+// longer order the whole field.
+// --- An updated row's block only ever widens its min and max; they no longer need be exact,
+// only to bound every key in the block.
+void Database::updateColumns(int rowNum)
+{
+	for (int i = 0; i < m_columns.size(); ++i)
+	{
+		NumericColumn& column = m_columns[i];
+		unsigned long long key;
+		if (!column.numeric)
+			continue;
+		if (MultiMap::numericKey(value(rowNum, i), key))
+		{
+			if (rowNum == column.keys.size())
+				column.keys.push_back(key);
+			else
+				column.keys[rowNum] = key;
+			int block = rowNum / SCAN_BLOCK;
+			if (block == column.blockMin.size()) // first row of a new block
+			{
+				column.blockMin.push_back(key);
+				column.blockMax.push_back(key);
+			}
+			column.blockMin[block] = min(column.blockMin[block], key);
+			column.blockMax[block] = max(column.blockMax[block], key);
+		}
+		else
+		{
+			column.numeric = false;
+			vector<unsigned long long>().swap(column.keys);
+			vector<unsigned long long>().swap(column.blockMin);
+			vector<unsigned long long>().swap(column.blockMax);
+		}
+	}
+}
+
+// Returns true if the row satisfies every range of the query from position firstRange on.
+bool Database::matches(int rowNum, const PreparedQuery& query, int firstRange) const
+{
+	if (m_stats)
+		return countMatches(rowNum, query, firstRange, false);
+	for (int i = firstRange; i < query.ranges.size(); ++i)
+		if (query.ranges[i].composite < 0 && !inRange(rowNum, query.ranges[i])) // (a composite is implied by the others)
+			return false;
+	return true;
+}
+
+// Same as matches, but also counts, in m_stats, the rows each range is tested against and lets
+// through. If keyFiltered, scanBlock has already counted the ranges over numeric columns by
+// their keys, so those only lose the rows that tie with a bound but fail the full comparison.
+bool Database::countMatches(int rowNum, const PreparedQuery& query, int firstRange, bool keyFiltered) const
+{
+	for (int i = firstRange; i < query.ranges.size(); ++i)
+	{
+		const PreparedQuery::Range& range = query.ranges[i];
+		if (range.composite >= 0)
+			continue;
+		QueryStats::Criterion& criterion = m_stats->criteria[i];
+		bool counted = keyFiltered && range.keyed && m_columns[range.field].numeric;
+		bool in = inRange(rowNum, range);
+		if (!counted)
+		{
+			criterion.checked++;
+			criterion.passed += in;
+			m_stats->comparisons++;
+		}
+		else if (!in)
+			criterion.passed--;
+		if (!in)
+			return false;
+	}
+	return true;
+}
+
+// Lists each of the query's ranges in stats, in the order they are applied, with nothing
+// counted yet.
+void Database::describe(const PreparedQuery& query, QueryStats& stats) const
+{
+	stats.criteria.clear();
+	for (int i = 0; i < query.ranges.size(); ++i)
+	{
+		const PreparedQuery::Range& range = query.ranges[i];
+		QueryStats::Criterion criterion;
+		if (range.composite >= 0)
+		{
+			const vector<int>& fields = m_composites[range.composite].fields;
+			criterion.fieldName = "(";
+			for (int j = 0; j < fields.size(); ++j)
+				criterion.fieldName += (j > 0 ? "," : "") + m_schema[fields[j]].name;
+			criterion.fieldName += ")";
+			criterion.access = "composite";
+		}
+		else
+		{
+			criterion.fieldName = m_schema[range.field].name;
+			criterion.access = range.hashed ? "hash" : range.scanned ? "scan" : "tree";
+		}
+		criterion.estimate = range.estimate;
+		criterion.checked = criterion.passed = 0;
+		stats.criteria.push_back(criterion);
+	}
+}
+
+// Returns true if the row's value of the range's field lies within the range, using the same
+// bounds (and the same key comparison) as the index walk in search. An empty bound is unbounded.
+// --- Where the field has a numeric column, unequal numeric keys decide without looking at
+// the value itself; only a value whose key ties with a bound's needs the full comparison.
+bool Database::inRange(int rowNum, const PreparedQuery::Range& range) const
+{
+	if (range.keyed && m_columns[range.field].numeric)
+	{
+		unsigned long long key = m_columns[range.field].keys[rowNum];
+		if (key < range.minKey || key > range.maxKey)
+			return false;
+		if (key != range.minKey && key != range.maxKey)
+			return true;
+	}
+	return inRange(value(rowNum, range.field), range);
+}
+
+// Same as above, but tests a value of the range's field (without its numeric key).
+bool Database::inRange(const string& value, const PreparedQuery::Range& range)
+{
+	if (range.minValue != "")
+	{
+		int result = MultiMap::compare(value, range.minValue);
+		if (result < 0 || (result == 0 && range.minExclusive))
+			return false;
+	}
+	if (range.maxValue != "")
+	{
+		int result = MultiMap::compare(value, range.maxValue);
+		if (result > 0 || (result == 0 && range.maxExclusive))
+			return false;
+	}
+	return true;
+}
+
+// Appends the rows from begin up to (not including) end that match every range of the query.
+// begin must be the first row of a block, and end at most the first row of the next one.
+// Returns false if the block's zone maps rule out every row, so none of them was looked at.
+// --- First, each range over a numeric column marks the rows whose keys fall between its
+// bounds' keys, in a branch-free loop over the block that the compiler can vectorize. Only the
+// marked rows are then checked in full, which settles ties with the bounds and any ranges
+// without a numeric column. A block whose keys all lie strictly outside a range is skipped
+// outright; on a field loaded in roughly sorted order (eg. IDs, dates), most blocks are.
+// In a compressed block, a range over a dictionary coded field without a numeric column is
+// tested once per distinct value instead (see CompressedBlock::filter), and if every range
+// is, no row is checked again.
+bool Database::scanBlock(const PreparedQuery& query, int begin, int end, vector<int>& results) const
+{
+	int block = begin / SCAN_BLOCK;
+	for (int r = 0; r < query.ranges.size(); ++r)
+	{
+		const PreparedQuery::Range& range = query.ranges[r];
+		if (range.composite < 0 && range.keyed && m_columns[range.field].numeric
+			&& (m_columns[range.field].blockMax[block] < range.minKey || m_columns[range.field].blockMin[block] > range.maxKey))
+			return false;
+	}
+
+	unsigned char selected[SCAN_BLOCK];
+	int n = end - begin;
+	for (int i = 0; i < n; ++i)
+		selected[i] = 1;
+	if (m_stats)
+		m_stats->rowsExamined += n;
+
+	for (int r = 0; r < query.ranges.size(); ++r)
+	{
+		const PreparedQuery::Range& range = query.ranges[r];
+		if (range.composite >= 0 || !range.keyed || !m_columns[range.field].numeric)
+			continue;
+		const unsigned long long* keys = &m_columns[range.field].keys[begin];
+		unsigned long long minKey = range.minKey, maxKey = range.maxKey;
+		int before = 0;
+		if (m_stats)
+			before = std::count(selected, selected + n, 1);
+		for (int i = 0; i < n; ++i)
+			selected[i] &= (keys[i] >= minKey) & (keys[i] <= maxKey);
+		if (m_stats)
+		{
+			m_stats->criteria[r].checked += before;
+			m_stats->criteria[r].passed += std::count(selected, selected + n, 1);
+			m_stats->comparisons += before;
+		}
+	}
+
+	bool filtered = false; // every range has been tested exactly
+	const CompressedBlock* compressed = block < m_blocks.size() ? m_blocks[block] : nullptr;
+	if (compressed && !m_stats && n == compressed->size())
+	{
+		filtered = true;
+		for (int r = 0; r < query.ranges.size(); ++r)
+		{
+			const PreparedQuery::Range& range = query.ranges[r];
+			if (range.composite >= 0)
+				continue;
+			if ((range.keyed && m_columns[range.field].numeric) // its keys have done most of the work
+				|| !compressed->filter(range.field, [&range](const string& value) { return inRange(value, range); }, selected))
+				filtered = false;
+		}
+	}
+
+	for (int i = 0; i < n; ++i)
+		if (selected[i] && !m_deleted[begin + i] && (filtered
+			|| (m_stats ? countMatches(begin + i, query, 0, true) : matches(begin + i, query, 0))))
+			results.push_back(begin + i);
+	return true;
+}
+
+// Runs a group of queries from searchBatch that are driven by the same index, or the same hash
+// key, or a lone query driven by a scan, appending each query's rows to its results in the
+// order its own search would walk them. Returns the # of scan blocks skipped.
+// --- The index is walked once, in order, from the lowest first key of any query's range; a
+// query joins the walk at its range's first key and leaves after its last one, and each row
+// is checked against the other criteria of every query in the walk at the time. If no query
+// is in the walk, we jump straight to the next one's first key, so keys no range holds are
+// never walked. Every key is a node's, and keys are unique, so a range's ends are recognized
+// by the address of the key rather than by comparing it.
+int Database::runTogether(const vector<PreparedQuery>& queries, const vector<int>& group,
+	vector<vector<int> >& results) const
+{
+	const PreparedQuery::Range& driver = queries[group[0]].ranges[0];
+	int skipped = 0;
+	if (driver.scanned)
+	{
+		for (int begin = 0; begin < m_rows.size(); begin += SCAN_BLOCK)
+			if (!scanBlock(queries[group[0]], begin, min<int>(begin + SCAN_BLOCK, m_rows.size()), results[group[0]]))
+				skipped++;
+		Metrics::add(Metrics::db_rows_matched, results[group[0]].size());
+		return skipped;
+	}
+
+	int matched = 0;
+	if (driver.hashed)
+	{
+		const vector<unsigned int>* rows = hashIndex(driver.field)->find(driver.minValue);
+		for (int i = 0; rows && i < rows->size(); ++i)
+			for (int j = 0; j < group.size(); ++j)
+				if (matches((*rows)[i], queries[group[j]], 1))
+				{
+					results[group[j]].push_back((*rows)[i]);
+					matched++;
+				}
+		Metrics::add(Metrics::db_rows_matched, matched);
+		return 0;
+	}
+
+	struct Span
+	{
+		MultiMap::Iterator first;
+		int query;
+	};
+	const MultiMap* index = driver.composite >= 0 ? m_composites[driver.composite].index : m_fieldIndex[driver.field];
+	vector<Span> spans;
+	unordered_map<const string*, vector<int> > ends; // the queries whose ranges end at each key
+	for (int i = 0; i < group.size(); ++i)
+	{
+		Span span;
+		MultiMap::Iterator last;
+		span.query = group[i];
+		if (!findRange(queries[group[i]].ranges[0], span.first, last))
+			continue;
+		spans.push_back(span);
+		ends[&last.getKey()].push_back(group[i]);
+	}
+	stable_sort(spans.begin(), spans.end(), [index](const Span& a, const Span& b) {
+		return index->compareKeys(a.first.getKey(), b.first.getKey()) < 0;
+	});
+
+	vector<int> walking; // the queries whose ranges hold the current key
+	MultiMap::Iterator cur;
+	for (int next = 0; next < spans.size() || !walking.empty(); )
+	{
+		if (walking.empty())
+			cur = spans[next].first;
+		const string* key = &cur.getKey();
+		while (next < spans.size() && &spans[next].first.getKey() == key)
+			walking.push_back(spans[next++].query);
+		bool more;
+		do
+		{
+			int row = cur.getValue();
+			for (int i = 0; i < walking.size(); ++i)
+				if (matches(row, queries[walking[i]], 1))
+				{
+					results[walking[i]].push_back(row);
+					matched++;
+				}
+			more = cur.next();
+		} while (more && &cur.getKey() == key);
+
+		auto ending = ends.find(key);
+		if (ending != ends.end())
+			for (int i = 0; i < ending->second.size(); ++i)
+				walking.erase(find(walking.begin(), walking.end(), ending->second[i]));
+		if (!more)
+			break; // (every range ends by the last key)
+	}
+	Metrics::add(Metrics::db_rows_matched, matched);
+	return 0;
+}
+
+// Sorts a query's results, walked in index order by runTogether, into the order its own search
+// would have returned them in (see search(const PreparedQuery&, ResultCursor&)).
+void Database::sortResults(const PreparedQuery& query, vector<int>& results) const
+{
+	const vector<PreparedQuery::SortKey>& sortKeys = query.sortKeys;
+	const PreparedQuery::Range& driver = query.ranges[0];
+	if (sortKeys.empty())
+		return;
+	if (sortKeys[0].field != driver.field || driver.composite >= 0 || driver.scanned)
+	{
+		quicksort(results, 0, results.size(), sortKeys);
+		return;
+	}
+
+	// Already in the driver's order, which leaves each key's rows to sort by the other keys
+	if (sortKeys[0].ordering == ot_descending && !driver.hashed)
+		reverse(results.begin(), results.end());
+	if (sortKeys.size() == 1)
+		return;
+	vector<PreparedQuery::SortKey> firstKey(1, sortKeys[0]), tieKeys(sortKeys.begin() + 1, sortKeys.end());
+	for (int begin = 0, end; begin < results.size(); begin = end)
+	{
+		for (end = begin + 1; end < results.size() && compare(results[begin], results[end], firstKey) == 0; ++end)
+			;
+		quicksort(results, begin, end, tieKeys);
+	}
+}
+
+// Calls task(0) to task(numTasks - 1) on as many threads as the hardware offers (including
+// ours), each taking the next task nobody has claimed yet, and returns once all are done.
+void Database::runInParallel(int numTasks, const function<void(int)>& task)
+{
+	atomic<int> nextTask(0);
+	auto work = [&]() {
+		for (int i; (i = nextTask++) < numTasks; )
+			task(i);
+	};
+	vector<thread> threads;
+	int numThreads = min<int>(numTasks, max(1u, thread::hardware_concurrency()));
+	for (int i = 1; i < numThreads; ++i)
+		threads.push_back(thread(work));
+	work();
+	for (int i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+// Folds one more value into a running aggregate. The caller has already counted its row.
+void Database::accumulate(AggregateResult& result, AggregateType type, const string& value) const
+{
+	switch (type)
+	{
+	case ag_min:
+		if (result.count == 1 || MultiMap::compare(value, result.value) < 0)
+			result.value = value;
+		break;
+	case ag_max:
+		if (result.count == 1 || MultiMap::compare(value, result.value) > 0)
+			result.value = value;
+		break;
+	case ag_sum:
+	case ag_avg:
+		result.number += atof(value.c_str());
+		break;
+	default:
+		break;
+	}
+}
+
+// Turns a running aggregate (a count and a sum) into its final value.
+void Database::finish(AggregateResult& result, AggregateType type) const
+{
+	if (type == ag_count)
+		result.number = result.count;
+	else if (type == ag_avg && result.count > 0)
+		result.number /= result.count;
+}
+
+// Compares two rows of data by each sort key's field, and by its ordering (ascending/descending).
+// Returns 1 if the 1st row belongs after the 2nd, or -1 if vice versa.
+// If the two rows being compared are equal, we check the next sort key.
+// --- Fields are compared the same way the index orders its keys, so that results read off
+// an index walk are already in sorted order.
+int Database::compare(int a, int b, const vector<PreparedQuery::SortKey>& sortKeys) const
+{
+	if (m_stats)
+		m_stats->comparisons++;
+	for (int i = 0; i < sortKeys.size(); ++i)
+	{
+		int result = MultiMap::compare(value(a, sortKeys[i].field), value(b, sortKeys[i].field));
+		if (result != 0)
+			return sortKeys[i].ordering == ot_descending ? -result : result;
+		// elements are equal, check the next sort key
 	}
 	return 0;
 }
 
-void Database::swap(int& a, int& b)
+void Database::swap(int& a, int& b) const
 {
 	int t = a;
 	a = b;
@@ -306,7 +2469,7 @@ void Database::swap(int& a, int& b)
 }
 
 void Database::split(vector<int>& a, int start, int end, int pivot, int& firstEqualPivot, int& firstAfterPivot, 
-	const vector<SortCriterion>& sortCriteria)
+	const vector<PreparedQuery::SortKey>& sortKeys) const
 {
 	// It will always be the case that just before evaluating the loop
 	// condition:
@@ -321,7 +2484,7 @@ void Database::split(vector<int>& a, int start, int end, int pivot, int& firstEq
 	int firstUnknown = start;
 	while (firstUnknown < firstAfterPivot)
 	{
-		int test = compare(a[firstUnknown], pivot, sortCriteria);
+		int test = compare(a[firstUnknown], pivot, sortKeys);
 		if (test > 0)
 			swap(a[firstUnknown], a[--firstAfterPivot]); 
 		else
@@ -333,13 +2496,15 @@ void Database::split(vector<int>& a, int start, int end, int pivot, int& firstEq
 	}
 }
 
-void Database::quicksort(vector<int>& a, int start, int end, const vector<SortCriterion>& sortCriteria)
+// Pivots on the middle element, since results often arrive already ordered by an index walk
+// and a first-element pivot would then degrade to O(N^2).
+void Database::quicksort(vector<int>& a, int start, int end, const vector<PreparedQuery::SortKey>& sortKeys) const
 {
 	if (end - start <= 1)
 		return;
 
 	int firstEqualPivot, firstAfterPivot;
-	split(a, start, end, a[start], firstEqualPivot, firstAfterPivot, sortCriteria);
-	quicksort(a, start, firstEqualPivot, sortCriteria);
-	quicksort(a, firstAfterPivot, end, sortCriteria);
+	split(a, start, end, a[start + (end - start) / 2], firstEqualPivot, firstAfterPivot, sortKeys);
+	quicksort(a, start, firstEqualPivot, sortKeys);
+	quicksort(a, firstAfterPivot, end, sortKeys);
 }
@@ -3,22 +3,59 @@
 // each field marked for indexing will be added to its respective BST multimap so that it can be 
 // efficiently queried. When querying, finds all results that match every keyword defined by the 
 // search criteria, and within the specified range specified, and returns them in the order
-// specified by the sorting criteria. Since we are always interested in a range of results, it 
-// makes sense to index using a BST rather than a hash table.
+// specified by the sorting criteria (or that match any one of several such sets of criteria).
+// Since we are always interested in a range of results, it makes sense to index using a BST
+// rather than a hash table (although a field can also, or instead, have a hash index, which
+// serves exact-match criteria in O(1)). Composite indexes order rows by a tuple of fields, so
+// that criteria on several of those fields are answered by one range walk.
+// Optionally, results can be cached: repeated searches with the same criteria are answered from
+// an LRU cache (bounded by a byte budget), which addRow keeps up to date by patching new rows
+// into every cached result they match. Criteria on fields without a usable index are answered
+// by scanning every row, and a field that keeps forcing scans gets a BST index built for it.
+// Numeric fields without a BST index also keep a column of integer sort keys, so that a scan
+// compares them a block of rows at a time in a tight loop instead of comparing strings, and
+// skips any block whose smallest and largest keys show that none of its rows can match.
+// Rows can be updated or deleted in place; a deleted row leaves a tombstone so that no other
+// row's # changes, until compact reclaims the space and renumbers the remaining rows.
+// A file can also be loaded in the background, a chunk of rows at a time, while other threads
+// query the rows loaded so far; every public member function holds the database's lock.
+// A search can also report how it was run (see QueryStats), much like SQL's EXPLAIN ANALYZE.
+// Searches, rows matched, cache hits and loads are also counted in the process-wide Metrics.
+// A database can report the memory it uses (see MemoryUsage), and be given a memory budget,
+// beyond which adding or loading rows fails up front rather than running out of memory.
+// Many searches can be run as one batch, which walks each index range they share only once.
+// For tables larger than memory, rows can be kept in a file instead (see RowStore), read a page
+// at a time through a bounded page cache; the indexes, numeric columns and cache stay in memory.
+// Rows kept in memory can instead be compressed a block at a time, column by column (see
+// CompressedBlock), and a scan then tests a dictionary coded value once per block.
 
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include "MultiMap.h"
 #include <string>
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <iosfwd>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <functional>
 
-class MultiMap;
+class HashIndex;
+class RowStore;
+class CompressedBlock;
 
 class Database
 {
 public:
-	enum IndexType { it_none, it_indexed };
+	enum IndexType { it_none, it_indexed, it_hashed, it_both };
 	enum OrderingType { ot_ascending, ot_descending };
+	enum AggregateType { ag_count, ag_min, ag_max, ag_sum, ag_avg };
 
 	struct FieldDescriptor
 	{
@@ -31,6 +68,8 @@ public:
 		std::string fieldName;
 		std::string minValue;
 		std::string maxValue;
+		bool minExclusive = false; // excludes minValue itself
+		bool maxExclusive = false; // excludes maxValue itself
 	};
 
 	struct SortCriterion
@@ -39,37 +78,327 @@ public:
 		OrderingType ordering;
 	};
 
+	struct LoadProgress
+	{
+		long long bytesParsed;	// of the file, including its header
+		long long totalBytes;
+		int rowsIndexed;
+		bool done;		// finished, failed or cancelled
+	};
+
+	struct AggregateResult
+	{
+		std::string group;	// the group's key (GROUP BY only)
+		int count;		// number of rows aggregated
+		std::string value;	// ag_min, ag_max
+		double number;		// ag_count, ag_sum, ag_avg
+	};
+
+	struct IndexMemory
+	{
+		std::string name;	// the field's name, or "(a,b)" for a composite index
+		std::string kind;	// "tree", "hash" or "composite"
+		size_t bytes;		// as allocated, including its keys' heap buffers
+		int keys;
+		int values;
+		int depth;		// # levels (0 for a hash index)
+		double valuesPerKey;
+	};
+
+	// The bytes a database has allocated, as malloc would set them aside. stringHeapBytes and
+	// overheadBytes are not extra: they say how much of the rest is the heap buffers of
+	// strings too long to be stored inline, and how much is allocator headers, rounding and
+	// unused capacity.
+	struct MemoryUsage
+	{
+		size_t rowBytes;			// the rows, their vectors and strings
+		std::vector<size_t> fieldBytes;		// of rowBytes, each field's strings
+		size_t columnBytes;			// numeric columns, zone maps and tombstones
+		size_t cacheBytes;			// cached search results
+		std::vector<IndexMemory> indexes;
+		size_t stringHeapBytes;
+		size_t overheadBytes;
+		size_t totalBytes;
+	};
+
+	// How a search was run: how each criterion was served, how many rows each one was tested
+	// against and let through, and how long planning, walking the rows and sorting took. Walking
+	// the driving criterion's rows and testing them against the other criteria happen together,
+	// so the intersection is part of the scan time.
+	struct QueryStats
+	{
+		struct Criterion
+		{
+			std::string fieldName;	// "(a,b)" for a composite index's range
+			std::string access;	// "hash", "tree", "composite" or "scan"
+			int estimate;		// # rows the planner expected in range
+			int checked;		// # rows tested against it
+			int passed;		// # of those it let through
+		};
+
+		std::vector<Criterion> criteria; // in the order applied; criteria[0] drove the search
+		bool cacheHit;		// answered from the cache, so nothing else was counted
+		int nodesVisited;	// # index keys the driver walked
+		int rowsExamined;	// # rows the driver produced (every row, for a scan)
+		int blocksSkipped;	// # scan blocks ruled out by their zone maps
+		long long comparisons;	// # value comparisons, against bounds or while sorting
+		int results;		// # rows matching every criterion
+		double planSeconds;
+		double scanSeconds;
+		double sortSeconds;
+	};
+
+	// A query whose field names have been resolved and whose driving criterion has been
+	// chosen ahead of time (see prepare). It stays valid until the schema is respecified.
+	struct PreparedQuery
+	{
+		struct Range
+		{
+			int field;
+			std::string minValue; // empty = unbounded
+			std::string maxValue; // empty = unbounded
+			int estimate;	      // # rows in range when prepared
+			int composite;	      // composite index serving the range, or -1
+			bool hashed;	      // an equality served by the field's hash index
+			bool minExclusive = false;
+			bool maxExclusive = false;
+			bool scanned;	      // no index serves the range, so every row is checked
+			bool keyed;	      // both bounds have a MultiMap::numericKey (or are empty)
+			unsigned long long minKey;
+			unsigned long long maxKey;
+		};
+
+		struct SortKey
+		{
+			int field;
+			OrderingType ordering;
+		};
+
+		std::vector<Range> ranges;	// ranges[0] drives the query
+		std::vector<SortKey> sortKeys;
+		int schemaVersion;
+	};
+
+	// Pulls the results of a query a batch at a time, walking the index only as far as needed
+	// to fill each batch. Stop at any point by simply not asking for more (or calling close).
+	// A cursor becomes exhausted if the schema is respecified, or a row is deleted or updated (or
+	// the rows compacted), while it is open.
+	class ResultCursor
+	{
+	public:
+		ResultCursor();						// O(1)
+		int next(std::vector<int>& batch, int maxRows);	// O(maxRows C) amortized
+		bool next(int& rowNum);					// O(C) amortized
+		void close();						// O(1)
+
+	private:
+		friend class Database;
+		bool refill();
+
+		const Database* m_db;
+		PreparedQuery m_query;
+		std::vector<PreparedQuery::SortKey> m_tieKeys; // sort keys after the driver's
+		MultiMap::Iterator m_cur;
+		MultiMap::Iterator m_last;
+		size_t m_pos;		// position in a hash index's rows, or in the rows being scanned
+		bool m_reverse;
+		bool m_done;
+		std::vector<int> m_buffer;
+		size_t m_bufferPos;
+		int m_blocksSkipped;
+		int m_rowsVersion;
+	};
+
 	static const int ERROR_RESULT = -1;
+	static const int CURSOR_CHUNK = 256; // max index entries a cursor walks per refill
+	static const int ADAPTIVE_SCANS = 4; // default # of full scans a field forces before it is indexed
+	static const int SCAN_BLOCK = 1024;  // # rows a scan filters at a time
+	static const int LOAD_CHUNK = 65536; // # rows a background load adds at a time
 
 	Database();							// O(1)
 	~Database();							// O(F)
 	bool specifySchema(const std::vector<FieldDescriptor>& schema);	// O(F)
+	bool specifySchema(const std::vector<FieldDescriptor>& schema,	// O(F + G) (G = # fields in composites)
+		const std::vector<std::vector<std::string> >& compositeIndexes);
 	bool addRow(const std::vector<std::string>& rowOfData);		// O(F log N)
+	bool addRows(std::vector<std::vector<std::string> >&& rows);	// O(FK log K + F min(K log N, N))
+	bool deleteRow(int rowNum);					// O(F log N + cached results)
+	bool updateRow(int rowNum, const std::vector<std::string>& rowOfData); // O(F log N + cached results)
+	void compact();							// O(FN log N)
 	bool loadFromURL(std::string url);				// O(FN log N)
 	bool loadFromFile(std::string filename);			// O(FN log N)
+	bool appendFromURL(std::string url);				// O(FK log K + F min(K log N, N))
+	bool appendFromFile(std::string filename);			// O(FK log K + F min(K log N, N))
+	bool appendFromURLs(const std::vector<std::string>& urls);	// as above, parsed in parallel
+	bool appendFromFiles(const std::vector<std::string>& filenames); // as above, parsed in parallel
+	std::future<bool> loadFromFileAsync(std::string filename);	// O(1), then O(FN log N) in the background
+	LoadProgress getLoadProgress() const;				// O(1)
+	void cancelLoad();						// O(LOAD_CHUNK F log N)
 	int getNumRows() const;						// O(1)
 	bool getRow(int rowNum, std::vector<std::string>& row) const;	// O(F)
 	int search(const std::vector<SearchCriterion>& searchCriteria,	// O(CM log N + SR log R
 		const std::vector<SortCriterion>& sortCriteria, 
 		std::vector<int>& results);
+	int search(const std::vector<SearchCriterion>& searchCriteria,	// as above
+		const std::vector<SortCriterion>& sortCriteria,
+		std::vector<int>& results, QueryStats& stats);
+	int search(const std::vector<std::vector<SearchCriterion> >& anyOf, // O(sum of above + R log A)
+		const std::vector<SortCriterion>& sortCriteria, std::vector<int>& results);
+	bool searchBatch(const std::vector<std::vector<SearchCriterion> >& queries, // O(Q log N + W + MC + R log R)
+		const std::vector<std::vector<SortCriterion> >& sortCriteria,	// (W = # entries in the union of
+		std::vector<std::vector<int> >& results);			//  the queries' driving ranges)
+	bool prepare(const std::vector<SearchCriterion>& searchCriteria,	// O(C(F + log N) + S)
+		const std::vector<SortCriterion>& sortCriteria, PreparedQuery& query) const;
+	int search(const PreparedQuery& query, std::vector<int>& results);	// O(M (log N + C) + R log R)
+	bool search(const PreparedQuery& query, ResultCursor& cursor) const;	// O(log N), or as above if sorted
+	bool aggregate(const std::vector<SearchCriterion>& searchCriteria,	// O(log N) to O(M log N)
+		AggregateType type, const std::string& fieldName, AggregateResult& result);
+	bool aggregate(const std::vector<SearchCriterion>& searchCriteria,	// O(N + M C)
+		AggregateType type, const std::string& fieldName, const std::string& groupBy,
+		std::vector<AggregateResult>& groups);
+	void setCacheCapacity(size_t bytes);				// O(1) amortized
+	void setAdaptiveIndexing(int scans);				// O(1)
+	MemoryUsage memoryUsage() const;				// O(NF + I) (I = # index keys)
+	void setMemoryBudget(size_t bytes);				// O(1)
+	bool storeRowsOnDisk(const std::string& filename, size_t cacheBytes); // O(total length of rows)
+	void setCompression(bool on);					// O(NF)
+	int getCacheHits() const;					// O(1)
+	int getCacheMisses() const;					// O(1)
+	int getBlocksSkipped() const;					// O(1)
 
 private:
+	struct CompositeIndex
+	{
+		std::vector<int> fields;
+		MultiMap* index;
+	};
+
+	// Each row's MultiMap::numericKey for a field, kept while all of the field's values have one,
+	// along with the smallest and largest key in each SCAN_BLOCK of rows (its zone map).
+	struct NumericColumn
+	{
+		bool numeric;
+		std::vector<unsigned long long> keys;
+		std::vector<unsigned long long> blockMin;
+		std::vector<unsigned long long> blockMax;
+	};
+
+	// The contents of a file (or web page) loaded by appendFromFiles (or appendFromURLs).
+	struct ParsedSource
+	{
+		bool ok;
+		long long bytes; // # bytes read, including the header
+		size_t limit = 0; // parsing fails once the rows take more bytes than this (unless 0)
+		std::vector<FieldDescriptor> schema;
+		std::vector<std::vector<std::string> > composites;
+		std::vector<std::vector<std::string> > rows;
+	};
+
+	struct CacheEntry
+	{
+		std::string key;
+		PreparedQuery query;
+		std::vector<int> results;
+		size_t bytes;
+	};
+
 	std::vector<FieldDescriptor> m_schema;
 	std::vector<std::vector<std::string> > m_rows;
+	std::vector<bool> m_deleted;	// tombstones, by row #
+	int m_numDeleted;
+	int m_rowsVersion;		// bumped by every delete, update and compact
 	MultiMap** m_fieldIndex;
+	HashIndex** m_hashIndex;
+	std::vector<CompositeIndex> m_composites;
+	std::vector<NumericColumn> m_columns; // for fields without a BST index when the schema was set
+	int m_schemaVersion;
+	std::list<CacheEntry> m_cache; // most recently used at the front
+	std::unordered_map<std::string, std::list<CacheEntry>::iterator> m_cacheIndex;
+	size_t m_cacheCapacity;
+	size_t m_cacheBytes;
+	size_t m_memoryBudget;	// 0 = unlimited
+	size_t m_rowBytes;	// allocated by the rows themselves (see rowBytes)
+	int m_cacheHits;
+	int m_cacheMisses;
+	int m_blocksSkipped;
+	mutable std::recursive_mutex m_lock;
+	std::recursive_mutex m_loaderLock;	// guards m_loader; always taken before m_lock
+	std::thread m_loader;
+	std::atomic<bool> m_loading;
+	std::atomic<bool> m_loadCancelled;
+	std::atomic<long long> m_loadBytes;
+	std::atomic<int> m_loadRows;
+	std::atomic<long long> m_loadTotalBytes;
+	mutable QueryStats* m_stats;	// where the current search reports how it ran, if anywhere
+	std::vector<int> m_fieldScans; // # full scans each field has forced
+	int m_adaptiveScans;
+	RowStore* m_store;		// holds rows # 0 to m_store->size() - 1 (if any), m_rows the rest
+	std::string m_storeFile;
+	size_t m_storeCache;
+	std::vector<CompressedBlock*> m_blocks; // by SCAN_BLOCK of rows; nullptr (or none) = not compressed
+	bool m_compressed;		// compress each block of rows once it is full
 
 private:
 	Database(const Database& other);
 	Database& operator=(const Database& rhs);
+	bool loadFromStream(std::istream& in);
+	bool parseStream(std::istream& in, ParsedSource& parsed) const;
+	bool readSource(const std::string& source, bool url, ParsedSource& parsed) const;
+	bool appendFromSources(const std::vector<std::string>& sources, bool urls);
+	void loadInBackground(std::ifstream& in, std::promise<bool>& result);
+	static size_t rowBytes(const std::vector<std::string>& row);
+	size_t rowCost(const std::vector<std::string>& row) const;
+	size_t memoryUsed() const;
+	static void noteLoad(int rows, long long bytes, std::chrono::steady_clock::time_point start);
+	void splitLine(const std::string& line, std::vector<std::string>& fields) const;
 	void clearAll();
 	void clearSchema();
 	void clearRows();
 	void clearFieldIndex();
-	int compare(int a, int b, const std::vector<SortCriterion>& sortCriteria);
-	void swap(int& a, int& b);
+	void clearCache();
+	const std::vector<std::string>& row(int rowNum) const;
+	const std::string& value(int rowNum, int field) const;
+	void spillRows();
+	void sealBlocks();
+	void sealBlock(int block);
+	void unsealBlocks();
+	void unsealBlock(int block);
+	void indexRow(int rowNum, bool add);
+	std::string cacheKey(const std::vector<SearchCriterion>& searchCriteria,
+		const std::vector<SortCriterion>& sortCriteria) const;
+	bool cacheLookup(const std::string& key, std::vector<int>& results);
+	void cacheStore(const std::string& key, const PreparedQuery& query, const std::vector<int>& results);
+	void cachePatch(int rowNum);
+	void cacheRemove(int rowNum);
+	void cacheEvict();
+	MultiMap* treeIndex(int field) const;
+	HashIndex* hashIndex(int field) const;
+	int fieldNumber(const std::string& fieldName) const;
+	void resolveSortKeys(const std::vector<SortCriterion>& sortCriteria, std::vector<PreparedQuery::SortKey>& sortKeys) const;
+	void noteScans(const PreparedQuery& query);
+	void buildIndex(int field);
+	bool findRange(const PreparedQuery::Range& range, MultiMap::Iterator& first, MultiMap::Iterator& last) const;
+	std::string compositeKey(const CompositeIndex& composite, const std::vector<std::string>& row) const;
+	bool compositeRange(int composite, const PreparedQuery& query, PreparedQuery::Range& range) const;
+	void resetColumns();
+	void updateColumns(int rowNum);
+	bool matches(int rowNum, const PreparedQuery& query, int firstRange) const;
+	bool countMatches(int rowNum, const PreparedQuery& query, int firstRange, bool keyFiltered) const;
+	void describe(const PreparedQuery& query, QueryStats& stats) const;
+	bool inRange(int rowNum, const PreparedQuery::Range& range) const;
+	static bool inRange(const std::string& value, const PreparedQuery::Range& range);
+	bool scanBlock(const PreparedQuery& query, int begin, int end, std::vector<int>& results) const;
+	int runTogether(const std::vector<PreparedQuery>& queries, const std::vector<int>& group,
+		std::vector<std::vector<int> >& results) const;
+	void sortResults(const PreparedQuery& query, std::vector<int>& results) const;
+	static void runInParallel(int numTasks, const std::function<void(int)>& task);
+	void accumulate(AggregateResult& result, AggregateType type, const std::string& value) const;
+	void finish(AggregateResult& result, AggregateType type) const;
+	int compare(int a, int b, const std::vector<PreparedQuery::SortKey>& sortKeys) const;
+	void swap(int& a, int& b) const;
 	void split(std::vector<int>& a, int start, int end, int pivot, int& firstNotGreater, int& firstLess, 
-		const std::vector<SortCriterion>& sortCriteria);
-	void quicksort(std::vector<int>& a, int start, int end, const std::vector<SortCriterion>& sortCriteria);
+		const std::vector<PreparedQuery::SortKey>& sortKeys) const;
+	void quicksort(std::vector<int>& a, int start, int end, const std::vector<PreparedQuery::SortKey>& sortKeys) const;
 };
 
 #endif // DATABASE_H
@@ -0,0 +1,194 @@
+#include "HashIndex.h"
+#include "MultiMap.h"
+#include <algorithm>
+using namespace std;
+
+/////////////////////////////
+// HashIndex Implementations
+/////////////////////////////
+
+HashIndex::HashIndex()
+{
+	clear();
+}
+
+void HashIndex::clear()
+{
+	Slot empty = { 0, EMPTY };
+	m_slots.assign(16, empty);
+	m_entries.clear();
+	m_size = 0;
+	m_heapBytes = 0;
+}
+
+// Appends value to key's list of values, adding the key if it is new. Grows the table
+// whenever it would become more than half full, which keeps probe sequences short.
+void HashIndex::insert(const string& key, unsigned int value)
+{
+	int slot = findSlot(key);
+	if (m_slots[slot].entry == EMPTY)
+	{
+		if (2 * (m_entries.size() + 1) > m_slots.size())
+		{
+			grow();
+			slot = findSlot(key);
+		}
+		size_t start;
+		m_slots[slot].tag = (unsigned int)(hash(key, start) >> 32);
+		m_slots[slot].entry = m_entries.size();
+		m_entries.push_back(Entry());
+		m_entries.back().key = key;
+		m_entries.back().start = start;
+		m_heapBytes += MultiMap::stringHeapSize(m_entries.back().key.capacity());
+	}
+	vector<unsigned int>& values = m_entries[m_slots[slot].entry].values;
+	size_t capacity = values.capacity();
+	values.push_back(value);
+	if (values.capacity() != capacity)
+		m_heapBytes += MultiMap::allocationSize(values.capacity() * sizeof(unsigned int))
+			- MultiMap::allocationSize(capacity * sizeof(unsigned int));
+	m_size++;
+}
+
+// Removes one value from key's list of values. Returns false if key has no such value.
+// --- The key's entry stays behind even if this empties its list, so no other entry moves and
+// no probe sequence is broken.
+bool HashIndex::erase(const string& key, unsigned int value)
+{
+	int slot = findSlot(key);
+	if (m_slots[slot].entry == EMPTY)
+		return false;
+	vector<unsigned int>& values = m_entries[m_slots[slot].entry].values;
+	vector<unsigned int>::iterator it = std::find(values.begin(), values.end(), value);
+	if (it == values.end())
+		return false;
+	values.erase(it);
+	m_size--;
+	return true;
+}
+
+// Returns the values inserted with key, in insertion order, or nullptr if there are none
+// (or an empty list, if all of them have been erased).
+const vector<unsigned int>* HashIndex::find(const string& key) const
+{
+	int slot = findSlot(key);
+	return m_slots[slot].entry == EMPTY ? nullptr : &m_entries[m_slots[slot].entry].values;
+}
+
+int HashIndex::count(const string& key) const
+{
+	const vector<unsigned int>* values = find(key);
+	return values ? values->size() : 0;
+}
+
+int HashIndex::size() const
+{
+	return m_size;
+}
+
+// Returns the bytes allocated for our slots, entries, keys and value lists.
+size_t HashIndex::bytes() const
+{
+	return MultiMap::allocationSize(m_slots.capacity() * sizeof(Slot))
+		+ MultiMap::allocationSize(m_entries.capacity() * sizeof(Entry)) + m_heapBytes;
+}
+
+// Measures the table: the same bytes as above, broken down.
+HashIndex::Usage HashIndex::usage() const
+{
+	Usage u;
+	u.keys = m_entries.size();
+	u.values = m_size;
+	u.bytes = bytes();
+	u.stringHeapBytes = 0;
+	u.overheadBytes = u.bytes - m_slots.size() * sizeof(Slot) - m_entries.size() * sizeof(Entry);
+	for (size_t i = 0; i < m_entries.size(); ++i)
+	{
+		size_t heap = MultiMap::stringHeapSize(m_entries[i].key.capacity());
+		u.stringHeapBytes += heap;
+		u.overheadBytes -= m_entries[i].values.size() * sizeof(unsigned int) + (heap > 0 ? m_entries[i].key.size() + 1 : 0);
+	}
+	return u;
+}
+
+// Returns at most the bytes that inserting a new key of the given length, with one value,
+// allocates, counting its share of the slots and entries as they grow (each doubling leaves
+// them as little as a quarter and half full).
+size_t HashIndex::entryBytes(size_t keyLength)
+{
+	return 4 * sizeof(Slot) + 2 * sizeof(Entry) + MultiMap::stringHeapSize(keyLength)
+		+ MultiMap::allocationSize(sizeof(unsigned int));
+}
+
+
+/////////////////////////////
+// HashIndex Helper Functions
+/////////////////////////////
+
+// Returns the 64-bit FNV-1a hash of key, skipping the leading zeros of a number so that keys
+// MultiMap::compare considers equal hash alike. Sets start to the first character hashed.
+unsigned long long HashIndex::hash(const string& key, size_t& start)
+{
+	start = skipZeros(key);
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = start; i < key.size(); ++i)
+	{
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Returns the # of leading zeros if key is a number (only digits and '.'), otherwise 0.
+// --- MultiMap::compare pads the shorter of two numbers with leading zeros, so two numbers
+// are equal exactly when they are equal without any leading zeros.
+size_t HashIndex::skipZeros(const string& key)
+{
+	if (!MultiMap::isNumber(key))
+		return 0;
+	size_t start = 0;
+	while (start < key.size() && key[start] == '0')
+		++start;
+	return start;
+}
+
+// Returns the slot holding key's entry, or else the empty slot where it would be added.
+int HashIndex::findSlot(const string& key) const
+{
+	size_t start;
+	unsigned long long h = hash(key, start);
+	unsigned int tag = (unsigned int)(h >> 32);
+	size_t mask = m_slots.size() - 1;
+	for (size_t i = h & mask; ; i = (i + 1) & mask)
+	{
+		const Slot& slot = m_slots[i];
+		if (slot.entry == EMPTY)
+			return i;
+		if (slot.tag == tag)
+		{
+			const Entry& other = m_entries[slot.entry];
+			if (key.size() - start == other.key.size() - other.start
+				&& key.compare(start, string::npos, other.key, other.start, string::npos) == 0)
+				return i;
+		}
+	}
+}
+
+// Doubles the # of slots and re-places every entry. The entries themselves don't move.
+void HashIndex::grow()
+{
+	Slot empty = { 0, EMPTY };
+	vector<Slot> old(2 * m_slots.size(), empty);
+	old.swap(m_slots);
+	size_t mask = m_slots.size() - 1;
+	for (size_t i = 0; i < old.size(); ++i)
+	{
+		if (old[i].entry == EMPTY)
+			continue;
+		size_t start;
+		size_t j = hash(m_entries[old[i].entry].key, start) & mask;
+		while (m_slots[j].entry != EMPTY)
+			j = (j + 1) & mask;
+		m_slots[j] = old[i];
+	}
+}
@@ -0,0 +1,66 @@
+// A hash table mapping each key to the list of values (row #s) inserted with it, for exact-match
+// lookups in O(1). It uses open addressing with linear probing over a flat array of small slots,
+// each holding a few bits of its key's hash and the position of its key's entry, so that a
+// lookup usually touches one cache line of slots and compares a single key. Keys are equal
+// exactly when MultiMap::compare says so, eg. the numbers 020 and 20 are the same key.
+
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+
+#include <string>
+#include <vector>
+
+class HashIndex
+{
+public:
+	struct Usage
+	{
+		int keys;
+		int values;
+		size_t bytes;		// slots, entries, the keys' heap buffers and value lists, as allocated
+		size_t stringHeapBytes;	// of bytes, the keys' heap buffers
+		size_t overheadBytes;	// of bytes, allocator headers and rounding, and unused capacity (estimated)
+	};
+
+	HashIndex();							// O(1)
+	void clear();							// O(N)
+	void insert(const std::string& key, unsigned int value);	// O(1) amortized
+	bool erase(const std::string& key, unsigned int value);	// O(V) (V = # values of key)
+	const std::vector<unsigned int>* find(const std::string& key) const; // O(1)
+	int count(const std::string& key) const;			// O(1)
+	int size() const;						// O(1)
+	size_t bytes() const;						// O(1)
+	Usage usage() const;						// O(N)
+	static size_t entryBytes(size_t keyLength);			// O(1)
+
+private:
+	struct Entry
+	{
+		std::string key;
+		size_t start;	// # leading zeros skipped when comparing (see skipZeros)
+		std::vector<unsigned int> values;
+	};
+
+	struct Slot
+	{
+		unsigned int tag;	// upper bits of the key's hash
+		unsigned int entry;	// position in m_entries, or EMPTY
+	};
+
+	static const unsigned int EMPTY = 0xffffffff;
+
+	std::vector<Slot> m_slots;	// size is a power of 2, at most half full
+	std::vector<Entry> m_entries;
+	int m_size;
+	size_t m_heapBytes;	// the keys' heap buffers and value lists, as allocated
+
+private:
+	HashIndex(const HashIndex& other);				// prevent copying
+	HashIndex& operator=(const HashIndex& rhs);			// prevent copying
+	static unsigned long long hash(const std::string& key, size_t& start);	// O(L)
+	static size_t skipZeros(const std::string& key);		// O(L)
+	int findSlot(const std::string& key) const;			// O(1)
+	void grow();							// O(N)
+};
+
+#endif // HASHINDEX_H
@@ -0,0 +1,147 @@
+#include "Metrics.h"
+#include <fstream>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+using namespace std;
+
+/////////////////////////////
+// Metrics Implementations
+/////////////////////////////
+
+atomic<int> Metrics::s_maxDepth(0);
+
+// The shards of live threads, and the totals of threads that have exited (less whatever
+// the live shards held at the last reset)
+struct Metrics::Registry
+{
+	mutex lock;
+	vector<atomic<long long>*> shards;
+	long long retired[NUM_COUNTERS];
+
+	Registry()
+	{
+		for (int i = 0; i < NUM_COUNTERS; ++i)
+			retired[i] = 0;
+	}
+};
+
+// --- A function-local static, so that it exists before the first shard registers (from
+// whichever thread counts first), and outlives every shard.
+Metrics::Registry& Metrics::registry()
+{
+	static Registry r;
+	return r;
+}
+
+Metrics::Shard::Shard()
+{
+	for (int i = 0; i < NUM_COUNTERS; ++i)
+		counts[i].store(0, memory_order_relaxed);
+	Registry& r = registry();
+	lock_guard<mutex> lock(r.lock);
+	r.shards.push_back(counts);
+}
+
+// Folds the exiting thread's counts into the retired totals, so that no count is ever lost.
+Metrics::Shard::~Shard()
+{
+	Registry& r = registry();
+	lock_guard<mutex> lock(r.lock);
+	for (int i = 0; i < NUM_COUNTERS; ++i)
+		r.retired[i] += counts[i].load(memory_order_relaxed);
+	r.shards.erase(find(r.shards.begin(), r.shards.end(), counts));
+}
+
+// Sums every shard. Counts still being added by other threads may or may not be included.
+Metrics::Snapshot Metrics::snapshot()
+{
+	Snapshot s;
+	Registry& r = registry();
+	{
+		lock_guard<mutex> lock(r.lock);
+		for (int i = 0; i < NUM_COUNTERS; ++i)
+		{
+			s.counts[i] = r.retired[i];
+			for (int j = 0; j < r.shards.size(); ++j)
+				s.counts[i] += r.shards[j][i].load(memory_order_relaxed);
+		}
+	}
+	s.maxTreeDepth = s_maxDepth.load(memory_order_relaxed);
+	s.loadBytesPerSecond = s.counts[db_load_nanoseconds] > 0
+		? s.counts[db_bytes_loaded] * 1e9 / s.counts[db_load_nanoseconds] : 0;
+	return s;
+}
+
+// Writes a snapshot in the Prometheus text exposition format.
+void Metrics::writePrometheus(ostream& out)
+{
+	static const char* const names[NUM_COUNTERS][2] = {
+		{ "multimap_inserts_total", "Values inserted into MultiMaps." },
+		{ "multimap_erases_total", "Values erased from MultiMaps." },
+		{ "multimap_comparisons_total", "Key comparisons made by MultiMap::compare." },
+		{ "multimap_node_allocations_total", "MultiMap key nodes allocated." },
+		{ "multimap_value_allocations_total", "MultiMap value nodes allocated." },
+		{ "database_searches_total", "Searches with criteria." },
+		{ "database_queries_total", "Queries run against the indexes." },
+		{ "database_rows_matched_total", "Rows matched by those queries." },
+		{ "database_cache_hits_total", "Searches answered from the result cache." },
+		{ "database_cache_misses_total", "Searches the result cache could not answer." },
+		{ "database_rows_loaded_total", "Rows loaded from files and URLs." },
+		{ "database_bytes_loaded_total", "Bytes loaded from files and URLs." },
+		{ "database_load_seconds_total", "Time spent loading files and URLs." },
+		{ "database_page_hits_total", "Pages of rows stored on disk found in the page cache." },
+		{ "database_page_reads_total", "Pages of rows stored on disk read from the file." },
+	};
+
+	Snapshot s = snapshot();
+	for (int i = 0; i < NUM_COUNTERS; ++i)
+	{
+		out << "# HELP " << names[i][0] << ' ' << names[i][1] << '\n'
+			<< "# TYPE " << names[i][0] << " counter\n" << names[i][0] << ' ';
+		if (i == db_load_nanoseconds)
+			out << s.counts[i] / 1e9 << '\n';
+		else
+			out << s.counts[i] << '\n';
+	}
+	out << "# HELP multimap_max_depth Deepest any MultiMap has grown.\n"
+		<< "# TYPE multimap_max_depth gauge\n"
+		<< "multimap_max_depth " << s.maxTreeDepth << '\n'
+		<< "# HELP database_load_bytes_per_second Bytes loaded per second spent loading.\n"
+		<< "# TYPE database_load_bytes_per_second gauge\n"
+		<< "database_load_bytes_per_second " << s.loadBytesPerSecond << '\n';
+}
+
+// Writes a snapshot to the file, replacing it. Returns false if the file cannot be written.
+// --- The snapshot goes to a temporary file that is then renamed over the old one, so that a
+// scraper reading the file never sees half of it.
+bool Metrics::writePrometheus(const string& filename)
+{
+	string temp = filename + ".tmp";
+	{
+		ofstream outf(temp);
+		if (!outf)
+			return false;
+		writePrometheus(outf);
+		if (!outf)
+			return false;
+	}
+	return rename(temp.c_str(), filename.c_str()) == 0;
+}
+
+// Sets every count back to 0, eg. between benchmark runs.
+// --- Other threads' shards are never written, since that could race with their own updates;
+// instead, what they hold now is subtracted from the retired totals.
+void Metrics::reset()
+{
+	Registry& r = registry();
+	lock_guard<mutex> lock(r.lock);
+	for (int i = 0; i < NUM_COUNTERS; ++i)
+	{
+		r.retired[i] = 0;
+		for (int j = 0; j < r.shards.size(); ++j)
+			r.retired[i] -= r.shards[j][i].load(memory_order_relaxed);
+	}
+	s_maxDepth.store(0, memory_order_relaxed);
+}
@@ -0,0 +1,102 @@
+// Process-wide counters of the work done by every MultiMap and Database: inserts, key
+// comparisons, allocations, searches, rows matched, cache hits, bytes loaded and pages read. They are
+// cheap enough to leave on in production: each thread counts into its own shard, so an
+// increment is a plain add to memory no other thread writes, and only taking a snapshot
+// visits every shard. Snapshots can also be written in the Prometheus text format.
+// Building with DB_METRICS defined as 0 compiles every counter away.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#ifndef DB_METRICS
+#define DB_METRICS 1
+#endif
+
+#include <string>
+#include <iosfwd>
+#include <atomic>
+
+class Metrics
+{
+public:
+	enum Counter
+	{
+		mm_inserts,		// values inserted into MultiMaps
+		mm_erases,		// values erased from MultiMaps
+		mm_comparisons,		// calls to MultiMap::compare
+		mm_node_allocations,	// BSTNodes allocated
+		mm_value_allocations,	// VNodes allocated
+		db_searches,		// calls to search with criteria
+		db_queries,		// queries run against the indexes (each alternative of an OR)
+		db_rows_matched,	// rows those queries matched
+		db_cache_hits,
+		db_cache_misses,
+		db_rows_loaded,
+		db_bytes_loaded,
+		db_load_nanoseconds,	// time spent loading, so that bytes/sec can be derived
+		db_page_hits,		// rows stored on disk found in the page cache
+		db_page_reads,		// pages of rows read from disk
+		NUM_COUNTERS
+	};
+
+	struct Snapshot
+	{
+		long long counts[NUM_COUNTERS];
+		int maxTreeDepth;		// deepest any MultiMap has grown
+		double loadBytesPerSecond;	// over every load so far
+	};
+
+	static void add(Counter counter, long long n = 1);	// O(1)
+	static void noteDepth(int depth);			// O(1)
+	static Snapshot snapshot();				// O(T) (T = # threads that have counted)
+	static void writePrometheus(std::ostream& out);		// O(T)
+	static bool writePrometheus(const std::string& filename); // O(T)
+	static void reset();					// O(T)
+
+private:
+	struct Shard
+	{
+		std::atomic<long long> counts[NUM_COUNTERS];
+
+		Shard();
+		~Shard();
+	};
+
+	struct Registry;
+
+	static Shard& shard();
+	static Registry& registry();
+	static std::atomic<int> s_maxDepth;
+};
+
+// --- Only the shard's own thread ever writes it, so a relaxed load and store cannot lose an
+// update, and needs no locked instruction; the atomics only keep snapshots from tearing.
+inline void Metrics::add(Counter counter, long long n)
+{
+#if DB_METRICS
+	std::atomic<long long>& count = shard().counts[counter];
+	count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+#else
+	(void)counter;
+	(void)n;
+#endif
+}
+
+inline void Metrics::noteDepth(int depth)
+{
+#if DB_METRICS
+	int max = s_maxDepth.load(std::memory_order_relaxed);
+	while (depth > max && !s_maxDepth.compare_exchange_weak(max, depth, std::memory_order_relaxed))
+		;
+#else
+	(void)depth;
+#endif
+}
+
+inline Metrics::Shard& Metrics::shard()
+{
+	thread_local Shard s;
+	return s;
+}
+
+#endif // METRICS_H
@@ -1,271 +1,125 @@
 #include "MultiMap.h"
+#include <algorithm>
 using namespace std;
 
-/////////////////////////////
-// Iterator Implementations
-/////////////////////////////
-
-MultiMap::Iterator::Iterator(BSTNode* root, bool tail)
-{
-	bst_ptr = root;
-	if (root != nullptr)
-		v_ptr = tail ? root->v_tail : root->v_head;
-}
-
-bool MultiMap::Iterator::valid() const
-{
-	return bst_ptr != nullptr;
-}
-
-string MultiMap::Iterator::getKey() const
-{
-	return valid() ? bst_ptr->key : "";
-}
-
-unsigned int MultiMap::Iterator::getValue() const
-{
-	return valid() ? v_ptr->value : 0;
-}
-
-bool MultiMap::Iterator::next()
-{
-	if (!valid())
-		return false;
-
-	if (v_ptr == bst_ptr->v_tail) // end of the value linked list
-	{
-		bst_ptr = bst_ptr->next;
-		v_ptr = bst_ptr ? bst_ptr->v_head : nullptr;
-	}
-	else
-		v_ptr = v_ptr->next;
-
-	return true;
-}
-
-bool MultiMap::Iterator::prev()
-{
-	if (!valid())
-		return false;
-
-	if (v_ptr == bst_ptr->v_head) // first node of value linked list
-	{
-		bst_ptr = bst_ptr->prev;
-		v_ptr = bst_ptr ? bst_ptr->v_tail : nullptr;
-	}
-	else
-		v_ptr = v_ptr->prev;
-
-	return true;
-}
+// The database's MultiMap is compiled once, here, rather than in every file that uses it.
+template class BasicMultiMap<string, unsigned int, FieldCompare>;
 
 
 /////////////////////////////
-// MultiMap Implementations
+// MultiMapBase Implementations
 /////////////////////////////
 
-MultiMap::MultiMap()
-{
-	head = nullptr;
-}
-
-MultiMap::~MultiMap()
-{
-	clear();
-}
-
-void MultiMap::clear()
-{
-	removeAll(head);
-}
-
-// If no matching key is found, inserts a new BSTNode. Otherwise, since each BSTNode 
-// contains a linked list of values as part of the multimap implementation, a new
-// VNode is added to the end of the matching BSTNode's value list. 
-// --- The way we implemented iterator traversal requires that each BSTNode contains a
-// pointer to the prev and next BSTNode. In order to keep track of which is prev/next,
-// we create two temp BSTNode pointers: min and max. Each time we traverse left down the
-// tree, we update max to be the node we last visited, and each traversal right updates
-// min. This guarantees that we can always keep track of prev/next.
-void MultiMap::insert(string key, unsigned int value)
+// Returns 0 if both strings are equal, -1 if a < b, 1 if a > b.
+// --- If one is a number, the other is also (by designed use). In order to compare two numbers
+// as strings, eg. 020 vs 20, we need to fill the shorter string with padded 0's. Rather than
+// building the padded copy, we compare the longer string's extra leading characters against
+// '0' and then compare the remainders in place, so no comparison ever allocates.
+int MultiMapBase::compare(string_view a, string_view b)
 {
-	if (!head)
-	{
-		head = new BSTNode(key, value);
-		return;
-	}
-
-	BSTNode *cur = head, *min = nullptr, *max = nullptr;
-	for (;;)
+	Metrics::add(Metrics::mm_comparisons);
+	// By design, a and b are from the same field type, no need to check b.
+	if (isNumber(a))
 	{
-		int result = compare(key, cur->key);
-		if (result == 0)  // (key == cur->key)
+		size_t a_decimal = a.find('.'), b_decimal = b.find('.'),
+			a_length = a_decimal == string_view::npos ? a.length() : a_decimal,
+			b_length = b_decimal == string_view::npos ? b.length() : b_decimal;
+		if (a_length != b_length)
 		{
-			VNode* temp = new VNode(value);
-			cur->v_tail->next = temp;
-			temp->prev = cur->v_tail;
-			cur->v_tail = temp;
-			return;
-		}
-		if (result < 0) // (key < cur->key)
-		{
-			max = cur;
-			if (cur->left)
-				cur = cur->left;
-			else
-			{
-				cur->left = new BSTNode(key, value);
-				cur->left->prev = min;
-				cur->left->next = cur;
-				cur->prev = cur->left;
-				if (min)
-					min->next = cur->left;
-				return;
-			}
-		}
-		else if (result > 0) // (key > cur->key)
-		{
-			min = cur;
-			if (cur->right)
-				cur = cur->right;
-			else
-			{
-				cur->right = new BSTNode(key, value);
-				cur->right->prev = cur;
-				cur->right->next = max;
-				cur->next = cur->right;
-				if (max)
-					max->prev = cur->right;
-				return;
-			}
+			string_view longer = a_length > b_length ? a : b, shorter = a_length > b_length ? b : a;
+			int sign = a_length > b_length ? 1 : -1; // result if the longer string is larger
+			size_t padding = a_length > b_length ? a_length - b_length : b_length - a_length;
+			for (size_t i = 0; i < padding; ++i)
+				if (longer[i] != '0')
+					return (unsigned char)longer[i] > '0' ? sign : -sign;
+			int result = longer.substr(padding).compare(shorter);
+			return result == 0 ? 0 : (result > 0 ? sign : -sign);
 		}
 	}
+	int result = a.compare(b);
+	return result == 0 ? 0 : (result < 0 ? -1 : 1);
 }
 
-// Returns an iterator with its bst_ptr pointing to the BSTNode with the matching key,
-// and its v_ptr pointing to the BSTNode's v_head (earliest value). If a matching key 
-// cannot be found, returns an invalid iterator.
-MultiMap::Iterator MultiMap::findEqual(string key) const
+// Returns true if s consists only of digits and '.' (so an empty string counts as a number).
+// --- A plain loop, since this runs on every key comparison and find_first_not_of is far slower.
+bool MultiMapBase::isNumber(string_view s)
 {
-	BSTNode *cur = head;
-	while (cur != nullptr)
-	{
-		int result = compare(key, cur->key);
-		if (result < 0) // (key < cur->key)
-			cur = cur->left;
-		else if (result > 0) // (key > cur->key)
-			cur = cur->right;
-		else // found matching key
-			return Iterator(cur);
-	}
-	return Iterator(nullptr);
+	for (size_t i = 0; i < s.size(); ++i)
+		if ((s[i] < '0' || s[i] > '9') && s[i] != '.')
+			return false;
+	return true;
 }
 
-// Returns an iterator with its bst_ptr pointing to the BSTNode with the matching key
-// (or if one cannot be found, the next largest key), and its v_ptr pointing to the
-// BSTNode's v_head (earliest value). If key is an empty string, returns iterator to the
-// smallest BSTNode. If key is larger than the largest BSTNode, returns invalid iterator.
-// --- Utlizes a BSTNode pointer "max" to keep track of the next largest key. Everytime
-// we traverse left, the node we last visited will be the new "max". Alternatively, we could
-// just use the node's built-in "next" pointer.
-MultiMap::Iterator MultiMap::findEqualOrSuccessor(string key) const
+// Sets key to a 64-bit integer that orders numbers the way compare does: if compare(a, b) < 0,
+// then a's key <= b's key (so unequal keys decide the comparison, and only equal keys need
+// compare itself). Returns false if s is not a number, or its integer part is too long.
+// --- Numbers compare by their integer part without leading zeros, shortest first, and then
+// by what follows as a string. So the top byte holds the integer part's length, and the rest
+// holds as many of the remaining characters as fit, 4 bits each, in the same order ('.' below
+// every digit, and 0 for none left).
+bool MultiMapBase::numericKey(string_view s, unsigned long long& key)
 {
-	BSTNode *cur = head, *max = nullptr;
-	while (cur != nullptr)
-	{
-		int result = compare(key, cur->key);
-		if (result < 0) // (key < cur->key)
-		{
-			max = cur;
-			if (cur->left == nullptr)
-				return Iterator(cur);
-			cur = cur->left;
-		}
-		else if (result > 0) // (key > cur->key)
-		{
-			if (cur->right == nullptr)
-				return Iterator(max); // or Iterator(cur->next)
-			cur = cur->right;
-		}
-		else // found matching key
-			return Iterator(cur);
-	}
-	return Iterator(nullptr);
+	if (!isNumber(s))
+		return false;
+	size_t start = 0, point = s.find('.');
+	if (point == string_view::npos)
+		point = s.size();
+	while (start < point && s[start] == '0')
+		++start;
+	if (point - start > 0xff)
+		return false;
+
+	key = (unsigned long long)(point - start) << 56;
+	for (int shift = 52; start < s.size() && shift >= 0; ++start, shift -= 4)
+		key |= (unsigned long long)(s[start] == '.' ? 1 : s[start] - '0' + 2) << shift;
+	return true;
 }
 
-// Returns an iterator with its bst_ptr pointing to the BSTNode with the matching key
-// (or if one cannot be found, the next smallest key), and its v_ptr pointing to the
-// BSTNode's v_tail (latest value). If key is an empty string, returns iterator to the
-// largest BSTNode. If key is smaller than the smallest BSTNode, returns invalid iterator.
-// --- Utlizes a BSTNode pointer "min" to keep track of the next smallest key. Everytime
-// we traverse right, the node we last visited will be the new "min". Alternatively, we could
-// just use the node's built-in "prev" pointer.
-MultiMap::Iterator MultiMap::findEqualOrPredecessor(string key) const
+// Returns the bytes malloc actually sets aside for a request of the given size: the request
+// plus an 8-byte header, rounded up to a multiple of 16, and at least 32 (as glibc does).
+size_t MultiMapBase::allocationSize(size_t bytes)
 {
-	BSTNode *cur = head, *min = nullptr;
-	while (cur != nullptr)
-	{
-		int result = compare(key, cur->key);
-		if (key != "" && result < 0) // (key < cur->key)
-		{
-			if (cur->left == nullptr)
-				return Iterator(min, true); // or Iterator(cur->prev, true)
-			cur = cur->left;
-		}
-		else if (key == "" || result > 0) // (key > cur->key)
-		{
-			min = cur;
-			if (cur->right == nullptr)
-				return Iterator(cur, true);
-			cur = cur->right;
-		}
-		else // found matching key
-			return Iterator(cur, true);
-	}
-	return Iterator(nullptr);
+	if (bytes == 0)
+		return 0;
+	return max<size_t>(32, (bytes + 8 + 15) & ~(size_t)15);
 }
 
-
-/////////////////////////////
-// MultiMap Helper Functions
-/////////////////////////////
-
-void MultiMap::removeAll(BSTNode* root)
+// Returns the bytes a string of the given capacity allocates on the heap, which is none if
+// it is short enough to be stored inside the string object itself.
+size_t MultiMapBase::stringHeapSize(size_t capacity)
 {
-	if (root == nullptr)
-		return;
-
-	removeAll(root->left);
-	removeAll(root->right);
-	
-	VNode* v_cur = root->v_head;
-	while (v_cur != nullptr)
-	{
-		VNode* deleteMe = v_cur;
-		v_cur = v_cur->next;
-		delete deleteMe;
-	}
-
-	delete root;
+	static const size_t inlineCapacity = string().capacity();
+	return capacity > inlineCapacity ? allocationSize(capacity + 1) : 0;
 }
 
-// Returns 0 if both strings are equal, -1 if a < b, 1 if a > b.
-// --- If one is a number, the other is also (by designed use). In order to compare two numbers
-// as strings, eg. 020 vs 20, we need to fill the shorter string with padded 0's.
-int MultiMap::compare(string a, string b) const
+// Compares two composite keys: tuples of field values, each joined by COMPOSITE_SEPARATOR.
+// The tuples are compared a component at a time with compare, and a tuple that runs out of
+// components first (a prefix of the other) is the smaller. A key ending in COMPOSITE_MAX is
+// instead larger than every tuple it is a prefix of, which lets a range's upper bound cover
+// every key beginning with a given prefix.
+int MultiMapBase::compareComposite(string_view a, string_view b)
 {
-	bool isNumber = a.find_first_not_of("0123456789.") == string::npos;
-	// By design, a and b are from the same field type, no need to check b.
-	if (isNumber)
+	static const char delimiters[] = { COMPOSITE_SEPARATOR, COMPOSITE_MAX, '\0' };
+	size_t i = 0, j = 0;
+	bool aMore = !a.empty(), bMore = !b.empty();
+	for (;;)
 	{
-		int a_decimal = a.find('.'), b_decimal = b.find('.'),
-			a_length = a_decimal == string::npos ? a.length() : a_decimal,
-			b_length = b_decimal == string::npos ? b.length() : b_decimal;
-		string* shorter_string = a_length < b_length ? &a : &b;
-		shorter_string->insert(0, abs(a_length - b_length), '0');
+		// 0 = out of components, 1 = another component, 2 = COMPOSITE_MAX
+		int aKind = !aMore ? 0 : (i < a.size() && a[i] == COMPOSITE_MAX ? 2 : 1),
+			bKind = !bMore ? 0 : (j < b.size() && b[j] == COMPOSITE_MAX ? 2 : 1);
+		if (aKind != 1 || bKind != 1)
+			return aKind == bKind ? 0 : (aKind < bKind ? -1 : 1);
+
+		size_t aEnd = min(a.find_first_of(delimiters, i), a.size()),
+			bEnd = min(b.find_first_of(delimiters, j), b.size());
+		int result = compare(a.substr(i, aEnd - i), b.substr(j, bEnd - j));
+		if (result != 0)
+			return result;
+
+		// Step past a separator; stop in front of COMPOSITE_MAX so we see it next time
+		aMore = aEnd < a.size();
+		i = aEnd < a.size() && a[aEnd] == COMPOSITE_SEPARATOR ? aEnd + 1 : aEnd;
+		bMore = bEnd < b.size();
+		j = bEnd < b.size() && b[bEnd] == COMPOSITE_SEPARATOR ? bEnd + 1 : bEnd;
 	}
-	if (a == b)
-		return 0;
-	else
-		return a < b ? -1 : 1;
 }
@@ -1,77 +1,951 @@
 // To create an effective multimap, each node in the binary search tree
 // (BSTNode) points to a doubly-linked list of value nodes (VNode), so
-// that each BSTNode can contain multiple values.
+// that each BSTNode can contain multiple values. Each BSTNode also keeps
+// the number of values in its subtree, which lets us count the values in a
+// key range, or find the k-th value in order, with a single walk down the tree.
+// The tree is a template, BasicMultiMap<Key, Value, Compare, Allocator>: Compare is a
+// three-way comparator (returning < 0, 0 or > 0, like strcmp), and nodes come from Allocator.
+// If Compare declares is_transparent, lookups take any type it can compare with a Key (eg. a
+// string_view, or a double probing long long keys) without building a Key first.
+// MultiMap is the tree the database indexes with: string keys, unsigned int row #s, ordered by
+// a comparator chosen at construction: compare (the default) for single field values, or
+// compareComposite for tuples of field values. Its helpers for field values live in
+// MultiMapBase, so every BasicMultiMap has them.
 
 #ifndef MULTIMAP_H
 #define MULTIMAP_H
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include "Metrics.h"
 
-class MultiMap
+class MultiMapBase
+{
+public:
+	typedef int (*Comparator)(std::string_view a, std::string_view b);
+
+	struct Usage
+	{
+		int keys;
+		int values;
+		int depth;		// # levels
+		size_t bytes;		// nodes, value nodes and the keys' heap buffers, as allocated
+		size_t stringHeapBytes;	// of bytes, the keys' heap buffers
+		size_t overheadBytes;	// of bytes, allocator headers and rounding (estimated)
+	};
+
+	static const char COMPOSITE_SEPARATOR = '\x1f';	// between a composite key's components
+	static const char COMPOSITE_MAX = '\x1e';		// ends an upper bound on a key prefix
+
+	static int compare(std::string_view a, std::string_view b);		// O(L) (L = key length)
+	static int compareComposite(std::string_view a, std::string_view b);	// O(L)
+	static bool isNumber(std::string_view s);				// O(L)
+	static bool numericKey(std::string_view s, unsigned long long& key);	// O(L)
+	static size_t allocationSize(size_t bytes);				// O(1)
+	static size_t stringHeapSize(size_t capacity);				// O(1)
+};
+
+// Orders field values with one of MultiMapBase's comparators (compare by default). Transparent,
+// since they take string_views.
+struct FieldCompare
+{
+	typedef void is_transparent;
+	MultiMapBase::Comparator compare;
+
+	FieldCompare(MultiMapBase::Comparator cmp = MultiMapBase::compare) : compare(cmp) {}
+	int operator()(std::string_view a, std::string_view b) const { return compare(a, b); }
+};
+
+// Orders any keys with operator<, including keys of different types (eg. an int and a double).
+struct ThreeWayCompare
+{
+	typedef void is_transparent;
+
+	template <class A, class B>
+	int operator()(const A& a, const B& b) const
+	{
+		Metrics::add(Metrics::mm_comparisons);
+		return a < b ? -1 : (b < a ? 1 : 0);
+	}
+};
+
+template <class Key, class Value = unsigned int, class Compare = ThreeWayCompare,
+	class Allocator = std::allocator<std::pair<const Key, Value> > >
+class BasicMultiMap : public MultiMapBase
 {
 private:
 	struct VNode
 	{
-		unsigned int value;
+		Value value;
 		VNode* prev;
 		VNode* next;
-		
-		VNode(unsigned int v)
+
+		VNode(const Value& v) : value(v)
 		{
-			value = v;
+			Metrics::add(Metrics::mm_value_allocations);
 			prev = next = nullptr;
 		}
 	};
 
 	struct BSTNode
 	{
-		std::string key;// Key
+		Key key;	// Key
 		VNode* v_head;	// Value
 		VNode* v_tail;
 		BSTNode* left;	// Children
 		BSTNode* right;
 		BSTNode* prev;	// Pointers to in-order prev/next
 		BSTNode* next;
-		
-		BSTNode(std::string s, unsigned int v)
+		unsigned int count; // # values in this node
+		unsigned int size;  // # values in this subtree
+
+		BSTNode(const Key& k, VNode* v) : key(k)
 		{
-			key = s;
-			v_head = v_tail = new VNode(v);
+			Metrics::add(Metrics::mm_node_allocations);
+			v_head = v_tail = v;
 			left = right = prev = next = nullptr;
+			count = size = 1;
 		}
 	};
 
+	typedef typename std::allocator_traits<Allocator>::template rebind_alloc<BSTNode> NodeAllocator;
+	typedef typename std::allocator_traits<Allocator>::template rebind_alloc<VNode> ValueAllocator;
+
+	// The type a lookup compares keys with: its argument's own, if Compare is transparent
+	template <class C, class = void>
+	struct IsTransparent : std::false_type {};
+	template <class C>
+	struct IsTransparent<C, std::void_t<typename C::is_transparent> > : std::true_type {};
+	template <class K>
+	using Probe = typename std::conditional<IsTransparent<Compare>::value, K, Key>::type;
+
 	BSTNode* head;
 
-public:	
+public:
 	class Iterator
 	{
 	public:
 		Iterator(BSTNode* root = nullptr, bool tail = false); // O(1)
 		bool valid() const;				// O(1)
-		std::string getKey() const;			// O(1)
-		unsigned int getValue() const;			// O(1)
+		const Key& getKey() const;			// O(1)
+		Value getValue() const;				// O(1)
 		bool next();					// O(1)
 		bool prev();					// O(1)
+		bool operator==(const Iterator& other) const;	// O(1)
+		bool operator!=(const Iterator& other) const;	// O(1)
 
 	private:
-		MultiMap::BSTNode* bst_ptr;
-		MultiMap::VNode* v_ptr;
+		BasicMultiMap::BSTNode* bst_ptr;
+		BasicMultiMap::VNode* v_ptr;
 	};
 
-	MultiMap();						// O(1)
-	~MultiMap();						// O(NV) (v = # values per node)
+	BasicMultiMap(const Compare& cmp = Compare(), const Allocator& alloc = Allocator()); // O(1)
+	~BasicMultiMap();					// O(NV) (v = # values per node)
 	void clear();						// O(NV)
-	void insert(std::string key, unsigned int value);	// O(log N)
-	Iterator findEqual(std::string key) const;		// O(log N)
-	Iterator findEqualOrSuccessor(std::string key) const;	// O(log N)
-	Iterator findEqualOrPredecessor(std::string key) const;	// O(log N)
+	void insert(Key key, Value value);			// O(log N)
+	void insertAll(std::vector<std::pair<Key, Value> >& entries); // O(K log K + min(K log N, N))
+	template <class K>
+	bool erase(const K& key, const Value& value);		// O(log N + V)
+	template <class K>
+	Iterator findEqual(const K& key) const;			// O(log N)
+	template <class K>
+	Iterator findEqualOrSuccessor(const K& key) const;	// O(log N)
+	template <class K>
+	Iterator findEqualOrPredecessor(const K& key) const;	// O(log N)
+	template <class K>
+	Iterator findSuccessor(const K& key) const;		// O(log N)
+	template <class K>
+	Iterator findPredecessor(const K& key) const;		// O(log N)
+	int size() const;					// O(1)
+	size_t bytes() const;					// O(1)
+	Usage usage() const;					// O(N)
+	template <class K1, class K2>
+	int countRange(const K1& min, const K2& max,		// O(log N)
+		bool minExclusive = false, bool maxExclusive = false) const;
+	template <class K>
+	int rank(const K& key) const;				// O(log N)
+	Iterator select(int k) const;				// O(log N + V)
+	template <class K1, class K2>
+	int compareKeys(const K1& a, const K2& b) const;	// O(L)
+	static size_t entryBytes(size_t keyLength);		// O(1)
 
 private:
-	MultiMap(const MultiMap& other);			// prevent copying
-	MultiMap& operator=(const MultiMap& rhs);		// prevent copying
+	Compare m_compare;
+	NodeAllocator m_nodeAllocator;
+	ValueAllocator m_valueAllocator;
+	int m_height;	// at least the # levels in the tree (insertAll rebalances when it grows too large)
+	int m_keys;
+	size_t m_keyHeapBytes;	// the keys' heap buffers, as allocated
+
+	BasicMultiMap(const BasicMultiMap& other);		// prevent copying
+	BasicMultiMap& operator=(const BasicMultiMap& rhs);	// prevent copying
 	void removeAll(BSTNode* root);				// O(NV)
-	int compare(std::string a, std::string b) const;	
+	BSTNode* newNode(const Key& key, const Value& value);	// O(L)
+	VNode* newValue(const Value& value);			// O(1)
+	void deleteNode(BSTNode* node);				// O(L)
+	void deleteValue(VNode* v);				// O(1)
+	template <class K>
+	int countBelow(const K& key, bool inclusive) const;	// O(log N)
+	BSTNode* build(std::vector<BSTNode*>& nodes, int start, int end); // O(N)
+	void insertMiddleFirst(const std::vector<std::pair<Key, Value> >& entries, // O(K log N)
+		const std::vector<int>& groups, int start, int end);
+	template <class K>
+	static bool unbounded(const K& key);			// O(1)
+	static size_t keyHeapSize(const Key& key);		// O(1)
 };
 
+typedef BasicMultiMap<std::string, unsigned int, FieldCompare> MultiMap;
+
+
+/////////////////////////////
+// Iterator Implementations
+/////////////////////////////
+
+template <class Key, class Value, class Compare, class Allocator>
+BasicMultiMap<Key, Value, Compare, Allocator>::Iterator::Iterator(BSTNode* root, bool tail)
+{
+	bst_ptr = root;
+	if (root != nullptr)
+		v_ptr = tail ? root->v_tail : root->v_head;
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+bool BasicMultiMap<Key, Value, Compare, Allocator>::Iterator::valid() const
+{
+	return bst_ptr != nullptr;
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+const Key& BasicMultiMap<Key, Value, Compare, Allocator>::Iterator::getKey() const
+{
+	static const Key empty = Key();
+	return valid() ? bst_ptr->key : empty;
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+Value BasicMultiMap<Key, Value, Compare, Allocator>::Iterator::getValue() const
+{
+	return valid() ? v_ptr->value : Value();
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+bool BasicMultiMap<Key, Value, Compare, Allocator>::Iterator::next()
+{
+	if (!valid())
+		return false;
+
+	if (v_ptr == bst_ptr->v_tail) // end of the value linked list
+	{
+		bst_ptr = bst_ptr->next;
+		v_ptr = bst_ptr ? bst_ptr->v_head : nullptr;
+	}
+	else
+		v_ptr = v_ptr->next;
+
+	return true;
+}
+
+// Two iterators are equal if they point to the same value of the same BSTNode (or are both
+// invalid). This is much cheaper than comparing their keys and values.
+template <class Key, class Value, class Compare, class Allocator>
+bool BasicMultiMap<Key, Value, Compare, Allocator>::Iterator::operator==(const Iterator& other) const
+{
+	return bst_ptr == other.bst_ptr && (!valid() || v_ptr == other.v_ptr);
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+bool BasicMultiMap<Key, Value, Compare, Allocator>::Iterator::operator!=(const Iterator& other) const
+{
+	return !(*this == other);
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+bool BasicMultiMap<Key, Value, Compare, Allocator>::Iterator::prev()
+{
+	if (!valid())
+		return false;
+
+	if (v_ptr == bst_ptr->v_head) // first node of value linked list
+	{
+		bst_ptr = bst_ptr->prev;
+		v_ptr = bst_ptr ? bst_ptr->v_tail : nullptr;
+	}
+	else
+		v_ptr = v_ptr->prev;
+
+	return true;
+}
+
+
+/////////////////////////////
+// BasicMultiMap Implementations
+/////////////////////////////
+
+template <class Key, class Value, class Compare, class Allocator>
+BasicMultiMap<Key, Value, Compare, Allocator>::BasicMultiMap(const Compare& cmp, const Allocator& alloc)
+	: m_compare(cmp), m_nodeAllocator(alloc), m_valueAllocator(alloc)
+{
+	head = nullptr;
+	m_height = 0;
+	m_keys = 0;
+	m_keyHeapBytes = 0;
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+BasicMultiMap<Key, Value, Compare, Allocator>::~BasicMultiMap()
+{
+	clear();
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+void BasicMultiMap<Key, Value, Compare, Allocator>::clear()
+{
+	removeAll(head);
+	head = nullptr;
+	m_height = 0;
+	m_keys = 0;
+	m_keyHeapBytes = 0;
+}
+
+// If no matching key is found, inserts a new BSTNode. Otherwise, since each BSTNode
+// contains a linked list of values as part of the multimap implementation, a new
+// VNode is added to the end of the matching BSTNode's value list.
+// --- The way we implemented iterator traversal requires that each BSTNode contains a
+// pointer to the prev and next BSTNode. In order to keep track of which is prev/next,
+// we create two temp BSTNode pointers: min and max. Each time we traverse left down the
+// tree, we update max to be the node we last visited, and each traversal right updates
+// min. This guarantees that we can always keep track of prev/next.
+// Every node we pass gains one value in its subtree, so we bump its size on the way down.
+template <class Key, class Value, class Compare, class Allocator>
+void BasicMultiMap<Key, Value, Compare, Allocator>::insert(Key key, Value value)
+{
+	Metrics::add(Metrics::mm_inserts);
+	if (!head)
+	{
+		head = newNode(key, value);
+		m_height = 1;
+		Metrics::noteDepth(m_height);
+		return;
+	}
+
+	BSTNode *cur = head, *min = nullptr, *max = nullptr;
+	for (int depth = 2; ; ++depth)
+	{
+		if (depth > m_height)
+		{
+			m_height = depth;
+			Metrics::noteDepth(m_height);
+		}
+		cur->size++;
+		int result = m_compare(key, cur->key);
+		if (result == 0)  // (key == cur->key)
+		{
+			VNode* temp = newValue(value);
+			cur->v_tail->next = temp;
+			temp->prev = cur->v_tail;
+			cur->v_tail = temp;
+			cur->count++;
+			return;
+		}
+		if (result < 0) // (key < cur->key)
+		{
+			max = cur;
+			if (cur->left)
+				cur = cur->left;
+			else
+			{
+				cur->left = newNode(key, value);
+				cur->left->prev = min;
+				cur->left->next = cur;
+				cur->prev = cur->left;
+				if (min)
+					min->next = cur->left;
+				return;
+			}
+		}
+		else if (result > 0) // (key > cur->key)
+		{
+			min = cur;
+			if (cur->right)
+				cur = cur->right;
+			else
+			{
+				cur->right = newNode(key, value);
+				cur->right->prev = cur;
+				cur->right->next = max;
+				cur->next = cur->right;
+				if (max)
+					max->prev = cur->right;
+				return;
+			}
+		}
+	}
+}
+
+// Inserts every (key, value) pair in entries, which is sorted by key in the process (values of
+// equal keys keep their relative order, as if inserted one at a time).
+// --- A small batch is inserted one key at a time, middle key first (see insertMiddleFirst),
+// so that a batch whose keys all fall between two existing keys (eg. ever-increasing IDs,
+// loaded in chunks) hangs a balanced subtree there rather than a chain. Successive batches
+// can still stack such subtrees on top of one another, so once the tree may be more than twice
+// as deep as a balanced one, or the batch is large relative to the tree, the batch is instead
+// merged with the existing keys in a single in-order pass (following the next pointers), and
+// the tree is rebuilt from the merged node list, which leaves it perfectly balanced again.
+template <class Key, class Value, class Compare, class Allocator>
+void BasicMultiMap<Key, Value, Compare, Allocator>::insertAll(std::vector<std::pair<Key, Value> >& entries)
+{
+	Metrics::add(Metrics::mm_inserts, entries.size());
+	std::stable_sort(entries.begin(), entries.end(),
+		[this](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) {
+			return m_compare(a.first, b.first) < 0;
+		});
+
+	int n = size(), depth = 1;
+	while ((1 << depth) <= n)
+		++depth;
+	if ((long long)entries.size() * depth < n && m_height <= 2 * depth)
+	{
+		std::vector<int> groups; // where each run of equal keys starts, then entries.size()
+		for (int i = 0; i < entries.size(); ++i)
+			if (i == 0 || m_compare(entries[i - 1].first, entries[i].first) != 0)
+				groups.push_back(i);
+		groups.push_back(entries.size());
+		insertMiddleFirst(entries, groups, 0, groups.size() - 1);
+		return;
+	}
+
+	// Merge the existing nodes (in order) with the entries
+	BSTNode* cur = head;
+	while (cur && cur->left)
+		cur = cur->left;
+	std::vector<BSTNode*> nodes;
+	nodes.reserve(n + entries.size());
+	for (int i = 0; i < entries.size(); )
+	{
+		int result = cur ? m_compare(entries[i].first, cur->key) : -1;
+		if (result > 0) // existing node comes first
+		{
+			nodes.push_back(cur);
+			cur = cur->next;
+			continue;
+		}
+		BSTNode* target = cur;
+		if (result < 0) // new key
+		{
+			target = newNode(entries[i].first, entries[i].second);
+			nodes.push_back(target);
+			++i;
+		}
+		else
+		{
+			nodes.push_back(cur);
+			cur = cur->next;
+		}
+		for (; i < entries.size() && m_compare(entries[i].first, target->key) == 0; ++i)
+		{
+			VNode* temp = newValue(entries[i].second);
+			target->v_tail->next = temp;
+			temp->prev = target->v_tail;
+			target->v_tail = temp;
+			target->count++;
+		}
+	}
+	for (; cur != nullptr; cur = cur->next)
+		nodes.push_back(cur);
+
+	// Relink
+	for (int i = 0; i < nodes.size(); ++i)
+	{
+		nodes[i]->prev = i > 0 ? nodes[i - 1] : nullptr;
+		nodes[i]->next = i + 1 < nodes.size() ? nodes[i + 1] : nullptr;
+	}
+	head = build(nodes, 0, nodes.size());
+	for (m_height = 0; (1u << m_height) <= nodes.size(); ++m_height)
+		;
+	Metrics::noteDepth(m_height);
+}
+
+// Removes one value from key's value list, and the key itself if that leaves it without any.
+// Returns false if key has no such value. Invalidates iterators to the removed value or key.
+// --- We remember the path down to key's node, so that once we know the value is really there
+// we can shrink the size of every subtree it was counted in. A node with two children is
+// replaced by its in-order successor (its next pointer), which is the leftmost node of its
+// right subtree and so has no left child; the nodes on the way down to it lose its values.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K>
+bool BasicMultiMap<Key, Value, Compare, Allocator>::erase(const K& key, const Value& value)
+{
+	const Probe<K>& probe = key;
+	std::vector<BSTNode*> path;
+	BSTNode** link = &head;
+	while (*link != nullptr)
+	{
+		int result = m_compare(probe, (*link)->key);
+		if (result == 0)
+			break;
+		path.push_back(*link);
+		link = result < 0 ? &(*link)->left : &(*link)->right;
+	}
+	BSTNode* node = *link;
+	if (node == nullptr)
+		return false;
+	VNode* v = node->v_head;
+	while (v != nullptr && !(v->value == value))
+		v = v->next;
+	if (v == nullptr)
+		return false;
+
+	// Unlink the value
+	(v->prev ? v->prev->next : node->v_head) = v->next;
+	(v->next ? v->next->prev : node->v_tail) = v->prev;
+	deleteValue(v);
+	Metrics::add(Metrics::mm_erases);
+	node->count--;
+	node->size--;
+	for (int i = 0; i < path.size(); ++i)
+		path[i]->size--;
+	if (node->count > 0)
+		return true;
+
+	// Unlink the node, which has no values left
+	if (node->prev)
+		node->prev->next = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	if (node->left == nullptr || node->right == nullptr)
+		*link = node->left ? node->left : node->right;
+	else
+	{
+		BSTNode* successor = node->next;
+		BSTNode** successorLink = &node->right;
+		while (*successorLink != successor)
+		{
+			(*successorLink)->size -= successor->count;
+			successorLink = &(*successorLink)->left;
+		}
+		*successorLink = successor->right;
+		successor->left = node->left;
+		successor->right = node->right;
+		successor->size = node->size;
+		*link = successor;
+	}
+	m_keys--;
+	m_keyHeapBytes -= keyHeapSize(node->key);
+	deleteNode(node);
+	return true;
+}
+
+// Returns an iterator with its bst_ptr pointing to the BSTNode with the matching key,
+// and its v_ptr pointing to the BSTNode's v_head (earliest value). If a matching key
+// cannot be found, returns an invalid iterator.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::findEqual(const K& key) const -> Iterator
+{
+	const Probe<K>& probe = key;
+	BSTNode *cur = head;
+	while (cur != nullptr)
+	{
+		int result = m_compare(probe, cur->key);
+		if (result < 0) // (key < cur->key)
+			cur = cur->left;
+		else if (result > 0) // (key > cur->key)
+			cur = cur->right;
+		else // found matching key
+			return Iterator(cur);
+	}
+	return Iterator(nullptr);
+}
+
+// Returns an iterator with its bst_ptr pointing to the BSTNode with the matching key
+// (or if one cannot be found, the next largest key), and its v_ptr pointing to the
+// BSTNode's v_head (earliest value). If key is an empty string, returns iterator to the
+// smallest BSTNode. If key is larger than the largest BSTNode, returns invalid iterator.
+// --- Utlizes a BSTNode pointer "max" to keep track of the next largest key. Everytime
+// we traverse left, the node we last visited will be the new "max". Alternatively, we could
+// just use the node's built-in "next" pointer.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::findEqualOrSuccessor(const K& key) const -> Iterator
+{
+	const Probe<K>& probe = key;
+	bool smallest = unbounded(probe);
+	BSTNode *cur = head, *max = nullptr;
+	while (cur != nullptr)
+	{
+		int result = m_compare(probe, cur->key);
+		if (smallest || result < 0) // (key < cur->key)
+		{
+			max = cur;
+			if (cur->left == nullptr)
+				return Iterator(cur);
+			cur = cur->left;
+		}
+		else if (result > 0) // (key > cur->key)
+		{
+			if (cur->right == nullptr)
+				return Iterator(max); // or Iterator(cur->next)
+			cur = cur->right;
+		}
+		else // found matching key
+			return Iterator(cur);
+	}
+	return Iterator(nullptr);
+}
+
+// Returns an iterator with its bst_ptr pointing to the BSTNode with the matching key
+// (or if one cannot be found, the next smallest key), and its v_ptr pointing to the
+// BSTNode's v_tail (latest value). If key is an empty string, returns iterator to the
+// largest BSTNode. If key is smaller than the smallest BSTNode, returns invalid iterator.
+// --- Utlizes a BSTNode pointer "min" to keep track of the next smallest key. Everytime
+// we traverse right, the node we last visited will be the new "min". Alternatively, we could
+// just use the node's built-in "prev" pointer.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::findEqualOrPredecessor(const K& key) const -> Iterator
+{
+	const Probe<K>& probe = key;
+	bool largest = unbounded(probe);
+	BSTNode *cur = head, *min = nullptr;
+	while (cur != nullptr)
+	{
+		int result = m_compare(probe, cur->key);
+		if (!largest && result < 0) // (key < cur->key)
+		{
+			if (cur->left == nullptr)
+				return Iterator(min, true); // or Iterator(cur->prev, true)
+			cur = cur->left;
+		}
+		else if (largest || result > 0) // (key > cur->key)
+		{
+			min = cur;
+			if (cur->right == nullptr)
+				return Iterator(cur, true);
+			cur = cur->right;
+		}
+		else // found matching key
+			return Iterator(cur, true);
+	}
+	return Iterator(nullptr);
+}
+
+// Returns an iterator to the earliest value of the smallest key larger than key (unlike
+// findEqualOrSuccessor, never key itself). If there is none, returns an invalid iterator.
+// --- If key is in the tree, its in-order next pointer leads straight to the answer;
+// otherwise the answer is the same as findEqualOrSuccessor's.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::findSuccessor(const K& key) const -> Iterator
+{
+	const Probe<K>& probe = key;
+	BSTNode *cur = head;
+	while (cur != nullptr)
+	{
+		int result = m_compare(probe, cur->key);
+		if (result < 0)
+			cur = cur->left;
+		else if (result > 0)
+			cur = cur->right;
+		else
+			return Iterator(cur->next);
+	}
+	return findEqualOrSuccessor(probe);
+}
+
+// Returns an iterator to the latest value of the largest key smaller than key. If there is
+// none, returns an invalid iterator. See findSuccessor.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::findPredecessor(const K& key) const -> Iterator
+{
+	const Probe<K>& probe = key;
+	BSTNode *cur = head;
+	while (cur != nullptr)
+	{
+		int result = m_compare(probe, cur->key);
+		if (result < 0)
+			cur = cur->left;
+		else if (result > 0)
+			cur = cur->right;
+		else
+			return Iterator(cur->prev, true);
+	}
+	return findEqualOrPredecessor(probe);
+}
+
+// Compares two keys the way this multimap orders them.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K1, class K2>
+int BasicMultiMap<Key, Value, Compare, Allocator>::compareKeys(const K1& a, const K2& b) const
+{
+	const Probe<K1>& probeA = a;
+	const Probe<K2>& probeB = b;
+	return m_compare(probeA, probeB);
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+int BasicMultiMap<Key, Value, Compare, Allocator>::size() const
+{
+	return head ? head->size : 0;
+}
+
+// Returns the bytes allocated for our nodes, value nodes and keys, as kept up to date by
+// newNode and erase (the value nodes are simply one per value).
+template <class Key, class Value, class Compare, class Allocator>
+size_t BasicMultiMap<Key, Value, Compare, Allocator>::bytes() const
+{
+	return m_keys * allocationSize(sizeof(BSTNode)) + size() * allocationSize(sizeof(VNode)) + m_keyHeapBytes;
+}
+
+// Measures the tree: the same bytes as above, broken down, and its actual depth.
+// --- The depth is found with an explicit stack rather than recursion, since a tree built
+// by inserting sorted keys one at a time can be as deep as it has keys.
+template <class Key, class Value, class Compare, class Allocator>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::usage() const -> Usage
+{
+	Usage u;
+	u.keys = m_keys;
+	u.values = size();
+	u.bytes = bytes();
+	u.stringHeapBytes = m_keyHeapBytes;
+	u.overheadBytes = m_keys * (allocationSize(sizeof(BSTNode)) - sizeof(BSTNode))
+		+ u.values * (allocationSize(sizeof(VNode)) - sizeof(VNode));
+	u.depth = 0;
+	std::vector<std::pair<BSTNode*, int> > stack;
+	if (head)
+		stack.push_back(std::make_pair(head, 1));
+	while (!stack.empty())
+	{
+		BSTNode* node = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		u.depth = std::max(u.depth, depth);
+		if constexpr (std::is_same<Key, std::string>::value)
+		{
+			size_t capacity = node->key.capacity();
+			if (stringHeapSize(capacity) > 0)
+				u.overheadBytes += stringHeapSize(capacity) - (capacity + 1);
+		}
+		if (node->left)
+			stack.push_back(std::make_pair(node->left, depth + 1));
+		if (node->right)
+			stack.push_back(std::make_pair(node->right, depth + 1));
+	}
+	return u;
+}
+
+// Returns the number of values whose keys lie between min and max, inclusive unless that end
+// is exclusive. An empty min or max leaves that end of the range unbounded.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K1, class K2>
+int BasicMultiMap<Key, Value, Compare, Allocator>::countRange(const K1& min, const K2& max,
+	bool minExclusive, bool maxExclusive) const
+{
+	const Probe<K1>& lo = min;
+	const Probe<K2>& hi = max;
+	int result = (unbounded(hi) ? size() : countBelow(hi, !maxExclusive)) - (unbounded(lo) ? 0 : countBelow(lo, minExclusive));
+	return result > 0 ? result : 0;
+}
+
+// Returns the number of values whose keys are smaller than key, ie. the position (counting
+// from 0) of key's first value in the ordering, had it been inserted.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K>
+int BasicMultiMap<Key, Value, Compare, Allocator>::rank(const K& key) const
+{
+	const Probe<K>& probe = key;
+	return countBelow(probe, false);
+}
+
+// Returns an iterator to the k-th value (counting from 0) in key order, or an invalid
+// iterator if k is out of range. Values of the same key are ordered by insertion.
+// --- At each node, if k falls within the left subtree we go left; if it falls within this
+// node's values we walk its value list; otherwise we skip the left subtree and this node's
+// values and go right.
+template <class Key, class Value, class Compare, class Allocator>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::select(int k) const -> Iterator
+{
+	if (k < 0)
+		return Iterator(nullptr);
+
+	BSTNode* cur = head;
+	while (cur != nullptr)
+	{
+		int leftSize = cur->left ? cur->left->size : 0;
+		if (k < leftSize)
+			cur = cur->left;
+		else if (k < leftSize + (int)cur->count)
+		{
+			Iterator it(cur);
+			for (k -= leftSize; k > 0; --k)
+				it.next();
+			return it;
+		}
+		else
+		{
+			k -= leftSize + cur->count;
+			cur = cur->right;
+		}
+	}
+	return Iterator(nullptr);
+}
+
+// Returns the bytes that inserting a new key with one value allocates, given the key's length
+// if it is a string.
+template <class Key, class Value, class Compare, class Allocator>
+size_t BasicMultiMap<Key, Value, Compare, Allocator>::entryBytes(size_t keyLength)
+{
+	return allocationSize(sizeof(BSTNode)) + allocationSize(sizeof(VNode))
+		+ (std::is_same<Key, std::string>::value ? stringHeapSize(keyLength) : 0);
+}
+
+
+/////////////////////////////
+// BasicMultiMap Helper Functions
+/////////////////////////////
+
+// Allocates a node for a new key with one value, counting the memory it takes.
+template <class Key, class Value, class Compare, class Allocator>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::newNode(const Key& key, const Value& value) -> BSTNode*
+{
+	VNode* v = newValue(value);
+	BSTNode* node = std::allocator_traits<NodeAllocator>::allocate(m_nodeAllocator, 1);
+	std::allocator_traits<NodeAllocator>::construct(m_nodeAllocator, node, key, v);
+	m_keys++;
+	m_keyHeapBytes += keyHeapSize(node->key);
+	return node;
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::newValue(const Value& value) -> VNode*
+{
+	VNode* v = std::allocator_traits<ValueAllocator>::allocate(m_valueAllocator, 1);
+	std::allocator_traits<ValueAllocator>::construct(m_valueAllocator, v, value);
+	return v;
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+void BasicMultiMap<Key, Value, Compare, Allocator>::deleteNode(BSTNode* node)
+{
+	std::allocator_traits<NodeAllocator>::destroy(m_nodeAllocator, node);
+	std::allocator_traits<NodeAllocator>::deallocate(m_nodeAllocator, node, 1);
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+void BasicMultiMap<Key, Value, Compare, Allocator>::deleteValue(VNode* v)
+{
+	std::allocator_traits<ValueAllocator>::destroy(m_valueAllocator, v);
+	std::allocator_traits<ValueAllocator>::deallocate(m_valueAllocator, v, 1);
+}
+
+// Inserts the sorted entries of groups [start, end) (runs of equal keys; see insertAll) in the
+// order that builds a balanced tree: the middle group, then each half the same way. A group's
+// values go in together, in order.
+template <class Key, class Value, class Compare, class Allocator>
+void BasicMultiMap<Key, Value, Compare, Allocator>::insertMiddleFirst(
+	const std::vector<std::pair<Key, Value> >& entries, const std::vector<int>& groups, int start, int end)
+{
+	if (start >= end)
+		return;
+	int mid = start + (end - start) / 2;
+	for (int i = groups[mid]; i < groups[mid + 1]; ++i)
+		insert(entries[i].first, entries[i].second);
+	insertMiddleFirst(entries, groups, start, mid);
+	insertMiddleFirst(entries, groups, mid + 1, end);
+}
+
+template <class Key, class Value, class Compare, class Allocator>
+void BasicMultiMap<Key, Value, Compare, Allocator>::removeAll(BSTNode* root)
+{
+	if (root == nullptr)
+		return;
+
+	removeAll(root->left);
+	removeAll(root->right);
+
+	VNode* v_cur = root->v_head;
+	while (v_cur != nullptr)
+	{
+		VNode* deleteMe = v_cur;
+		v_cur = v_cur->next;
+		deleteValue(deleteMe);
+	}
+
+	deleteNode(root);
+}
+
+// Returns the number of values whose keys are smaller than key (or equal to it, if inclusive).
+// --- Every time we go right, the node we leave and its entire left subtree are smaller.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K>
+int BasicMultiMap<Key, Value, Compare, Allocator>::countBelow(const K& key, bool inclusive) const
+{
+	int result = 0;
+	BSTNode* cur = head;
+	while (cur != nullptr)
+	{
+		int cmp = m_compare(key, cur->key);
+		if (cmp < 0 || (cmp == 0 && !inclusive))
+		{
+			if (cmp == 0)
+				return result + (cur->left ? cur->left->size : 0);
+			cur = cur->left;
+		}
+		else
+		{
+			result += (cur->left ? cur->left->size : 0) + cur->count;
+			if (cmp == 0)
+				return result;
+			cur = cur->right;
+		}
+	}
+	return result;
+}
+
+// Makes the middle node of nodes[start, end) the root of a balanced subtree of the rest,
+// recomputing subtree sizes on the way back up. Returns the root.
+template <class Key, class Value, class Compare, class Allocator>
+auto BasicMultiMap<Key, Value, Compare, Allocator>::build(std::vector<BSTNode*>& nodes, int start, int end)
+	-> BSTNode*
+{
+	if (start >= end)
+		return nullptr;
+
+	int mid = start + (end - start) / 2;
+	BSTNode* root = nodes[mid];
+	root->left = build(nodes, start, mid);
+	root->right = build(nodes, mid + 1, end);
+	root->size = root->count + (root->left ? root->left->size : 0) + (root->right ? root->right->size : 0);
+	return root;
+}
+
+// Returns true if key is an empty string, which as a bound stands for no bound at all (since
+// compare would otherwise order it like the number 0). Other keys are always bounds.
+template <class Key, class Value, class Compare, class Allocator>
+template <class K>
+bool BasicMultiMap<Key, Value, Compare, Allocator>::unbounded(const K& key)
+{
+	if constexpr (std::is_convertible<const K&, std::string_view>::value)
+		return std::string_view(key).empty();
+	else
+		return false;
+}
+
+// Returns the bytes a key allocates beyond its node: a string's heap buffer, if it has one.
+template <class Key, class Value, class Compare, class Allocator>
+size_t BasicMultiMap<Key, Value, Compare, Allocator>::keyHeapSize(const Key& key)
+{
+	if constexpr (std::is_same<Key, std::string>::value)
+		return stringHeapSize(key.capacity());
+	else
+		return 0;
+}
+
+extern template class BasicMultiMap<std::string, unsigned int, FieldCompare>;
+
 #endif // MULTIMAP_H
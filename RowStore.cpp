@@ -0,0 +1,287 @@
+#include "RowStore.h"
+#include "MultiMap.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+using namespace std;
+
+/////////////////////////////
+// RowStore Implementations
+/////////////////////////////
+
+atomic<unsigned int> RowStore::s_nextId(1);
+
+RowStore::RowStore()
+{
+	m_end = 0;
+	m_maxPages = 2;
+	m_id = s_nextId++;
+	m_version = 0;
+	m_ok = false;
+}
+
+RowStore::~RowStore()
+{
+	close();
+}
+
+// Creates (or empties) the file, and keeps up to cacheBytes of its pages in memory (at least
+// two). Returns false if the file cannot be created.
+bool RowStore::open(const string& filename, size_t cacheBytes)
+{
+	close();
+	m_file.open(filename, ios::in | ios::out | ios::binary | ios::trunc);
+	if (!m_file)
+		return false;
+	m_filename = filename;
+	m_maxPages = max<size_t>(2, cacheBytes / PAGE_SIZE);
+	m_ok = true;
+	return true;
+}
+
+// Forgets every row, and deletes the file: its contents mean nothing without our locations.
+void RowStore::close()
+{
+	clear();
+	if (m_file.is_open())
+	{
+		m_file.close();
+		remove(m_filename.c_str());
+	}
+	m_filename.clear();
+	m_ok = false;
+}
+
+bool RowStore::isOpen() const
+{
+	return m_file.is_open();
+}
+
+// Forgets every row, and empties the file.
+void RowStore::clear()
+{
+	m_locations.clear();
+	m_pages.clear();
+	m_pageIndex.clear();
+	m_tail.clear();
+	m_end = 0;
+	m_version++;
+	if (m_file.is_open())
+	{
+		m_file.close();
+		m_file.open(m_filename, ios::in | ios::out | ios::binary | ios::trunc);
+		m_ok = !!m_file;
+	}
+}
+
+// Writes a row after the last one, as row # size(). Returns false, adding nothing, if the
+// file cannot be written (after which no write succeeds until the store is cleared).
+bool RowStore::append(const vector<string>& row)
+{
+	string bytes;
+	encode(row, bytes);
+	Location location = { m_end, (unsigned int)bytes.size() };
+	if (!write(bytes.data(), bytes.size()))
+		return false;
+	m_locations.push_back(location);
+	return true;
+}
+
+// Writes a new copy of a row, which its # then refers to. Returns false, changing nothing, if
+// the file cannot be written.
+bool RowStore::replace(int rowNum, const vector<string>& row)
+{
+	string bytes;
+	encode(row, bytes);
+	Location location = { m_end, (unsigned int)bytes.size() };
+	if (!write(bytes.data(), bytes.size()))
+		return false;
+	m_locations[rowNum] = location;
+	m_version++;
+	return true;
+}
+
+// Forgets a row, which is then read as having no fields.
+void RowStore::erase(int rowNum)
+{
+	m_locations[rowNum].length = 0;
+	m_version++;
+}
+
+// Returns a row's fields. The reference stays valid until this thread has read three other
+// rows (from any store), or the row is replaced, erased or cleared.
+// --- Every thread keeps the last few rows it has read, already decoded, since a search tests
+// (or compares) the same row against several criteria (or sort keys) in a row. The least
+// recently read one is replaced, so a row just returned survives the next few reads.
+const vector<string>& RowStore::get(int rowNum) const
+{
+	struct Recent
+	{
+		unsigned int store;	// m_id, or 0 for none
+		unsigned int version;
+		int rowNum;
+		unsigned long long used; // when last returned
+		vector<string> row;
+	};
+	const int RECENT = 4;
+	thread_local Recent recent[RECENT];
+	thread_local unsigned long long clock = 0;
+
+	unsigned int version = m_version.load(memory_order_relaxed);
+	int oldest = 0;
+	for (int i = 0; i < RECENT; ++i)
+	{
+		if (recent[i].store == m_id && recent[i].rowNum == rowNum && recent[i].version == version)
+		{
+			recent[i].used = ++clock;
+			return recent[i].row;
+		}
+		if (recent[i].used < recent[oldest].used)
+			oldest = i;
+	}
+
+	Recent& r = recent[oldest];
+	r.used = ++clock;
+	r.store = m_id;
+	r.version = version;
+	r.rowNum = rowNum;
+	string bytes;
+	read(m_locations[rowNum].offset, m_locations[rowNum].length, bytes);
+	decode(bytes, r.row);
+	return r.row;
+}
+
+const string& RowStore::filename() const
+{
+	return m_filename;
+}
+
+int RowStore::size() const
+{
+	return m_locations.size();
+}
+
+// Returns the bytes of memory we hold: our locations, the tail page and the cached pages
+// (estimated as MultiMap::bytes is).
+size_t RowStore::bytes() const
+{
+	lock_guard<mutex> lock(m_lock);
+	size_t page = MultiMap::allocationSize(PAGE_SIZE) + MultiMap::allocationSize(sizeof(Page) + 2 * sizeof(void*))
+		+ MultiMap::allocationSize(sizeof(long long) + 2 * sizeof(void*));
+	return MultiMap::allocationSize(m_locations.capacity() * sizeof(Location))
+		+ MultiMap::allocationSize(m_tail.capacity()) + m_pages.size() * page
+		+ MultiMap::allocationSize(m_pageIndex.bucket_count() * sizeof(void*));
+}
+
+// Adds bytes to the tail page, writing it out whenever it fills up.
+bool RowStore::write(const char* data, size_t length)
+{
+	if (!m_ok)
+		return false;
+	m_tail.reserve(PAGE_SIZE);
+	while (length > 0)
+	{
+		size_t n = min<size_t>(length, PAGE_SIZE - m_tail.size());
+		m_tail.insert(m_tail.end(), data, data + n);
+		data += n;
+		length -= n;
+		m_end += n;
+		if (m_tail.size() == PAGE_SIZE)
+		{
+			m_file.seekp((m_end / PAGE_SIZE - 1) * PAGE_SIZE);
+			m_file.write(m_tail.data(), PAGE_SIZE);
+			if (!m_file)
+			{
+				m_ok = false;
+				return false;
+			}
+			m_tail.clear();
+		}
+	}
+	return true;
+}
+
+// Copies length bytes from offset, from the tail page or the pages they lie in.
+void RowStore::read(long long offset, size_t length, string& bytes) const
+{
+	lock_guard<mutex> lock(m_lock);
+	bytes.resize(length);
+	long long tailPage = m_end / PAGE_SIZE;
+	for (size_t done = 0; done < length; )
+	{
+		long long number = (offset + done) / PAGE_SIZE;
+		size_t start = (offset + done) % PAGE_SIZE, n = min<size_t>(length - done, PAGE_SIZE - start);
+		const char* data = number == tailPage ? m_tail.data() : page(number).data();
+		memcpy(&bytes[done], data + start, n);
+		done += n;
+	}
+}
+
+// Returns a page that has been written out, reading it in (and evicting the least recently
+// used page, if the cache is full) unless it is cached.
+const vector<char>& RowStore::page(long long number) const
+{
+	auto found = m_pageIndex.find(number);
+	if (found != m_pageIndex.end())
+	{
+		m_pages.splice(m_pages.begin(), m_pages, found->second); // now most recently used
+		Metrics::add(Metrics::db_page_hits);
+		return m_pages.front().data;
+	}
+
+	Metrics::add(Metrics::db_page_reads);
+	if (m_pages.size() >= m_maxPages)
+	{
+		m_pageIndex.erase(m_pages.back().number);
+		m_pages.pop_back();
+	}
+	m_pages.push_front(Page());
+	m_pages.front().number = number;
+	m_pages.front().data.resize(PAGE_SIZE);
+	m_pageIndex[number] = m_pages.begin();
+	m_file.clear();
+	m_file.seekg(number * PAGE_SIZE);
+	m_file.read(m_pages.front().data.data(), PAGE_SIZE);
+	return m_pages.front().data;
+}
+
+// A row is the # of fields, then each field's length and bytes; numbers are written 7 bits at
+// a time, low bits first, with the high bit set on every byte but the last.
+void RowStore::encode(const vector<string>& row, string& bytes)
+{
+	auto number = [&bytes](size_t n) {
+		for (; n >= 0x80; n >>= 7)
+			bytes += (char)(n | 0x80);
+		bytes += (char)n;
+	};
+	number(row.size());
+	for (int i = 0; i < row.size(); ++i)
+	{
+		number(row[i].size());
+		bytes += row[i];
+	}
+}
+
+void RowStore::decode(const string& bytes, vector<string>& row)
+{
+	size_t pos = 0;
+	auto number = [&bytes, &pos]() {
+		size_t n = 0;
+		for (int shift = 0; pos < bytes.size(); shift += 7)
+		{
+			unsigned char c = bytes[pos++];
+			n |= (size_t)(c & 0x7f) << shift;
+			if (!(c & 0x80))
+				break;
+		}
+		return n;
+	};
+	row.resize(bytes.empty() ? 0 : number());
+	for (int i = 0; i < row.size(); ++i)
+	{
+		size_t length = number();
+		row[i].assign(bytes, pos, length);
+		pos += length;
+	}
+}
@@ -0,0 +1,76 @@
+// Rows of data kept in a file instead of in memory, for tables larger than RAM. The file is a
+// sequence of fixed-size pages, each row written after the last one (spanning pages as it
+// must), and only a bounded number of recently used pages are kept in memory, in an LRU page
+// cache. A row is found by its # through a table of where it starts, which is all that stays
+// in memory per row. Replacing a row writes it anew at the end; the old copy is left behind
+// until the store is cleared and refilled (see Database::compact).
+// Reads may come from several threads at once; everything else must not overlap any call.
+
+#ifndef ROWSTORE_H
+#define ROWSTORE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <fstream>
+#include <mutex>
+#include <atomic>
+
+class RowStore
+{
+public:
+	static const int PAGE_SIZE = 16384;
+
+	RowStore();								// O(1)
+	~RowStore();								// O(P)
+	bool open(const std::string& filename, size_t cacheBytes);		// O(1)
+	void close();								// O(P) (P = # cached pages)
+	bool isOpen() const;							// O(1)
+	const std::string& filename() const;					// O(1)
+	void clear();								// O(P)
+	bool append(const std::vector<std::string>& row);			// O(L) amortized (L = row's length)
+	bool replace(int rowNum, const std::vector<std::string>& row);	// O(L) amortized
+	void erase(int rowNum);							// O(1)
+	const std::vector<std::string>& get(int rowNum) const;		// O(L), or a page read
+	int size() const;							// O(1)
+	size_t bytes() const;							// O(1)
+
+private:
+	struct Location
+	{
+		long long offset;	// in the file
+		unsigned int length;	// 0 = erased
+	};
+
+	struct Page
+	{
+		long long number;
+		std::vector<char> data;
+	};
+
+	mutable std::fstream m_file;	// read under m_lock
+	std::string m_filename;
+	std::vector<Location> m_locations;	// by row #
+	long long m_end;			// where the next row goes
+	std::vector<char> m_tail;		// the last page, still being filled, not yet written
+	size_t m_maxPages;
+	mutable std::list<Page> m_pages;	// cached, most recently used at the front
+	mutable std::unordered_map<long long, std::list<Page>::iterator> m_pageIndex;
+	mutable std::mutex m_lock;		// guards the file and the cache, for readers
+	unsigned int m_id;			// distinguishes stores in each thread's recent rows
+	std::atomic<unsigned int> m_version;	// bumped whenever a row # changes contents
+	bool m_ok;				// no write has failed
+	static std::atomic<unsigned int> s_nextId;
+
+private:
+	RowStore(const RowStore& other);					// prevent copying
+	RowStore& operator=(const RowStore& rhs);				// prevent copying
+	bool write(const char* data, size_t length);				// O(length)
+	void read(long long offset, size_t length, std::string& bytes) const;	// O(length), or page reads
+	const std::vector<char>& page(long long number) const;		// O(1), or a page read
+	static void encode(const std::vector<std::string>& row, std::string& bytes); // O(L)
+	static void decode(const std::string& bytes, std::vector<std::string>& row); // O(L)
+};
+
+#endif // ROWSTORE_H
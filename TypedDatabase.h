@@ -0,0 +1,421 @@
+// A database whose schema is fixed at compile time, for tables whose layout is known in advance.
+// The schema is a std::tuple of field types, each of which names its field, gives the C++ type
+// of its values (int, long long, double or std::string) and says whether it is indexed:
+//
+//   struct Gpa : TypedField<double, true> { static constexpr const char* name = "gpa"; };
+//   typedef std::tuple<LastName, FirstName, Id, Gpa> Students;
+//   TypedDatabase<Students> db;
+//   db.search(results, TypedRange<Gpa>(3.0, 4.0), TypedRange<LastName>("F", "M"));
+//   db.sort(results, TypedSort<Gpa>(true), TypedSort<Id>());
+//
+// A row is a tuple of those types, so values are parsed once, when the row is added, and are
+// never stored or compared as strings. Each indexed field has a BST of its own type, each node
+// of which (as in MultiMap) holds the #s of every row with its key. Queries name fields by type,
+// so which field (and which comparison) each one uses is settled at compile time, and a field
+// that is not in the schema doesn't compile. A search is driven by the index of the first range
+// on an indexed field (so list the most selective first), and the rows it finds are tested
+// against the other ranges; without one, every row is scanned.
+// Unlike Database, rows can only be added, and there is no cache, hash index or store; use
+// Database for anything whose schema is known only at run time. Every public member function
+// holds the database's lock.
+
+#ifndef TYPEDDATABASE_H
+#define TYPEDDATABASE_H
+
+#include <string>
+#include <vector>
+#include <tuple>
+#include <map>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+
+// A field's value type, and whether it is indexed; a field derives from this and adds its name.
+template <class Type, bool Indexed = false>
+struct TypedField
+{
+	typedef Type type;
+	static const bool indexed = Indexed;
+};
+
+// Values of a field from min to max, each end included unless it is marked exclusive.
+template <class Field>
+struct TypedRange
+{
+	typedef Field field;
+	typename Field::type min;
+	typename Field::type max;
+	bool minExclusive;
+	bool maxExclusive;
+
+	TypedRange(const typename Field::type& lo, const typename Field::type& hi,
+		bool loExclusive = false, bool hiExclusive = false)
+		: min(lo), max(hi), minExclusive(loExclusive), maxExclusive(hiExclusive)
+	{}
+};
+
+// Orders rows by a field, ascending unless descending.
+template <class Field>
+struct TypedSort
+{
+	typedef Field field;
+	bool descending;
+
+	TypedSort(bool desc = false) : descending(desc) {}
+};
+
+template <class Schema>
+class TypedDatabase;
+
+template <class... Fields>
+class TypedDatabase<std::tuple<Fields...> >
+{
+public:
+	typedef std::tuple<typename Fields::type...> Row;
+	static const int NUM_FIELDS = sizeof...(Fields);
+
+	// The # of a field in the schema, at compile time
+	template <class Field>
+	static constexpr int fieldNumber()						// O(1)
+	{
+		return indexOf<Field, Fields...>();
+	}
+
+	TypedDatabase() {}								// O(1)
+	void clear();									// O(N)
+	void addRow(const Row& row);							// O(I log N) (I = # indexed fields)
+	bool loadFromFile(const std::string& filename);					// O(N I log N)
+	int getNumRows() const;								// O(1)
+	bool getRow(int rowNum, Row& row) const;					// O(F)
+	template <class Field>
+	bool getValue(int rowNum, typename Field::type& value) const;			// O(1)
+	template <class... Ranges>
+	int search(std::vector<int>& results, const Ranges&... ranges) const;		// O(log N + K R), or O(N R) without an index
+	template <class... Sorts>
+	void sort(std::vector<int>& results, const Sorts&... sorts) const;		// O(K log K S)
+
+private:
+	struct NoIndex {};
+	template <class Field>
+	using Index = typename std::conditional<Field::indexed,
+		std::map<typename Field::type, std::vector<int> >, NoIndex>::type;
+	template <int I>
+	using FieldAt = typename std::tuple_element<I, std::tuple<Fields...> >::type;
+
+	std::vector<Row> m_rows;
+	std::tuple<Index<Fields>...> m_indexes;
+	mutable std::mutex m_lock;
+
+private:
+	TypedDatabase(const TypedDatabase& other);			// prevent copying
+	TypedDatabase& operator=(const TypedDatabase& rhs);		// prevent copying
+
+	template <class Field>
+	static constexpr int indexOf()
+	{
+		static_assert(!std::is_same<Field, Field>::value, "no such field in the schema");
+		return -1;
+	}
+
+	template <class Field, class First, class... Rest>
+	static constexpr int indexOf()
+	{
+		if constexpr (std::is_same<Field, First>::value)
+			return 0;
+		else
+			return 1 + indexOf<Field, Rest...>();
+	}
+
+	// The position of the first range on an indexed field, or -1 if there is none
+	template <class... Ranges>
+	static constexpr int driverOf()
+	{
+		constexpr bool indexed[] = { Ranges::field::indexed..., false };
+		for (int i = 0; i < (int)sizeof...(Ranges); ++i)
+			if (indexed[i])
+				return i;
+		return -1;
+	}
+
+	template <size_t... Is>
+	void indexRow(int rowNum, std::index_sequence<Is...>);
+	template <class... Ranges>
+	static bool matches(const Row& row, const Ranges&... ranges);
+	template <class Range>
+	static bool inRange(const Row& row, const Range& range);
+	template <class Sort, class... Rest>
+	static int compare(const Row& a, const Row& b, const Sort& sort, const Rest&... rest);
+	template <size_t... Is>
+	static bool parseRow(const std::vector<std::string>& values, Row& row, std::index_sequence<Is...>);
+	template <size_t... Is>
+	static bool checkHeader(const std::vector<std::string>& names, std::index_sequence<Is...>);
+	static void splitLine(const std::string& line, std::vector<std::string>& fields);
+	static bool parse(const std::string& text, std::string& value);
+	static bool parse(const std::string& text, int& value);
+	static bool parse(const std::string& text, long long& value);
+	static bool parse(const std::string& text, double& value);
+};
+
+
+/////////////////////////////
+// TypedDatabase Implementations
+/////////////////////////////
+
+template <class... Fields>
+void TypedDatabase<std::tuple<Fields...> >::clear()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_rows.clear();
+	m_indexes = std::tuple<Index<Fields>...>();
+}
+
+// Adds a row, as row # getNumRows(), to every index.
+template <class... Fields>
+void TypedDatabase<std::tuple<Fields...> >::addRow(const Row& row)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_rows.push_back(row);
+	indexRow(m_rows.size() - 1, std::index_sequence_for<Fields...>());
+}
+
+// Replaces our rows with those of a CSV file whose 1st line names our fields, in order (any
+// index markers are ignored, since the schema decides what is indexed). Returns false, leaving
+// the rows as they were, if the file can't be read, the header doesn't match, or a row has the
+// wrong # of fields or a value that isn't of its field's type.
+template <class... Fields>
+bool TypedDatabase<std::tuple<Fields...> >::loadFromFile(const std::string& filename)
+{
+	std::ifstream inf(filename);
+	std::string line;
+	std::vector<std::string> values;
+	if (!inf || !std::getline(inf, line))
+		return false;
+	splitLine(line, values);
+	for (size_t i = 0; i < values.size(); ++i)
+		while (!values[i].empty() && (values[i].back() == '*' || values[i].back() == '#'))
+			values[i].pop_back();
+	if (values.size() != NUM_FIELDS || !checkHeader(values, std::index_sequence_for<Fields...>()))
+		return false;
+
+	std::vector<Row> rows;
+	while (std::getline(inf, line))
+	{
+		splitLine(line, values);
+		rows.push_back(Row());
+		if (values.size() != NUM_FIELDS || !parseRow(values, rows.back(), std::index_sequence_for<Fields...>()))
+			return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_rows.swap(rows);
+	m_indexes = std::tuple<Index<Fields>...>();
+	for (int rowNum = 0; rowNum < m_rows.size(); ++rowNum)
+		indexRow(rowNum, std::index_sequence_for<Fields...>());
+	return true;
+}
+
+template <class... Fields>
+int TypedDatabase<std::tuple<Fields...> >::getNumRows() const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_rows.size();
+}
+
+// Copies a row into row. Returns false if there is no such row.
+template <class... Fields>
+bool TypedDatabase<std::tuple<Fields...> >::getRow(int rowNum, Row& row) const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (rowNum < 0 || rowNum >= m_rows.size())
+		return false;
+	row = m_rows[rowNum];
+	return true;
+}
+
+// Copies a row's value of a field into value. Returns false if there is no such row.
+template <class... Fields>
+template <class Field>
+bool TypedDatabase<std::tuple<Fields...> >::getValue(int rowNum, typename Field::type& value) const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (rowNum < 0 || rowNum >= m_rows.size())
+		return false;
+	value = std::get<fieldNumber<Field>()>(m_rows[rowNum]);
+	return true;
+}
+
+// Sets results to the #s of the rows within every range, and returns how many there are: in
+// the order of the driving index's keys (ties in row # order), or of row # after a scan.
+// --- Which range drives the search, and the type of every comparison, is decided when this is
+// instantiated, so a search does no work per field but the comparisons themselves.
+template <class... Fields>
+template <class... Ranges>
+int TypedDatabase<std::tuple<Fields...> >::search(std::vector<int>& results, const Ranges&... ranges) const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	results.clear();
+	constexpr int driver = driverOf<Ranges...>();
+	if constexpr (driver < 0)
+	{
+		for (int rowNum = 0; rowNum < m_rows.size(); ++rowNum)
+			if (matches(m_rows[rowNum], ranges...))
+				results.push_back(rowNum);
+	}
+	else
+	{
+		const auto& range = std::get<driver>(std::tie(ranges...));
+		typedef typename std::remove_reference<decltype(range)>::type::field Field;
+		const Index<Field>& index = std::get<fieldNumber<Field>()>(m_indexes);
+		if (range.max < range.min
+			|| (!(range.min < range.max) && (range.minExclusive || range.maxExclusive)))
+			return 0; // (or the walk below would start past its end)
+		auto it = range.minExclusive ? index.upper_bound(range.min) : index.lower_bound(range.min);
+		auto end = range.maxExclusive ? index.lower_bound(range.max) : index.upper_bound(range.max);
+		for (; it != end; ++it)
+			for (int i = 0; i < it->second.size(); ++i)
+				if (matches(m_rows[it->second[i]], ranges...))
+					results.push_back(it->second[i]);
+	}
+	return results.size();
+}
+
+// Orders results by each sort in turn, then by row #.
+template <class... Fields>
+template <class... Sorts>
+void TypedDatabase<std::tuple<Fields...> >::sort(std::vector<int>& results, const Sorts&... sorts) const
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	std::sort(results.begin(), results.end(), [&](int a, int b) {
+		int result = 0;
+		if constexpr (sizeof...(Sorts) > 0)
+			result = compare(m_rows[a], m_rows[b], sorts...);
+		return result != 0 ? result < 0 : a < b;
+	});
+}
+
+
+/////////////////////////////
+// TypedDatabase Helper Functions
+/////////////////////////////
+
+// Adds row # rowNum to the index of each indexed field.
+template <class... Fields>
+template <size_t... Is>
+void TypedDatabase<std::tuple<Fields...> >::indexRow(int rowNum, std::index_sequence<Is...>)
+{
+	auto add = [&](auto field) {
+		constexpr size_t I = decltype(field)::value;
+		if constexpr (FieldAt<I>::indexed)
+			std::get<I>(m_indexes)[std::get<I>(m_rows[rowNum])].push_back(rowNum);
+	};
+	(add(std::integral_constant<size_t, Is>()), ...);
+}
+
+template <class... Fields>
+template <class... Ranges>
+bool TypedDatabase<std::tuple<Fields...> >::matches(const Row& row, const Ranges&... ranges)
+{
+	return (inRange(row, ranges) && ...);
+}
+
+template <class... Fields>
+template <class Range>
+bool TypedDatabase<std::tuple<Fields...> >::inRange(const Row& row, const Range& range)
+{
+	const auto& value = std::get<fieldNumber<typename Range::field>()>(row);
+	return (range.minExclusive ? range.min < value : !(value < range.min))
+		&& (range.maxExclusive ? value < range.max : !(range.max < value));
+}
+
+// Returns < 0 if row a comes first by the sorts, > 0 if b does, or 0 if neither does.
+template <class... Fields>
+template <class Sort, class... Rest>
+int TypedDatabase<std::tuple<Fields...> >::compare(const Row& a, const Row& b, const Sort& sort,
+	const Rest&... rest)
+{
+	constexpr int f = fieldNumber<typename Sort::field>();
+	if (std::get<f>(a) < std::get<f>(b))
+		return sort.descending ? 1 : -1;
+	if (std::get<f>(b) < std::get<f>(a))
+		return sort.descending ? -1 : 1;
+	if constexpr (sizeof...(Rest) > 0)
+		return compare(a, b, rest...);
+	else
+		return 0;
+}
+
+template <class... Fields>
+template <size_t... Is>
+bool TypedDatabase<std::tuple<Fields...> >::parseRow(const std::vector<std::string>& values, Row& row,
+	std::index_sequence<Is...>)
+{
+	return (parse(values[Is], std::get<Is>(row)) && ...);
+}
+
+template <class... Fields>
+template <size_t... Is>
+bool TypedDatabase<std::tuple<Fields...> >::checkHeader(const std::vector<std::string>& names,
+	std::index_sequence<Is...>)
+{
+	return ((names[Is] == FieldAt<Is>::name) && ...);
+}
+
+// Splits a line into its comma-separated fields, as Database::splitLine does.
+template <class... Fields>
+void TypedDatabase<std::tuple<Fields...> >::splitLine(const std::string& line, std::vector<std::string>& fields)
+{
+	fields.clear();
+	size_t end = line.size();
+	if (end > 0 && line[end - 1] == '\r')
+		--end;
+	for (size_t begin = 0; begin < end; )
+	{
+		size_t comma = line.find(',', begin);
+		if (comma == std::string::npos || comma > end)
+			comma = end;
+		fields.push_back(line.substr(begin, comma - begin));
+		begin = comma + 1;
+	}
+}
+
+// Each parse returns false unless all of text is a value of its type.
+template <class... Fields>
+bool TypedDatabase<std::tuple<Fields...> >::parse(const std::string& text, std::string& value)
+{
+	value = text;
+	return true;
+}
+
+template <class... Fields>
+bool TypedDatabase<std::tuple<Fields...> >::parse(const std::string& text, int& value)
+{
+	long long n;
+	if (!parse(text, n) || n < INT_MIN || n > INT_MAX)
+		return false;
+	value = n;
+	return true;
+}
+
+template <class... Fields>
+bool TypedDatabase<std::tuple<Fields...> >::parse(const std::string& text, long long& value)
+{
+	char* end;
+	errno = 0;
+	value = std::strtoll(text.c_str(), &end, 10);
+	return !text.empty() && *end == '\0' && errno == 0;
+}
+
+template <class... Fields>
+bool TypedDatabase<std::tuple<Fields...> >::parse(const std::string& text, double& value)
+{
+	char* end;
+	value = std::strtod(text.c_str(), &end);
+	return !text.empty() && *end == '\0';
+}
+
+#endif // TYPEDDATABASE_H
@@ -0,0 +1,640 @@
+// This Benchmark class generates a synthetic table and times the MultiMap and
+// Database operations that matter most on it: inserts and lookups (also with integer keys,
+// in a BasicMultiMap), loading a file, searches with 1 to 4 criteria, with and without
+// sorting, and in batches, the same loads and searches on a TypedDatabase, and scans
+// and row reads with and without compression. Each result
+// is printed as one JSON object per line, so that runs can be compared by a script.
+// Each also counts the key comparisons made (see Metrics), which unlike timings are exact.
+// The table and the queries depend only on the options (including the seed), so
+// two runs with the same options do the same work, which their checksums confirm.
+
+#ifndef BENCH_INCLUDED
+#define BENCH_INCLUDED
+
+#include "Database.h"
+#include "TypedDatabase.h"
+#include "MultiMap.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class Benchmark
+{
+public:
+	struct Options
+	{
+		int rows;		// # rows in the table
+		int fields;		// # fields per row, including the unique id
+		int cardinality;	// # distinct values of each field other than the id
+		double skew;		// Zipf exponent of those values' frequencies (0 = uniform)
+		bool sorted;		// rows in order of id, rather than shuffled
+		unsigned long long seed;
+		int queries;		// # searches timed per kind of search
+		int loads;		// # times the file is loaded
+		std::string dataFile;	// where the table is written as CSV
+		bool keepData;		// leave the file behind afterwards
+
+		Options()
+			: rows(100000), fields(4), cardinality(1000), skew(0), sorted(false), seed(1),
+			queries(200), loads(3), dataFile("bench_data.csv"), keepData(false)
+		{}
+	};
+
+	// Sets options from arguments like rows=1000000 skew=1.2 order=sorted.
+	static bool parseOptions(const std::vector<std::string>& args, Options& options,
+		std::string& problem)
+	{
+		for (size_t i = 0; i < args.size(); i++)
+		{
+			size_t equalPos = args[i].find('=');
+			if (equalPos == std::string::npos)
+			{
+				problem = "expected name=value, not " + args[i];
+				return false;
+			}
+			std::string name = args[i].substr(0, equalPos), value = args[i].substr(equalPos + 1);
+			char* end = nullptr;
+			if (name == "rows")
+				options.rows = std::strtol(value.c_str(), &end, 10);
+			else if (name == "fields")
+				options.fields = std::strtol(value.c_str(), &end, 10);
+			else if (name == "cardinality")
+				options.cardinality = std::strtol(value.c_str(), &end, 10);
+			else if (name == "skew")
+				options.skew = std::strtod(value.c_str(), &end);
+			else if (name == "seed")
+				options.seed = std::strtoull(value.c_str(), &end, 10);
+			else if (name == "queries")
+				options.queries = std::strtol(value.c_str(), &end, 10);
+			else if (name == "loads")
+				options.loads = std::strtol(value.c_str(), &end, 10);
+			else if (name == "order" && (value == "sorted" || value == "shuffled"))
+				options.sorted = value == "sorted";
+			else if (name == "data" && !value.empty())
+				options.dataFile = value;
+			else if (name == "keep" && (value == "0" || value == "1"))
+				options.keepData = value == "1";
+			else
+			{
+				problem = "unknown option " + args[i];
+				return false;
+			}
+			if (end && (end == value.c_str() || *end != '\0'))
+			{
+				problem = "invalid number in " + args[i];
+				return false;
+			}
+		}
+		if (options.rows < 1 || options.fields < 2 || options.cardinality < 1
+			|| options.skew < 0 || options.queries < 1 || options.loads < 1)
+		{
+			problem = "need rows, queries, loads, cardinality >= 1, fields >= 2 and skew >= 0";
+			return false;
+		}
+		return true;
+	}
+
+	bool run(const Options& options, std::ostream& out, std::string& problem)
+	{
+		m_options = options;
+		m_out = &out;
+		if (!generate(problem))
+			return false;
+
+		out << "{\"config\":{\"rows\":" << options.rows << ",\"fields\":" << options.fields
+			<< ",\"cardinality\":" << options.cardinality << ",\"skew\":" << options.skew
+			<< ",\"order\":\"" << (options.sorted ? "sorted" : "shuffled") << "\",\"seed\":"
+			<< options.seed << ",\"queries\":" << options.queries << "}}" << std::endl;
+
+		Metrics::reset();
+		benchMultiMap();
+		bool ok = benchLoad(problem) && benchSearch(problem) && benchTyped(problem)
+			&& benchBatch(problem) && benchCompression(problem);
+		if (!options.keepData)
+			std::remove(options.dataFile.c_str());
+		return ok;
+	}
+
+private:
+	// splitmix64, so the table is the same on every platform (unlike std's distributions)
+	class Random
+	{
+	public:
+		Random(unsigned long long seed) : m_state(seed) {}
+		unsigned long long next()
+		{
+			unsigned long long z = (m_state += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			return z ^ (z >> 31);
+		}
+		int below(int n) { return (int)(next() % (unsigned long long)n); }
+		double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+	private:
+		unsigned long long m_state;
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	// The table of 4 fields that generate writes, as a TypedDatabase schema
+	struct TypedId : TypedField<int, true> { static constexpr const char* name = "id"; };
+	struct TypedF1 : TypedField<int, true> { static constexpr const char* name = "f1"; };
+	struct TypedF2 : TypedField<std::string, true> { static constexpr const char* name = "f2"; };
+	struct TypedF3 : TypedField<double> { static constexpr const char* name = "f3"; };
+	typedef TypedDatabase<std::tuple<TypedId, TypedF1, TypedF2, TypedF3> > TypedTable;
+
+	// Writes the table: a unique id 0..rows-1, then fields whose values are drawn from
+	// cardinality ranks with Zipf-distributed frequencies (rank 0 being the most common).
+	bool generate(std::string& problem)
+	{
+		std::ofstream outf(m_options.dataFile);
+		if (!outf)
+		{
+			problem = "cannot create data file " + m_options.dataFile;
+			return false;
+		}
+
+		// Cumulative frequency of each rank, for sampling by binary search
+		m_cdf.assign(m_options.cardinality, 0);
+		double total = 0;
+		for (int r = 0; r < m_options.cardinality; r++)
+			m_cdf[r] = total += 1 / std::pow(r + 1.0, m_options.skew);
+		for (int r = 0; r < m_options.cardinality; r++)
+			m_cdf[r] /= total;
+
+		// Every field is indexed, except the last of 4 or more, which searches have to scan
+		outf << "id*";
+		for (int f = 1; f < m_options.fields; f++)
+			outf << ",f" << f << (f == m_options.fields - 1 && f >= 3 ? "" : "*");
+		outf << "\n";
+
+		std::vector<int> ids = order(m_options.sorted, m_options.seed);
+		Random rng(m_options.seed);
+		for (int i = 0; i < m_options.rows; i++)
+		{
+			outf << ids[i];
+			for (int f = 1; f < m_options.fields; f++)
+				outf << ',' << value(f, sampleRank(rng));
+			outf << "\n";
+		}
+		if (!outf)
+		{
+			problem = "cannot write data file " + m_options.dataFile;
+			return false;
+		}
+		return true;
+	}
+
+	// The ids 0..rows-1, in order or shuffled
+	std::vector<int> order(bool sorted, unsigned long long seed) const
+	{
+		std::vector<int> ids(m_options.rows);
+		for (int i = 0; i < m_options.rows; i++)
+			ids[i] = i;
+		if (!sorted)
+		{
+			Random rng(seed ^ 0x5eed);
+			for (int i = m_options.rows - 1; i > 0; i--)
+				std::swap(ids[i], ids[rng.below(i + 1)]);
+		}
+		return ids;
+	}
+
+	int sampleRank(Random& rng) const
+	{
+		if (m_options.skew == 0)
+			return rng.below(m_options.cardinality);
+		int r = std::lower_bound(m_cdf.begin(), m_cdf.end(), rng.uniform()) - m_cdf.begin();
+		return std::min(r, m_options.cardinality - 1);
+	}
+
+	// The value of rank r in field f; values rise with their ranks, and the fields cycle
+	// through integers, strings and decimals. Field 0 is the id.
+	static std::string value(int f, int r)
+	{
+		char buf[32];
+		if (f == 0 || f % 3 == 1)
+			std::snprintf(buf, sizeof(buf), "%d", f == 0 ? r : r * 10);
+		else if (f % 3 == 2)
+			std::snprintf(buf, sizeof(buf), "v%08d", r);
+		else
+			std::snprintf(buf, sizeof(buf), "%d.%02d", r / 100, r % 100);
+		return buf;
+	}
+
+	// Prints one result: latencies holds each sample's time in seconds, a sample being one
+	// operation, or batch operations at a time. Starts counting comparisons for the next one.
+	void report(const std::string& name, std::vector<double>& latencies, long long ops,
+		long long checksum, int batch = 1) const
+	{
+		double seconds = 0;
+		for (size_t i = 0; i < latencies.size(); i++)
+			seconds += latencies[i];
+		std::sort(latencies.begin(), latencies.end());
+		*m_out << "{\"bench\":\"" << name << "\",\"batch\":" << batch << ",\"samples\":"
+			<< latencies.size() << ",\"ops\":" << ops << ",\"seconds\":" << seconds
+			<< ",\"ops_per_sec\":" << (seconds > 0 ? ops / seconds : 0)
+			<< ",\"p50_us\":" << percentile(latencies, 50) << ",\"p90_us\":" << percentile(latencies, 90)
+			<< ",\"p99_us\":" << percentile(latencies, 99) << ",\"max_us\":" << percentile(latencies, 100)
+			<< ",\"comparisons\":" << Metrics::snapshot().counts[Metrics::mm_comparisons]
+			<< ",\"checksum\":" << checksum << "}" << std::endl;
+		Metrics::reset();
+	}
+
+	static double percentile(const std::vector<double>& sorted, int p)  // nearest rank
+	{
+		if (sorted.empty())
+			return 0;
+		size_t rank = (sorted.size() * p + 99) / 100;
+		return sorted[rank == 0 ? 0 : rank - 1] * 1e6;
+	}
+
+	static double since(Clock::time_point start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	// Times MultiMap's inserts and lookups, then the same on a BasicMultiMap of integer keys,
+	// which compares ids as numbers directly instead of as strings of digits, and probes
+	// between them with doubles (through its transparent comparator). Both return the same
+	// checksums.
+	void benchMultiMap() const
+	{
+		benchMap<MultiMap>("multimap", [](int id) { return value(0, id); },
+			[](int id) { return value(0, id) + ".5"; });
+		benchMap<BasicMultiMap<long long, unsigned int> >("typed_multimap",
+			[](int id) { return (long long)id; }, [](int id) { return id + 0.5; });
+	}
+
+	// Single inserts go in shuffled order whatever the table's order, since ids inserted one at
+	// a time in order build a chain; batches, as a load adds them, go in the table's order.
+	// Each id's key is key(id), and the lookups between ids (eg. 41.5) look up between(id).
+	template <class Map, class MakeKey, class MakeBetween>
+	void benchMap(const std::string& name, MakeKey key, MakeBetween between) const
+	{
+		typedef std::pair<typename std::decay<decltype(key(0))>::type, unsigned int> Entry;
+		const int BATCH = 1024;
+		std::vector<int> shuffled = order(false, m_options.seed + 1);
+		std::vector<double> latencies;
+		latencies.reserve(m_options.rows);
+		Map map;
+		for (int i = 0; i < m_options.rows; i++)
+		{
+			auto k = key(shuffled[i]);
+			Clock::time_point start = Clock::now();
+			map.insert(k, i);
+			latencies.push_back(since(start));
+		}
+		report(name + "_insert", latencies, m_options.rows, map.size());
+
+		latencies.clear();
+		std::vector<int> ids = order(m_options.sorted, m_options.seed);
+		Map batched;
+		for (int i = 0; i < m_options.rows; i += BATCH)
+		{
+			std::vector<Entry> entries;
+			for (int j = i; j < i + BATCH && j < m_options.rows; j++)
+				entries.push_back(Entry(key(ids[j]), (unsigned int)j));
+			Clock::time_point start = Clock::now();
+			batched.insertAll(entries);
+			latencies.push_back(since(start));
+		}
+		report(name + "_insert_all", latencies, m_options.rows, batched.size(), BATCH);
+
+		// Lookups of existing ids, then of keys between them
+		for (int isBetween = 0; isBetween < 2; isBetween++)
+		{
+			latencies.clear();
+			Random rng(m_options.seed + 2 + isBetween);
+			long long found = 0;
+			for (int q = 0; q < m_options.queries * 50; q++)
+			{
+				int id = rng.below(m_options.rows);
+				typename Map::Iterator it;
+				if (isBetween)
+				{
+					auto probe = between(id);
+					Clock::time_point start = Clock::now();
+					it = map.findEqualOrSuccessor(probe);
+					latencies.push_back(since(start));
+				}
+				else
+				{
+					auto probe = key(id);
+					Clock::time_point start = Clock::now();
+					it = map.findEqual(probe);
+					latencies.push_back(since(start));
+				}
+				if (it.valid())
+					found += it.getValue();
+			}
+			report(name + (isBetween ? "_find_successor" : "_find_equal"), latencies,
+				latencies.size(), found);
+		}
+	}
+
+	bool benchLoad(std::string& problem)
+	{
+		std::vector<double> latencies;
+		for (int i = 0; i < m_options.loads; i++)
+		{
+			Clock::time_point start = Clock::now();
+			if (!m_db.loadFromFile(m_options.dataFile))
+			{
+				problem = "cannot load data file " + m_options.dataFile;
+				return false;
+			}
+			latencies.push_back(since(start));
+		}
+		report("load_file", latencies, (long long)m_options.rows * m_options.loads,
+			m_db.getNumRows(), m_options.rows);
+		return true;
+	}
+
+	// Each criterion spans a tenth of its field's ranks (of the ids, for field 0), so each
+	// selects about 10% of the rows if the values are uniform. Criteria use fields 1, 2, ...,
+	// wrapping around to the id; sorted searches order by f1, then by id descending.
+	bool benchSearch(std::string& problem)
+	{
+		for (int criteria = 1; criteria <= 4 && criteria <= m_options.fields; criteria++)
+		{
+			for (int sorted = 0; sorted < 2; sorted++)
+			{
+				std::vector<Database::SortCriterion> sortCriteria;
+				if (sorted)
+				{
+					Database::SortCriterion sc;
+					sc.fieldName = "f1";
+					sc.ordering = Database::ot_ascending;
+					sortCriteria.push_back(sc);
+					sc.fieldName = "id";
+					sc.ordering = Database::ot_descending;
+					sortCriteria.push_back(sc);
+				}
+
+				Random rng(m_options.seed + 10 * criteria + sorted);
+				std::vector<double> latencies;
+				long long returned = 0;
+				for (int q = 0; q < m_options.queries; q++)
+				{
+					std::vector<Database::SearchCriterion> searchCriteria = makeCriteria(rng, criteria);
+					std::vector<int> results;
+					Clock::time_point start = Clock::now();
+					int n = m_db.search(searchCriteria, sortCriteria, results);
+					latencies.push_back(since(start));
+					if (n == Database::ERROR_RESULT)
+					{
+						problem = "error during search";
+						return false;
+					}
+					returned += n;
+				}
+				report("search_" + std::to_string(criteria) + (sorted ? "_sorted" : ""),
+					latencies, m_options.queries, returned);
+				m_searchReturned[criteria][sorted] = returned;
+			}
+		}
+		return true;
+	}
+
+	// A search's criteria, as described above
+	std::vector<Database::SearchCriterion> makeCriteria(Random& rng, int criteria) const
+	{
+		std::vector<Database::SearchCriterion> searchCriteria;
+		for (int c = 1; c <= criteria; c++)
+		{
+			int f = c % m_options.fields;
+			int ranks = f == 0 ? m_options.rows : m_options.cardinality;
+			int width = std::max(1, ranks / 10), low = rng.below(ranks);
+			Database::SearchCriterion sc;
+			sc.fieldName = f == 0 ? "id" : "f" + std::to_string(f);
+			sc.minValue = value(f, low);
+			sc.maxValue = value(f, std::min(low + width, ranks) - 1);
+			searchCriteria.push_back(sc);
+		}
+		return searchCriteria;
+	}
+
+	// The loads and searches above again, on a TypedDatabase of the same table, whose schema
+	// is fixed at compile time (so this needs fields=4). Each search is given the same
+	// criteria, converted to their fields' types, and must return as many rows.
+	bool benchTyped(std::string& problem)
+	{
+		if (m_options.fields != 4)
+			return true;
+		TypedTable table;
+		std::vector<double> latencies;
+		for (int i = 0; i < m_options.loads; i++)
+		{
+			Clock::time_point start = Clock::now();
+			if (!table.loadFromFile(m_options.dataFile))
+			{
+				problem = "cannot load data file " + m_options.dataFile + " as a typed table";
+				return false;
+			}
+			latencies.push_back(since(start));
+		}
+		report("typed_load_file", latencies, (long long)m_options.rows * m_options.loads,
+			table.getNumRows(), m_options.rows);
+
+		for (int criteria = 1; criteria <= 4; criteria++)
+		{
+			for (int sorted = 0; sorted < 2; sorted++)
+			{
+				Random rng(m_options.seed + 10 * criteria + sorted);
+				latencies.clear();
+				long long returned = 0;
+				for (int q = 0; q < m_options.queries; q++)
+				{
+					std::vector<Database::SearchCriterion> searchCriteria = makeCriteria(rng, criteria);
+					std::vector<int> results;
+					Clock::time_point start = Clock::now();
+					returned += typedSearch(table, searchCriteria, results);
+					if (sorted)
+						table.sort(results, TypedSort<TypedF1>(), TypedSort<TypedId>(true));
+					latencies.push_back(since(start));
+				}
+				report("typed_search_" + std::to_string(criteria) + (sorted ? "_sorted" : ""),
+					latencies, m_options.queries, returned);
+				if (returned != m_searchReturned[criteria][sorted])
+				{
+					problem = "typed search returned different rows";
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	// Searches the typed table with the criteria makeCriteria made, on f1, f2, f3 and id.
+	static int typedSearch(const TypedTable& table, const std::vector<Database::SearchCriterion>& c,
+		std::vector<int>& results)
+	{
+		TypedRange<TypedF1> f1(std::atoi(c[0].minValue.c_str()), std::atoi(c[0].maxValue.c_str()));
+		if (c.size() == 1)
+			return table.search(results, f1);
+		TypedRange<TypedF2> f2(c[1].minValue, c[1].maxValue);
+		if (c.size() == 2)
+			return table.search(results, f1, f2);
+		TypedRange<TypedF3> f3(std::atof(c[2].minValue.c_str()), std::atof(c[2].maxValue.c_str()));
+		if (c.size() == 3)
+			return table.search(results, f1, f2, f3);
+		TypedRange<TypedId> id(std::atoi(c[3].minValue.c_str()), std::atoi(c[3].maxValue.c_str()));
+		return table.search(results, f1, f2, f3, id);
+	}
+
+	// A report's worth of similar searches: each on f1 over a tenth of its ranks, starting
+	// within the same twentieth of them, and on f2 over a random tenth. They are run one at a
+	// time, then as batches of BATCH (see Database::searchBatch), which should share most of
+	// their walks of f1's index; both must return the same rows.
+	bool benchBatch(std::string& problem)
+	{
+		const int BATCH = 100;
+		if (m_options.fields < 3)
+			return true;
+		Random rng(m_options.seed + 100);
+		int ranks = m_options.cardinality, width = std::max(1, ranks / 10), base = rng.below(ranks);
+		std::vector<std::vector<Database::SearchCriterion> > queries(m_options.queries);
+		for (int q = 0; q < m_options.queries; q++)
+		{
+			for (int f = 1; f <= 2; f++)
+			{
+				int low = f == 1 ? std::min(base + rng.below(std::max(1, ranks / 20)), ranks - 1) : rng.below(ranks);
+				Database::SearchCriterion sc;
+				sc.fieldName = "f" + std::to_string(f);
+				sc.minValue = value(f, low);
+				sc.maxValue = value(f, std::min(low + width, ranks) - 1);
+				queries[q].push_back(sc);
+			}
+		}
+
+		std::vector<double> latencies;
+		long long individual = 0, batched = 0;
+		for (int i = 0; i < m_options.queries; i += BATCH)
+		{
+			Clock::time_point start = Clock::now();
+			for (int q = i; q < i + BATCH && q < m_options.queries; q++)
+			{
+				std::vector<int> results;
+				individual += m_db.search(queries[q], std::vector<Database::SortCriterion>(), results);
+			}
+			latencies.push_back(since(start));
+		}
+		report("search_batch_one_at_a_time", latencies, m_options.queries, individual, BATCH);
+
+		latencies.clear();
+		for (int i = 0; i < m_options.queries; i += BATCH)
+		{
+			std::vector<std::vector<Database::SearchCriterion> > batch(queries.begin() + i,
+				queries.begin() + std::min(i + BATCH, m_options.queries));
+			std::vector<std::vector<int> > results;
+			Clock::time_point start = Clock::now();
+			if (!m_db.searchBatch(batch, std::vector<std::vector<Database::SortCriterion> >(), results))
+			{
+				problem = "error during batch search";
+				return false;
+			}
+			latencies.push_back(since(start));
+			for (size_t q = 0; q < results.size(); q++)
+				batched += results[q].size();
+		}
+		report("search_batch", latencies, m_options.queries, batched, BATCH);
+		if (batched != individual)
+		{
+			problem = "batch search returned different rows";
+			return false;
+		}
+		return true;
+	}
+
+	// Searches on the last field alone (which has no BST index, so each is a scan) over a tenth
+	// of its ranks, and reads of random rows, before and after compressing the rows (see
+	// Database::setCompression); both ways must find the same rows. Also reports the bytes the
+	// rows take each way. The file is loaded again without adaptive indexing, which would
+	// otherwise have indexed the field by now.
+	bool benchCompression(std::string& problem)
+	{
+		if (m_options.fields < 4)
+			return true;
+		m_db.setAdaptiveIndexing(0);
+		if (!m_db.loadFromFile(m_options.dataFile))
+		{
+			problem = "cannot load data file " + m_options.dataFile;
+			return false;
+		}
+		int f = m_options.fields - 1, ranks = m_options.cardinality, width = std::max(1, ranks / 10);
+		Random rng(m_options.seed + 200);
+		std::vector<std::vector<Database::SearchCriterion> > queries(m_options.queries);
+		std::vector<int> rows(m_options.queries * 100);
+		for (int q = 0; q < m_options.queries; q++)
+		{
+			int low = rng.below(ranks);
+			Database::SearchCriterion sc;
+			sc.fieldName = "f" + std::to_string(f);
+			sc.minValue = value(f, low);
+			sc.maxValue = value(f, std::min(low + width, ranks) - 1);
+			queries[q].push_back(sc);
+		}
+		for (size_t i = 0; i < rows.size(); i++)
+			rows[i] = rng.below(m_options.rows);
+
+		long long returned[2], fields[2];
+		size_t rowBytes[2];
+		for (int compressed = 0; compressed < 2; compressed++)
+		{
+			m_db.setCompression(compressed);
+			rowBytes[compressed] = m_db.memoryUsage().rowBytes;
+			std::vector<double> latencies;
+			returned[compressed] = 0;
+			for (int q = 0; q < m_options.queries; q++)
+			{
+				std::vector<int> results;
+				Clock::time_point start = Clock::now();
+				returned[compressed] += m_db.search(queries[q], std::vector<Database::SortCriterion>(), results);
+				latencies.push_back(since(start));
+			}
+			report(compressed ? "scan_compressed" : "scan", latencies, m_options.queries, returned[compressed]);
+
+			latencies.clear();
+			fields[compressed] = 0;
+			std::vector<std::string> row;
+			for (size_t i = 0; i < rows.size(); i += 100)
+			{
+				Clock::time_point start = Clock::now();
+				for (size_t j = i; j < i + 100; j++)
+				{
+					m_db.getRow(rows[j], row);
+					fields[compressed] += row.size();
+				}
+				latencies.push_back(since(start));
+			}
+			report(compressed ? "get_row_compressed" : "get_row", latencies, rows.size(), fields[compressed], 100);
+		}
+		m_db.setCompression(false);
+		m_db.setAdaptiveIndexing(Database::ADAPTIVE_SCANS);
+		*m_out << "{\"bench\":\"compression\",\"row_bytes\":" << rowBytes[0] << ",\"compressed_row_bytes\":"
+			<< rowBytes[1] << ",\"ratio\":" << (double)rowBytes[0] / rowBytes[1] << "}" << std::endl;
+		if (returned[0] != returned[1] || fields[0] != fields[1])
+		{
+			problem = "compressed rows differ";
+			return false;
+		}
+		return true;
+	}
+
+private:
+	Options             m_options;
+	std::ostream*       m_out;
+	std::vector<double> m_cdf;
+	Database            m_db;
+	long long           m_searchReturned[5][2]; // rows returned by each kind of search, by # criteria
+};
+
+#endif // BENCH_INCLUDED
@@ -0,0 +1,336 @@
+// This LoadGenerator class measures a Server's throughput and latency: it opens some
+// connections to the server (normally over loopback), keeps a number of requests in flight
+// on each (pipelining), and times every reply. The requests are read from a script of
+// qparam/sparam/or lines, each search ending with an execute, count or explain line, and
+// are sent in turn. The result is printed as one JSON object, like a Benchmark's.
+// Linux (or any POSIX system) only.
+
+#ifndef LOADGEN_INCLUDED
+#define LOADGEN_INCLUDED
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+class LoadGenerator
+{
+public:
+	struct Options
+	{
+		std::string address;	// the server's TCP address
+		int port;
+		std::string socketPath;	// the server's Unix domain socket, instead of TCP
+		std::string scriptFile;	// the searches to send
+		int connections;
+		int depth;		// # requests in flight per connection
+		double seconds;		// how long to send requests for
+
+		Options()
+			: address("127.0.0.1"), port(7070), connections(4), depth(8), seconds(5)
+		{}
+	};
+
+	// Sets options from arguments like script=queries.txt connections=16 depth=32.
+	static bool parseOptions(const std::vector<std::string>& args, Options& options,
+		std::string& problem)
+	{
+		for (size_t i = 0; i < args.size(); i++)
+		{
+			size_t equalPos = args[i].find('=');
+			if (equalPos == std::string::npos)
+			{
+				problem = "expected name=value, not " + args[i];
+				return false;
+			}
+			std::string name = args[i].substr(0, equalPos), value = args[i].substr(equalPos + 1);
+			char* end = nullptr;
+			if (name == "address")
+				options.address = value;
+			else if (name == "port")
+				options.port = std::strtol(value.c_str(), &end, 10);
+			else if (name == "socket")
+				options.socketPath = value;
+			else if (name == "script")
+				options.scriptFile = value;
+			else if (name == "connections")
+				options.connections = std::strtol(value.c_str(), &end, 10);
+			else if (name == "depth")
+				options.depth = std::strtol(value.c_str(), &end, 10);
+			else if (name == "seconds")
+				options.seconds = std::strtod(value.c_str(), &end);
+			else
+			{
+				problem = "unknown option " + args[i];
+				return false;
+			}
+			if (end && (end == value.c_str() || *end != '\0'))
+			{
+				problem = "invalid number in " + args[i];
+				return false;
+			}
+		}
+		if (options.scriptFile.empty() || options.connections < 1 || options.depth < 1
+			|| options.seconds <= 0)
+		{
+			problem = "need script=file, connections and depth >= 1, and seconds > 0";
+			return false;
+		}
+		return true;
+	}
+
+	bool run(const Options& options, std::ostream& out, std::string& problem)
+	{
+		m_options = options;
+		if (!readScript(problem))
+			return false;
+
+		std::vector<Connection> connections(options.connections);
+		for (int i = 0; i < options.connections; i++)
+		{
+			connections[i].fd = connect(problem);
+			if (connections[i].fd < 0)
+			{
+				for (int j = 0; j < i; j++)
+					close(connections[j].fd);
+				return false;
+			}
+			connections[i].next = i % m_requests.size(); // so they don't all send the same search
+		}
+
+		Clock::time_point start = Clock::now();
+		m_deadline = start + std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double>(options.seconds));
+		std::vector<std::thread> threads;
+		for (int i = 0; i < options.connections; i++)
+			threads.push_back(std::thread(&LoadGenerator::drive, this, &connections[i]));
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+		std::vector<double> latencies;
+		long long errors = 0, lines = 0;
+		bool ok = true;
+		for (size_t i = 0; i < connections.size(); i++)
+		{
+			latencies.insert(latencies.end(), connections[i].latencies.begin(),
+				connections[i].latencies.end());
+			errors += connections[i].errors;
+			lines += connections[i].lines;
+			if (!connections[i].problem.empty() && ok)
+			{
+				problem = connections[i].problem;
+				ok = false;
+			}
+			close(connections[i].fd);
+		}
+		std::sort(latencies.begin(), latencies.end());
+		out << "{\"loadgen\":\"" << (options.socketPath.empty() ? "tcp" : "unix")
+			<< "\",\"connections\":" << options.connections << ",\"depth\":" << options.depth
+			<< ",\"requests\":" << latencies.size() << ",\"errors\":" << errors
+			<< ",\"reply_lines\":" << lines << ",\"seconds\":" << seconds
+			<< ",\"qps\":" << latencies.size() / seconds
+			<< ",\"p50_us\":" << percentile(latencies, 50) << ",\"p90_us\":" << percentile(latencies, 90)
+			<< ",\"p99_us\":" << percentile(latencies, 99) << ",\"p999_us\":" << percentile(latencies, 99.9)
+			<< ",\"max_us\":" << percentile(latencies, 100) << "}" << std::endl;
+		return ok;
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Connection
+	{
+		int fd;
+		size_t next;				// the request to send next
+		std::deque<Clock::time_point> sent;	// when each request in flight was sent
+		std::vector<double> latencies;		// seconds, for each reply
+		long long errors;			// replies that were errors
+		long long lines;			// lines in the other replies
+		std::string problem;
+
+		Connection() : fd(-1), next(0), errors(0), lines(0) {}
+	};
+
+	// Each request is the lines of one search, up to and including its execute (or count, or
+	// explain), ready to send.
+	bool readScript(std::string& problem)
+	{
+		std::ifstream scriptf(m_options.scriptFile);
+		if (!scriptf)
+		{
+			problem = "cannot open script file " + m_options.scriptFile;
+			return false;
+		}
+		std::string line, request;
+		while (std::getline(scriptf, line))
+		{
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (line.empty())
+				continue;
+			request += line + "\n";
+			if (line == "execute" || line == "count" || line == "explain")
+			{
+				m_requests.push_back(request);
+				request.clear();
+			}
+		}
+		if (m_requests.empty())
+		{
+			problem = "no execute, count or explain in " + m_options.scriptFile;
+			return false;
+		}
+		return true;
+	}
+
+	int connect(std::string& problem) const
+	{
+		int fd;
+		int result;
+		if (!m_options.socketPath.empty())
+		{
+			sockaddr_un addr;
+			std::memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			std::strncpy(addr.sun_path, m_options.socketPath.c_str(), sizeof(addr.sun_path) - 1);
+			fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			result = fd < 0 ? -1 : ::connect(fd, (sockaddr*)&addr, sizeof(addr));
+		}
+		else
+		{
+			sockaddr_in addr;
+			std::memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(m_options.port);
+			inet_pton(AF_INET, m_options.address.c_str(), &addr.sin_addr);
+			fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			result = fd < 0 ? -1 : ::connect(fd, (sockaddr*)&addr, sizeof(addr));
+			int one = 1;
+			if (result == 0)
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		if (result < 0)
+		{
+			problem = std::string("cannot connect to server: ") + std::strerror(errno);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	// Keeps depth requests in flight until the deadline, then waits for the last replies.
+	// Requests are sent in batches: whatever replies one read completes are replaced with
+	// a single write.
+	void drive(Connection* c)
+	{
+		std::string in;
+		char buf[64 * 1024];
+		size_t needed = 0;	// lines still to come of the reply being read (after its "ok N")
+		bool inReply = false;
+		int toSend = m_options.depth;
+		for (;;)
+		{
+			if (toSend > 0 && Clock::now() < m_deadline)
+			{
+				std::string batch;
+				for (; toSend > 0; toSend--)
+				{
+					batch += m_requests[c->next];
+					c->next = (c->next + 1) % m_requests.size();
+					c->sent.push_back(Clock::now());
+				}
+				if (!sendAll(c->fd, batch))
+				{
+					c->problem = "lost connection to server";
+					return;
+				}
+			}
+			toSend = 0;
+			if (c->sent.empty())
+				return;
+
+			ssize_t n = read(c->fd, buf, sizeof(buf));
+			if (n <= 0)
+			{
+				if (n < 0 && errno == EINTR)
+					continue;
+				c->problem = "lost connection to server";
+				return;
+			}
+			in.append(buf, n);
+
+			size_t begin = 0, end;
+			while ((end = in.find('\n', begin)) != std::string::npos)
+			{
+				if (inReply)
+					needed--;
+				else if (in.compare(begin, 3, "ok ") == 0)
+				{
+					needed = std::strtoul(in.c_str() + begin + 3, nullptr, 10);
+					c->lines += needed;
+					inReply = true;
+				}
+				else
+				{
+					c->errors++;
+					needed = 0;
+					inReply = true;
+				}
+				begin = end + 1;
+				if (inReply && needed == 0)
+				{
+					c->latencies.push_back(std::chrono::duration<double>(
+						Clock::now() - c->sent.front()).count());
+					c->sent.pop_front();
+					inReply = false;
+					toSend++;
+				}
+			}
+			in.erase(0, begin);
+		}
+	}
+
+	static bool sendAll(int fd, const std::string& data)
+	{
+		size_t sent = 0;
+		while (sent < data.size())
+		{
+			ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (n < 0 && errno != EINTR)
+				return false;
+			if (n > 0)
+				sent += n;
+		}
+		return true;
+	}
+
+	static double percentile(const std::vector<double>& sorted, double p)  // nearest rank
+	{
+		if (sorted.empty())
+			return 0;
+		size_t rank = (size_t)(sorted.size() * p / 100 + 0.999999);
+		return sorted[std::min(rank == 0 ? 0 : rank - 1, sorted.size() - 1)] * 1e6;
+	}
+
+private:
+	Options                  m_options;
+	std::vector<std::string> m_requests;
+	Clock::time_point        m_deadline;
+};
+
+#endif // LOADGEN_INCLUDED
@@ -1,12 +1,78 @@
 #include "test.h"
+#include "bench.h"
 #include <iostream>
 #include <string>
+#ifdef __linux__
+#include "server.h"
+#include "loadgen.h"
+#include <csignal>
+#endif
 using namespace std;
 
+#ifdef __linux__
+static Server* s_server;
+
+static void stopServer(int)
+{
+	s_server->stop();
+}
+#endif
+
 int main(int argc, char *argv[])
 {
 	string filename;
 
+	if (argc >= 2 && string(argv[1]) == "-bench")
+	{
+		Benchmark b;
+		Benchmark::Options options;
+		string problem;
+		if (!Benchmark::parseOptions(vector<string>(argv + 2, argv + argc), options, problem)
+			|| !b.run(options, cout, problem))
+		{
+			cout << "Problem running benchmark: " << problem << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+#ifdef __linux__
+	if (argc >= 2 && string(argv[1]) == "-serve")
+	{
+		Server server;
+		Server::Options options;
+		string problem;
+		if (!Server::parseOptions(vector<string>(argv + 2, argv + argc), options, problem))
+		{
+			cout << "Problem starting server: " << problem << endl;
+			return 1;
+		}
+		s_server = &server;
+		signal(SIGINT, stopServer);
+		signal(SIGTERM, stopServer);
+		if (!server.run(options, cout, problem))
+		{
+			cout << "Problem starting server: " << problem << endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (argc >= 2 && string(argv[1]) == "-loadgen")
+	{
+		LoadGenerator generator;
+		LoadGenerator::Options options;
+		string problem;
+		if (!LoadGenerator::parseOptions(vector<string>(argv + 2, argv + argc), options, problem)
+			|| !generator.run(options, cout, problem))
+		{
+			cout << "Problem generating load: " << problem << endl;
+			return 1;
+		}
+		return 0;
+	}
+#endif
+
 	switch (argc)
 	{
 	case 1:
@@ -18,6 +84,14 @@ int main(int argc, char *argv[])
 		break;
 	default:
 		cout << "Usage: " << argv[0] << " scriptname" << endl;
+		cout << "       " << argv[0] << " -bench [rows=N] [fields=N] [cardinality=N] [skew=X]"
+			" [order=sorted|shuffled] [seed=N] [queries=N] [loads=N] [data=file] [keep=0|1]" << endl;
+#ifdef __linux__
+		cout << "       " << argv[0] << " -serve data=file [address=A] [port=N] [socket=path]"
+			" [threads=N] [cache=bytes]" << endl;
+		cout << "       " << argv[0] << " -loadgen script=file [address=A] [port=N] [socket=path]"
+			" [connections=N] [depth=N] [seconds=X]" << endl;
+#endif
 		return 1;
 	}
 
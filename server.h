@@ -0,0 +1,636 @@
+// This Server class loads a file into one Database and answers searches on it over TCP
+// and/or a Unix domain socket, so that clients share a single loaded copy instead of each
+// loading its own. Linux only: it waits for sockets with epoll.
+//
+// The protocol is the test script's, a line at a time:
+//
+//   qparam: field,min,max[,bounds]    adds a search criterion, eg. qparam: GPA,3.0,4.0,[)
+//   sparam: field,ascending|descending adds a sort criterion
+//   or                                 the criteria so far form one alternative
+//   execute                            searches, and replies with the matching rows
+//   count                              searches, and replies with just the # of matches
+//   explain                            searches, and replies with how it was run
+//
+// The first three reply with nothing; the last three with a line "ok N" followed by N lines
+// (rows have their fields separated by commas), or with a single line "error problem", then
+// start the next search afresh. A client may send any number of requests without waiting
+// for replies (pipelining), and the replies come back in order.
+//
+// One thread waits for sockets to become readable (or writable) and hands each ready
+// connection to a pool of workers. A worker reads everything the connection has sent, runs
+// every complete request, and sends all of their replies with one write. Each connection is
+// handled by one worker at a time (epoll's one-shot mode), so its lock is never contended.
+// Searches themselves still take turns on the database's lock; the workers overlap the
+// parsing, formatting and socket I/O around them.
+
+#ifndef SERVER_INCLUDED
+#define SERVER_INCLUDED
+
+#include "Database.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+class Server
+{
+public:
+	struct Options
+	{
+		std::string dataFile;	// loaded at startup (its header line gives the schema)
+		std::string address;	// TCP address to listen on
+		int port;		// 0 = no TCP
+		std::string socketPath;	// Unix domain socket to listen on (empty = none)
+		int threads;		// # workers
+		int cacheBytes;		// search result cache (0 = none)
+		std::string rowsFile;	// keeps the rows in this file instead of in memory (empty = don't)
+		long long pageCacheBytes; // of the rows file kept in memory
+
+		Options()
+			: address("127.0.0.1"), port(7070), threads(std::thread::hardware_concurrency()),
+			cacheBytes(0), pageCacheBytes(64 << 20)
+		{
+			if (threads < 1)
+				threads = 1;
+		}
+	};
+
+	// Sets options from arguments like data=people.csv port=7070 threads=8.
+	static bool parseOptions(const std::vector<std::string>& args, Options& options,
+		std::string& problem)
+	{
+		for (size_t i = 0; i < args.size(); i++)
+		{
+			size_t equalPos = args[i].find('=');
+			if (equalPos == std::string::npos)
+			{
+				problem = "expected name=value, not " + args[i];
+				return false;
+			}
+			std::string name = args[i].substr(0, equalPos), value = args[i].substr(equalPos + 1);
+			char* end = nullptr;
+			if (name == "data")
+				options.dataFile = value;
+			else if (name == "address")
+				options.address = value;
+			else if (name == "port")
+				options.port = std::strtol(value.c_str(), &end, 10);
+			else if (name == "socket")
+				options.socketPath = value;
+			else if (name == "threads")
+				options.threads = std::strtol(value.c_str(), &end, 10);
+			else if (name == "cache")
+				options.cacheBytes = std::strtol(value.c_str(), &end, 10);
+			else if (name == "rows")
+				options.rowsFile = value;
+			else if (name == "pagecache")
+				options.pageCacheBytes = std::strtoll(value.c_str(), &end, 10);
+			else
+			{
+				problem = "unknown option " + args[i];
+				return false;
+			}
+			if (end && (end == value.c_str() || *end != '\0'))
+			{
+				problem = "invalid number in " + args[i];
+				return false;
+			}
+		}
+		if (options.dataFile.empty() || options.threads < 1 || options.port < 0
+			|| options.port > 65535 || (options.port == 0 && options.socketPath.empty())
+			|| options.pageCacheBytes < 0)
+		{
+			problem = "need data=file, threads >= 1, pagecache >= 0, and a port or a socket";
+			return false;
+		}
+		return true;
+	}
+
+	Server()
+		: m_epoll(-1), m_wakeup(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), m_stopping(false),
+		m_requests(0), m_accepted(0) {}
+
+	~Server()
+	{
+		closeAll();
+		if (m_wakeup >= 0)
+			close(m_wakeup);
+	}
+
+	// Loads the data file, then serves until stop is called. Returns false (with the problem)
+	// if the file cannot be loaded or a socket cannot be opened.
+	bool run(const Options& options, std::ostream& out, std::string& problem)
+	{
+		if (!options.rowsFile.empty() && !m_db.storeRowsOnDisk(options.rowsFile, options.pageCacheBytes))
+		{
+			problem = "cannot create rows file " + options.rowsFile;
+			return false;
+		}
+		if (!m_db.loadFromFile(options.dataFile))
+		{
+			problem = "cannot load data file " + options.dataFile;
+			return false;
+		}
+		if (options.cacheBytes > 0)
+			m_db.setCacheCapacity(options.cacheBytes);
+
+		m_epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (m_epoll < 0 || m_wakeup < 0)
+		{
+			problem = std::string("cannot create epoll instance: ") + std::strerror(errno);
+			closeAll();
+			return false;
+		}
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = nullptr; // the wakeup
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &ev);
+
+		if ((options.port > 0 && !listenTCP(options.address, options.port, problem))
+			|| (!options.socketPath.empty() && !listenUnix(options.socketPath, problem)))
+		{
+			closeAll();
+			return false;
+		}
+		out << "serving " << m_db.getNumRows() << " rows from " << options.dataFile;
+		if (options.port > 0)
+			out << " on " << options.address << ":" << options.port;
+		if (!options.socketPath.empty())
+			out << " on " << options.socketPath;
+		out << " with " << options.threads << " workers" << std::endl;
+
+		std::vector<std::thread> workers;
+		for (int i = 0; i < options.threads; i++)
+			workers.push_back(std::thread(&Server::work, this));
+		eventLoop();
+
+		{
+			std::lock_guard<std::mutex> lock(m_queueLock);
+			m_stopping = true;
+		}
+		m_queueReady.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+		out << "served " << m_requests.load() << " requests on " << m_accepted.load()
+			<< " connections" << std::endl;
+		if (!options.socketPath.empty())
+			unlink(options.socketPath.c_str());
+		closeAll();
+		return true;
+	}
+
+	// Makes run return, once the requests being run are done (or as soon as it starts, if it
+	// hasn't yet). Safe to call from a signal handler, or more than once: it only writes to an
+	// eventfd, which lives as long as the Server.
+	void stop()
+	{
+		unsigned long long one = 1;
+		(void)!write(m_wakeup, &one, sizeof(one)); // (fails only if already woken)
+	}
+
+private:
+	// What a connection has received and has yet to send, and the search it is building up.
+	// listening is set for the sockets that accept connections.
+	struct Connection
+	{
+		std::mutex lock;		// held by the worker serving it
+		int fd;
+		bool listening;
+		bool closed;			// the client has sent all it will send
+		std::string in;			// received, from the first incomplete line
+		std::string out;
+		size_t outPos;			// # bytes of out already sent
+		std::vector<Database::SearchCriterion> searchCriteria;
+		std::vector<Database::SortCriterion> sortCriteria;
+		std::vector<std::vector<Database::SearchCriterion> > alternatives;
+		std::string problem;		// with a request since the last search, if any
+
+		Connection(int f, bool l) : fd(f), listening(l), closed(false), outPos(0) {}
+	};
+
+	static const size_t MAX_LINE = 1 << 20;	// a longer line closes the connection
+	static const size_t READ_SIZE = 64 * 1024;
+	static const int MAX_EVENTS = 64;
+
+	bool listenTCP(const std::string& address, int port, std::string& problem)
+	{
+		sockaddr_in addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+		{
+			problem = "invalid address " + address;
+			return false;
+		}
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		int one = 1;
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		return listenOn(fd, (sockaddr*)&addr, sizeof(addr), address + ":" + std::to_string(port),
+			problem);
+	}
+
+	bool listenUnix(const std::string& path, std::string& problem)
+	{
+		sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+		{
+			problem = "socket path too long: " + path;
+			return false;
+		}
+		std::strcpy(addr.sun_path, path.c_str());
+		unlink(path.c_str()); // left behind by an earlier server
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		return listenOn(fd, (sockaddr*)&addr, sizeof(addr), path, problem);
+	}
+
+	bool listenOn(int fd, const sockaddr* addr, socklen_t length, const std::string& name,
+		std::string& problem)
+	{
+		if (fd < 0 || bind(fd, addr, length) < 0 || listen(fd, SOMAXCONN) < 0)
+		{
+			problem = "cannot listen on " + name + ": " + std::strerror(errno);
+			if (fd >= 0)
+				close(fd);
+			return false;
+		}
+		Connection* c = new Connection(fd, true);
+		m_connections.insert(c);
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev);
+		return true;
+	}
+
+	// Accepts new connections, and queues ready ones for the workers, until woken by stop.
+	void eventLoop()
+	{
+		epoll_event events[MAX_EVENTS];
+		for (;;)
+		{
+			int n = epoll_wait(m_epoll, events, MAX_EVENTS, -1);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return;
+			}
+			std::vector<Connection*> ready;
+			for (int i = 0; i < n; i++)
+			{
+				Connection* c = (Connection*)events[i].data.ptr;
+				if (c == nullptr)
+					return;
+				if (c->listening)
+					accept(c->fd);
+				else
+					ready.push_back(c);
+			}
+			if (!ready.empty())
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_queueLock);
+					m_queue.insert(m_queue.end(), ready.begin(), ready.end());
+				}
+				if (ready.size() == 1)
+					m_queueReady.notify_one();
+				else
+					m_queueReady.notify_all();
+			}
+		}
+	}
+
+	void accept(int listenFd)
+	{
+		for (;;)
+		{
+			int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0)
+				return; // EAGAIN: accepted them all (or out of descriptors; retried next time)
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // (fails for Unix sockets)
+			Connection* c = new Connection(fd, false);
+			{
+				std::lock_guard<std::mutex> lock(m_queueLock);
+				m_connections.insert(c);
+			}
+			m_accepted++;
+			epoll_event ev;
+			ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+			ev.data.ptr = c;
+			epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev);
+		}
+	}
+
+	void work()
+	{
+		for (;;)
+		{
+			Connection* c;
+			{
+				std::unique_lock<std::mutex> lock(m_queueLock);
+				m_queueReady.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+				if (m_stopping)
+					return;
+				c = m_queue.front();
+				m_queue.pop_front();
+			}
+			serve(c);
+		}
+	}
+
+	// Reads what the client has sent, runs its complete requests, and sends the replies; then
+	// waits for more to read, or for room to send the rest, or closes the connection.
+	// --- While a connection has replies it could not send, nothing more is read from it, so a
+	// client that sends requests without reading replies cannot make us buffer without limit.
+	void serve(Connection* c)
+	{
+		std::unique_lock<std::mutex> connectionLock(c->lock);
+		bool ok = true;
+		if (c->outPos == c->out.size())
+		{
+			ok = receive(c);
+			if (ok)
+				runRequests(c);
+		}
+		if (ok)
+			ok = send(c);
+
+		bool unsent = c->outPos < c->out.size();
+		if (!ok || (c->closed && !unsent))
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_queueLock);
+				m_connections.erase(c);
+			}
+			close(c->fd); // (which also removes it from the epoll set)
+			connectionLock.unlock();
+			delete c;
+			return;
+		}
+		epoll_event ev;
+		ev.events = (unsent ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | EPOLLONESHOT;
+		ev.data.ptr = c;
+		epoll_ctl(m_epoll, EPOLL_CTL_MOD, c->fd, &ev); // (another worker may now wait for the lock)
+	}
+
+	// Reads everything available. Returns false on an error, or a line too long to be a request.
+	bool receive(Connection* c)
+	{
+		char buf[READ_SIZE];
+		for (;;)
+		{
+			ssize_t n = read(c->fd, buf, sizeof(buf));
+			if (n > 0)
+				c->in.append(buf, n);
+			else if (n == 0)
+			{
+				c->closed = true;
+				break;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			else if (errno != EINTR)
+				return false;
+		}
+		return c->in.size() <= MAX_LINE || c->in.find('\n') != std::string::npos;
+	}
+
+	// Sends as much of the replies as the socket takes. Returns false on an error.
+	bool send(Connection* c)
+	{
+		while (c->outPos < c->out.size())
+		{
+			ssize_t n = ::send(c->fd, c->out.data() + c->outPos, c->out.size() - c->outPos,
+				MSG_NOSIGNAL);
+			if (n > 0)
+				c->outPos += n;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			else if (errno != EINTR)
+				return false;
+		}
+		c->out.clear();
+		c->outPos = 0;
+		return true;
+	}
+
+	void runRequests(Connection* c)
+	{
+		size_t begin = 0, end;
+		while ((end = c->in.find('\n', begin)) != std::string::npos)
+		{
+			runRequest(c, c->in.substr(begin, end - begin));
+			begin = end + 1;
+		}
+		c->in.erase(0, begin);
+	}
+
+	void runRequest(Connection* c, std::string line)
+	{
+		trim(line);
+		if (line.empty())
+			return;
+		if (line == "or")
+		{
+			c->alternatives.push_back(c->searchCriteria);
+			c->searchCriteria.clear();
+			return;
+		}
+		if (line == "execute" || line == "count" || line == "explain")
+		{
+			search(c, line);
+			m_requests++;
+			return;
+		}
+
+		size_t colonPos = line.find(':');
+		std::string command = line.substr(0, colonPos);
+		std::vector<std::string> tokens;
+		if (colonPos != std::string::npos)
+			split(line.substr(colonPos + 1), tokens);
+		if (command == "qparam" && tokens.size() >= 3)
+		{
+			Database::SearchCriterion sc;
+			sc.fieldName = tokens[0];
+			sc.minValue = tokens[1];
+			sc.maxValue = tokens[2];
+			if (tokens.size() > 3)  // bounds, eg. (] excludes the min
+			{
+				if (tokens[3].size() != 2 || (tokens[3][0] != '[' && tokens[3][0] != '(')
+					|| (tokens[3][1] != ']' && tokens[3][1] != ')'))
+				{
+					fail(c, "invalid bounds for field " + tokens[0]);
+					return;
+				}
+				sc.minExclusive = tokens[3][0] == '(';
+				sc.maxExclusive = tokens[3][1] == ')';
+			}
+			c->searchCriteria.push_back(sc);
+		}
+		else if (command == "sparam" && tokens.size() >= 2
+			&& (tokens[1] == "ascending" || tokens[1] == "descending"))
+		{
+			Database::SortCriterion sc;
+			sc.fieldName = tokens[0];
+			sc.ordering = tokens[1] == "ascending" ? Database::ot_ascending : Database::ot_descending;
+			c->sortCriteria.push_back(sc);
+		}
+		else
+			fail(c, "invalid request " + line);
+	}
+
+	// Keeps the first problem with a search's requests, to be its reply.
+	void fail(Connection* c, const std::string& problem)
+	{
+		if (c->problem.empty())
+			c->problem = problem;
+	}
+
+	void search(Connection* c, const std::string& how)
+	{
+		std::vector<int> rows;
+		Database::QueryStats stats;
+		int result = Database::ERROR_RESULT;
+		if (c->problem.empty() && how == "explain" && !c->alternatives.empty())
+			c->problem = "cannot explain a search with or";
+		else if (c->problem.empty() && how == "explain")
+			result = m_db.search(c->searchCriteria, c->sortCriteria, rows, stats);
+		else if (c->problem.empty() && c->alternatives.empty())
+			result = m_db.search(c->searchCriteria, c->sortCriteria, rows);
+		else if (c->problem.empty())
+		{
+			c->alternatives.push_back(c->searchCriteria);
+			result = m_db.search(c->alternatives, c->sortCriteria, rows);
+		}
+		if (result == Database::ERROR_RESULT && c->problem.empty())
+			c->problem = "error during search";
+
+		if (!c->problem.empty())
+			c->out += "error " + c->problem + "\n";
+		else if (how == "count")
+			c->out += "ok 1\n" + std::to_string(result) + "\n";
+		else if (how == "explain")
+			explain(c->out, stats);
+		else
+		{
+			c->out += "ok " + std::to_string(rows.size()) + "\n";
+			std::vector<std::string> row;
+			for (size_t i = 0; i < rows.size(); i++)
+			{
+				m_db.getRow(rows[i], row);
+				for (size_t j = 0; j < row.size(); j++)
+				{
+					if (j != 0)
+						c->out += ',';
+					c->out += row[j];
+				}
+				c->out += '\n';
+			}
+		}
+		c->searchCriteria.clear();
+		c->sortCriteria.clear();
+		c->alternatives.clear();
+		c->problem.clear();
+	}
+
+	// One line per criterion, then one with the totals, like the test script's explain.
+	static void explain(std::string& out, const Database::QueryStats& stats)
+	{
+		if (stats.cacheHit)
+		{
+			out += "ok 1\ncache hit: " + std::to_string(stats.results) + " rows\n";
+			return;
+		}
+		out += "ok " + std::to_string(stats.criteria.size() + 1) + "\n";
+		for (size_t i = 0; i < stats.criteria.size(); i++)
+		{
+			const Database::QueryStats::Criterion& c = stats.criteria[i];
+			out += (i == 0 ? "drive " : "check ") + c.fieldName + " by " + c.access
+				+ ": estimate " + std::to_string(c.estimate) + ", checked " + std::to_string(c.checked)
+				+ ", passed " + std::to_string(c.passed) + "\n";
+		}
+		out += "keys walked " + std::to_string(stats.nodesVisited) + ", rows examined "
+			+ std::to_string(stats.rowsExamined) + ", results " + std::to_string(stats.results)
+			+ ", microseconds " + std::to_string((long long)((stats.planSeconds + stats.scanSeconds
+			+ stats.sortSeconds) * 1e6)) + "\n";
+	}
+
+	static void split(const std::string& args, std::vector<std::string>& tokens)
+	{
+		size_t begin = 0;
+		for (;;)
+		{
+			size_t commaPos = args.find(',', begin);
+			tokens.push_back(args.substr(begin, commaPos - begin));
+			if (commaPos == std::string::npos)
+				break;
+			begin = commaPos + 1;
+		}
+		for (size_t i = 0; i < tokens.size(); i++)
+			trim(tokens[i]);
+	}
+
+	static void trim(std::string& s)  // trim leading and trailing whitespace
+	{
+		size_t b;
+		for (b = 0; b != s.size() && isspace((unsigned char)s[b]); b++)
+			;
+		size_t e;
+		for (e = s.size(); e != b && isspace((unsigned char)s[e - 1]); e--)
+			;
+		s = s.substr(b, e - b);
+	}
+
+	void closeAll()
+	{
+		for (std::unordered_set<Connection*>::iterator it = m_connections.begin();
+			it != m_connections.end(); ++it)
+		{
+			close((*it)->fd);
+			delete *it;
+		}
+		m_connections.clear();
+		m_queue.clear();
+		if (m_epoll >= 0)
+			close(m_epoll);
+		m_epoll = -1;
+	}
+
+private:
+	Server(const Server& other);				// prevent copying
+	Server& operator=(const Server& rhs);			// prevent copying
+
+	Database                          m_db;
+	int                               m_epoll;
+	int                               m_wakeup;	// an eventfd, written by stop (open while we exist)
+	std::mutex                        m_queueLock;	// guards m_queue, m_stopping and m_connections
+	std::condition_variable           m_queueReady;
+	std::deque<Connection*>           m_queue;	// ready for a worker
+	bool                              m_stopping;
+	std::unordered_set<Connection*>   m_connections;	// including the listening sockets
+	std::atomic<long long>            m_requests;
+	std::atomic<long long>            m_accepted;
+};
+
+#endif // SERVER_INCLUDED
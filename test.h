@@ -6,11 +6,23 @@
 #define TEST_INCLUDED
 
 #include "Database.h"
+#include "TypedDatabase.h"
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <cctype>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#ifdef __linux__
+#include "server.h"
+#endif
 
 class Test
 {
@@ -42,7 +54,9 @@ private:
 
 	enum Command {
 		cmd_empty, cmd_error, cmd_schema, cmd_url, cmd_file, cmd_add,
-		cmd_query_param, cmd_sort_param, cmd_execute
+		cmd_query_param, cmd_sort_param, cmd_or, cmd_execute, cmd_explain, cmd_batch, cmd_check,
+		cmd_cache, cmd_cache_stats, cmd_expect, cmd_aggregate, cmd_cursor,
+		cmd_delete, cmd_update, cmd_compact, cmd_row
 	};
 
 	bool parseAndExecute(std::string line, std::string& problem)
@@ -63,6 +77,7 @@ private:
 			}
 			m_searchCriteria.clear();
 			m_sortCriteria.clear();
+			m_alternatives.clear();
 			return true;
 		case cmd_url:
 			if (!m_db.loadFromURL(tokens[0]))
@@ -85,6 +100,41 @@ private:
 				return false;
 			}
 			return true;
+		case cmd_delete:
+			if (!m_db.deleteRow(std::atoi(tokens[0].c_str())))
+			{
+				problem = "no row " + tokens[0] + " to delete";
+				return false;
+			}
+			return true;
+		case cmd_update:  // row #, then the row's new values
+		{
+			std::vector<std::string> row(tokens.begin() + 1, tokens.end());
+			if (!m_db.updateRow(std::atoi(tokens[0].c_str()), row))
+			{
+				problem = "cannot update row " + tokens[0];
+				return false;
+			}
+			return true;
+		}
+		case cmd_compact:
+			m_db.compact();
+			m_lastValue = std::to_string(m_db.getNumRows());
+			return true;
+		case cmd_row:  // prints the row with this #, or "none" if it has been deleted
+		{
+			std::vector<std::string> row;
+			m_lastValue = "none";
+			if (m_db.getRow(std::atoi(tokens[0].c_str()), row))
+			{
+				m_lastValue = row[0];
+				for (size_t i = 1; i < row.size(); i++)
+					m_lastValue += "," + row[i];
+			}
+			std::cout << "row " << tokens[0] << ": " << m_lastValue << std::endl;
+			std::cout << std::string(60, '-') << std::endl;
+			return true;
+		}
 		case cmd_query_param:
 		{
 			if (tokens.size() < 3)
@@ -96,9 +146,24 @@ private:
 			sc.fieldName = tokens[0];
 			sc.minValue = tokens[1];
 			sc.maxValue = tokens[2];
+			if (tokens.size() > 3)  // bounds, eg. (] excludes the min
+			{
+				if (tokens[3].size() != 2 || (tokens[3][0] != '[' && tokens[3][0] != '(')
+					|| (tokens[3][1] != ']' && tokens[3][1] != ')'))
+				{
+					problem = "invalid bounds for field " + tokens[0];
+					return false;
+				}
+				sc.minExclusive = tokens[3][0] == '(';
+				sc.maxExclusive = tokens[3][1] == ')';
+			}
 			m_searchCriteria.push_back(sc);
 			return true;
 		}
+		case cmd_or:  // the query params so far form one alternative
+			m_alternatives.push_back(m_searchCriteria);
+			m_searchCriteria.clear();
+			return true;
 		case cmd_sort_param:
 		{
 			if (tokens.size() < 2)
@@ -123,9 +188,17 @@ private:
 		case cmd_execute:
 		{
 			std::vector<int> rows;
-			int result = m_db.search(m_searchCriteria, m_sortCriteria, rows);
+			int result;
+			if (m_alternatives.empty())
+				result = m_db.search(m_searchCriteria, m_sortCriteria, rows);
+			else
+			{
+				m_alternatives.push_back(m_searchCriteria);
+				result = m_db.search(m_alternatives, m_sortCriteria, rows);
+			}
 			m_searchCriteria.clear();
 			m_sortCriteria.clear();
+			m_alternatives.clear();
 			if (result == Database::ERROR_RESULT)
 			{
 				problem = "error during search";
@@ -133,6 +206,137 @@ private:
 			}
 			printRows(rows);
 			std::cout << std::string(60, '-') << std::endl;
+			m_lastValue = std::to_string(rows.size());
+			return true;
+		}
+		case cmd_explain:  // like execute, but prints how the search ran instead of its rows
+		{
+			if (!m_alternatives.empty())
+			{
+				problem = "cannot explain a search with or";
+				return false;
+			}
+			std::vector<int> rows;
+			Database::QueryStats stats;
+			int result = m_db.search(m_searchCriteria, m_sortCriteria, rows, stats);
+			m_searchCriteria.clear();
+			m_sortCriteria.clear();
+			if (result == Database::ERROR_RESULT)
+			{
+				problem = "error during search";
+				return false;
+			}
+			printStats(stats);
+			std::cout << std::string(60, '-') << std::endl;
+			m_lastValue = stats.cacheHit ? "cache" : stats.criteria[0].access; // how the search was driven
+			return true;
+		}
+		case cmd_batch:  // runs each alternative as its own query, together and then one by one
+		{
+			m_alternatives.push_back(m_searchCriteria);
+			std::vector<std::vector<Database::SortCriterion> > sorts(m_alternatives.size(),
+				m_sortCriteria);
+			std::vector<std::vector<int> > batched;
+			bool ok = m_db.searchBatch(m_alternatives, sorts, batched);
+			for (size_t i = 0; ok && i < m_alternatives.size(); i++)
+			{
+				std::vector<int> rows;
+				if (m_db.search(m_alternatives[i], m_sortCriteria, rows) == Database::ERROR_RESULT)
+					ok = false;
+				else if (rows != batched[i])
+				{
+					problem = "batched search " + std::to_string(i + 1) + " differs from its single search";
+					return false;
+				}
+			}
+			m_searchCriteria.clear();
+			m_sortCriteria.clear();
+			m_alternatives.clear();
+			if (!ok)
+			{
+				problem = "error during search";
+				return false;
+			}
+			for (size_t i = 0; i < batched.size(); i++)
+			{
+				printRows(batched[i]);
+				std::cout << std::string(60, '-') << std::endl;
+			}
+			return true;
+		}
+		case cmd_cache:  // caches search results in up to this many bytes (0 = no cache)
+			m_db.setCacheCapacity(std::strtoul(tokens[0].c_str(), nullptr, 10));
+			return true;
+		case cmd_cache_stats:
+			std::cout << "cache hits " << m_db.getCacheHits() << ", misses " << m_db.getCacheMisses()
+				<< std::endl;
+			std::cout << std::string(60, '-') << std::endl;
+			m_lastValue = std::to_string(m_db.getCacheHits()) + "," + std::to_string(m_db.getCacheMisses());
+			return true;
+		case cmd_expect:  // checks what the last command found, eg. its # of rows
+		{
+			std::string expected = tokens[0];
+			for (size_t i = 1; i < tokens.size(); i++)
+				expected += "," + tokens[i];
+			if (m_lastValue != expected)
+			{
+				problem = "expected " + expected + " but got " + m_lastValue;
+				return false;
+			}
+			return true;
+		}
+		case cmd_aggregate:  // type,field[,groupBy] over the rows matching the query params so far
+		{
+			const char* types[] = { "count", "min", "max", "sum", "avg" };
+			int type = std::find(types, types + 5, tokens[0]) - types;
+			if (type == 5 || tokens.size() < 2 || tokens.size() > 3)
+			{
+				problem = "invalid aggregate " + tokens[0];
+				return false;
+			}
+			std::vector<Database::AggregateResult> groups(1);
+			bool ok;
+			if (tokens.size() == 2)
+				ok = m_db.aggregate(m_searchCriteria, Database::AggregateType(type), tokens[1], groups[0]);
+			else
+				ok = m_db.aggregate(m_searchCriteria, Database::AggregateType(type), tokens[1], tokens[2],
+					groups);
+			m_searchCriteria.clear();
+			if (!ok)
+			{
+				problem = "error during aggregate";
+				return false;
+			}
+			m_lastValue.clear();
+			for (size_t i = 0; i < groups.size(); i++)
+			{
+				std::ostringstream answer;
+				if (type == Database::ag_min || type == Database::ag_max)
+					answer << groups[i].value;
+				else
+					answer << groups[i].number;
+				std::string line = tokens.size() == 2 ? answer.str() : groups[i].group + "=" + answer.str();
+				std::cout << tokens[0] << " " << tokens[1] << ": " << line << " (" << groups[i].count
+					<< " rows)" << std::endl;
+				m_lastValue += (i != 0 ? "," : "") + line;
+			}
+			std::cout << std::string(60, '-') << std::endl;
+			return true;
+		}
+		case cmd_cursor:  // batch size[,close|delete|update]: pulls the query's results through a cursor
+			if (!runCursor(tokens, problem))
+				return false;
+			std::cout << std::string(60, '-') << std::endl;
+			return true;
+		case cmd_check:  // a self-checking scenario that a script of searches can't express
+		{
+			if (!runCheck(tokens, problem))
+				return false;
+			std::string name = tokens[0];
+			for (size_t i = 1; i < tokens.size(); i++)
+				name += "," + tokens[i];
+			std::cout << "check " << name << " passed" << std::endl;
+			std::cout << std::string(60, '-') << std::endl;
 			return true;
 		}
 		}
@@ -140,6 +344,373 @@ private:
 		return true;
 	}
 
+	// Opens a cursor on the query params and sort params so far, and pulls its results in
+	// batches of the given size. With no second argument it drains the cursor, and its rows must
+	// match execute's. Otherwise it stops after the first batch: it closes the cursor, or deletes
+	// or updates (to the same values) that batch's first row, and the cursor must then be
+	// exhausted. Prints the rows pulled.
+	bool runCursor(const std::vector<std::string>& tokens, std::string& problem)
+	{
+		std::vector<Database::SearchCriterion> criteria = m_searchCriteria;
+		std::vector<Database::SortCriterion> sorts = m_sortCriteria;
+		m_searchCriteria.clear();
+		m_sortCriteria.clear();
+		int batchSize = std::atoi(tokens[0].c_str());
+		std::string stop = tokens.size() > 1 ? tokens[1] : "";
+		if (batchSize < 1 || (stop != "" && stop != "close" && stop != "delete" && stop != "update"))
+		{
+			problem = "invalid cursor params";
+			return false;
+		}
+		Database::PreparedQuery query;
+		Database::ResultCursor cursor;
+		if (!m_db.prepare(criteria, sorts, query) || !m_db.search(query, cursor))
+		{
+			problem = "error during search";
+			return false;
+		}
+
+		std::vector<int> rows, batch;
+		while (cursor.next(batch, batchSize) > 0)
+		{
+			rows.insert(rows.end(), batch.begin(), batch.end());
+			if (stop != "")
+				break;
+			if (batch.size() < batchSize && cursor.next(batch, batchSize) > 0)
+			{
+				problem = "cursor returned rows after a short batch";
+				return false;
+			}
+		}
+		printRows(rows);
+		m_lastValue = std::to_string(rows.size());
+
+		if (stop == "")
+		{
+			std::vector<int> expected;
+			m_db.search(criteria, sorts, expected);
+			if (rows != expected)
+			{
+				problem = "cursor's rows differ from the search's";
+				return false;
+			}
+			return true;
+		}
+		std::vector<std::string> row;
+		if (stop == "close")
+			cursor.close();
+		else if (stop == "delete")
+			m_db.deleteRow(rows[0]);
+		else if (m_db.getRow(rows[0], row))
+			m_db.updateRow(rows[0], row);
+		int rowNum;
+		if (cursor.next(batch, batchSize) != 0 || cursor.next(rowNum))
+		{
+			problem = "cursor returned rows after " + stop;
+			return false;
+		}
+		return true;
+	}
+
+	bool runCheck(const std::vector<std::string>& tokens, std::string& problem)
+	{
+		if (tokens[0] == "asyncload" && tokens.size() == 2)
+			return checkAsyncLoad(tokens[1], problem);
+		if (tokens[0] == "storage" && tokens.size() == 2 && (tokens[1] == "disk" || tokens[1] == "compressed"))
+			return checkStorage(tokens[1], problem);
+		if (tokens[0] == "typed" && tokens.size() == 1)
+			return checkTypedRanges(problem);
+#ifdef __linux__
+		if (tokens[0] == "server" && tokens.size() == 2)
+			return checkServer(tokens[1], problem);
+#endif
+		problem = "unknown check " + tokens[0];
+		return false;
+	}
+
+	// Starts a background load of a large file, then loads the named file while it runs,
+	// which must cancel the background load rather than wait on it forever. Another thread
+	// polls the load's progress all the while, which must never be seen half updated.
+	bool checkAsyncLoad(const std::string& filename, std::string& problem)
+	{
+		const char* bigFile = "asyncload.tmp";
+		{
+			std::ofstream out(bigFile);
+			out << "lastname*,firstname*,ID,GPA" << std::endl;
+			for (int i = 0; i < 300000; i++)
+				out << "Last" << i % 5000 << ",First" << i % 977 << "," << i << ",3." << i % 100
+					<< std::endl;
+		}
+		std::atomic<bool> polling(true), consistent(true);
+		std::thread poller([&] {
+			while (polling)
+			{
+				Database::LoadProgress progress = m_db.getLoadProgress();
+				if (progress.bytesParsed > progress.totalBytes || progress.rowsIndexed < 0)
+					consistent = false;
+			}
+		});
+		std::future<bool> background = m_db.loadFromFileAsync(bigFile);
+		while (m_db.getLoadProgress().rowsIndexed == 0 && !m_db.getLoadProgress().done)
+			std::this_thread::yield();  // until the loader is between chunks, and so mid-load
+		bool loaded = m_db.loadFromFile(filename);
+		background.wait();
+		polling = false;
+		poller.join();
+		std::remove(bigFile);
+		if (!consistent)
+		{
+			problem = "load progress was seen half updated";
+			return false;
+		}
+		if (!loaded)
+		{
+			problem = "problem loading from file " + filename + " during a background load";
+			return false;
+		}
+
+		std::ifstream inf(filename);
+		std::string line;
+		int rows = -1;  // (not counting the header)
+		while (std::getline(inf, line))
+			rows++;
+		if (m_db.getNumRows() != rows)
+		{
+			problem = "background load added rows after it was cancelled";
+			return false;
+		}
+		return true;
+	}
+
+	// Loads a file of several SCAN_BLOCKs of rows into a database kept in memory, and into one
+	// whose rows are kept on disk (or compressed, a block at a time), and checks that the same searches and getRow calls give the
+	// same answers on both: as loaded, after deleting and updating rows, and after compacting.
+	bool checkStorage(const std::string& mode, std::string& problem)
+	{
+		const char* dataFile = "storage.tmp";
+		const int numRows = 3 * Database::SCAN_BLOCK + 17;
+		{
+			std::ofstream out(dataFile);
+			out << "lastname*,firstname,ID,GPA*,dept" << std::endl;
+			for (int i = 0; i < numRows; i++)
+				out << "Last" << i % 97 << ",First" << i % 13 << "," << i << "," << i % 4 << "." << i % 100
+					<< "," << i / 500 << std::endl;
+		}
+		bool ok;
+		{
+			Database memory, stored;
+			memory.setAdaptiveIndexing(0);  // so that the same criteria keep being scanned
+			stored.setAdaptiveIndexing(0);
+			ok = mode != "disk" || stored.storeRowsOnDisk("storage.rows", 65536);
+			ok = ok && memory.loadFromFile(dataFile) && stored.loadFromFile(dataFile);
+			if (mode == "compressed")
+				stored.setCompression(true);
+			ok = ok && sameAnswers(memory, stored, "as loaded", problem);
+			for (int i = 0; ok && i < numRows; i += 50)
+				ok = memory.deleteRow(i) && stored.deleteRow(i);
+			for (int i = 3; ok && i < numRows; i += 61)
+			{
+				std::vector<std::string> row;
+				if (!memory.getRow(i, row))
+					continue;  // (deleted)
+				row[1] = "Updated";
+				row[3] = "9.9";
+				ok = memory.updateRow(i, row) && stored.updateRow(i, row);
+			}
+			ok = ok && sameAnswers(memory, stored, "after deletes and updates", problem);
+			memory.compact();
+			stored.compact();
+			ok = ok && sameAnswers(memory, stored, "after compact", problem);
+			if (!ok && problem.empty())
+				problem = "cannot load or change rows with them kept " + std::string(mode == "disk" ? "on disk" : mode);
+		}
+		std::remove(dataFile);
+		std::remove("storage.rows");
+		std::remove("storage.rows.compact");
+		return ok;
+	}
+
+	// Runs the same searches on both databases, and reads every row from both.
+	bool sameAnswers(Database& a, Database& b, const std::string& when, std::string& problem)
+	{
+		struct Query { const char* field; const char* min; const char* max; const char* sortField; };
+		const Query queries[] = {
+			{ "lastname", "Last1", "Last3", "" },	// an index range
+			{ "ID", "1000", "1100", "" },		// a numeric scan, with zone maps
+			{ "firstname", "First7", "First7", "ID" }, // a string scan, sorted by another field
+			{ "dept", "2", "4", "firstname" },
+			{ "GPA", "1.5", "2.5", "ID" },
+			{ "firstname", "Updated", "Updated", "" },
+		};
+		for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++)
+		{
+			std::vector<Database::SearchCriterion> criteria(1);
+			criteria[0].fieldName = queries[i].field;
+			criteria[0].minValue = queries[i].min;
+			criteria[0].maxValue = queries[i].max;
+			std::vector<Database::SortCriterion> sorts;
+			if (*queries[i].sortField)
+			{
+				sorts.push_back(Database::SortCriterion());
+				sorts.back().fieldName = queries[i].sortField;
+				sorts.back().ordering = Database::ot_descending;
+			}
+			std::vector<int> aRows, bRows;
+			if (a.search(criteria, sorts, aRows) == Database::ERROR_RESULT
+				|| b.search(criteria, sorts, bRows) == Database::ERROR_RESULT || aRows != bRows)
+			{
+				problem = std::string("search on ") + queries[i].field + " differs " + when;
+				return false;
+			}
+		}
+		if (a.getNumRows() != b.getNumRows())
+		{
+			problem = "# of rows differs " + when;
+			return false;
+		}
+		for (int i = 0; i < a.getNumRows(); i++)
+		{
+			std::vector<std::string> aRow, bRow;
+			if (a.getRow(i, aRow) != b.getRow(i, bRow) || aRow != bRow)
+			{
+				problem = "row " + std::to_string(i) + " differs " + when;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// The same field indexed and not, so that searches on it are driven by its index or by a scan
+	struct IndexedKey : TypedField<int, true> { static constexpr const char* name = "indexed"; };
+	struct PlainKey : TypedField<int> { static constexpr const char* name = "plain"; };
+
+	// Searches a TypedDatabase with every combination of bounds around each key, including
+	// empty ranges such as (3,3), and checks that its index finds the rows a scan does.
+	bool checkTypedRanges(std::string& problem)
+	{
+		TypedDatabase<std::tuple<IndexedKey, PlainKey> > db;
+		for (int i = 0; i < 50; i++)
+			db.addRow(std::make_tuple(i % 7, i % 7));
+		for (int min = -1; min <= 7; min++)
+			for (int max = min - 1; max <= min + 2; max++)
+				for (int bounds = 0; bounds < 4; bounds++)
+				{
+					bool minExclusive = bounds & 1, maxExclusive = bounds & 2;
+					std::vector<int> indexed, scanned;
+					db.search(indexed, TypedRange<IndexedKey>(min, max, minExclusive, maxExclusive));
+					db.search(scanned, TypedRange<PlainKey>(min, max, minExclusive, maxExclusive));
+					std::sort(indexed.begin(), indexed.end());
+					if (indexed != scanned)
+					{
+						problem = std::string("typed search of ") + (minExclusive ? "(" : "[")
+							+ std::to_string(min) + "," + std::to_string(max)
+							+ (maxExclusive ? ")" : "]") + " found the wrong rows";
+						return false;
+					}
+				}
+		return true;
+	}
+
+#ifdef __linux__
+	// Serves the named file on a Unix socket, sends a pipeline of searches (one of them with
+	// malformed bounds) and half-closes, then checks that the replies match our own searches.
+	bool checkServer(const std::string& filename, std::string& problem)
+	{
+		if (!m_db.loadFromFile(filename))
+		{
+			problem = "problem loading from file " + filename;
+			return false;
+		}
+		std::string expected;
+		std::vector<Database::SearchCriterion> criteria(1);
+		std::vector<Database::SortCriterion> sorts;
+		std::vector<int> rows;
+		criteria[0].fieldName = "lastname";
+		criteria[0].minValue = "F";
+		expected += "ok 1\n" + std::to_string(m_db.search(criteria, sorts, rows)) + "\n";
+		expected += "error invalid bounds for field GPA\n";
+		criteria[0].fieldName = "GPA";
+		criteria[0].minValue = "3.5";
+		criteria[0].maxValue = "4";
+		const char* names[] = { "lastname", "firstname", "ID" };
+		for (int i = 0; i < 3; i++)
+		{
+			sorts.push_back(Database::SortCriterion());
+			sorts.back().fieldName = names[i];
+			sorts.back().ordering = Database::ot_ascending;
+		}
+		m_db.search(criteria, sorts, rows);
+		expected += "ok " + std::to_string(rows.size()) + "\n";
+		for (size_t i = 0; i < rows.size(); i++)
+		{
+			std::vector<std::string> row;
+			m_db.getRow(rows[i], row);
+			for (size_t j = 0; j < row.size(); j++)
+				expected += (j != 0 ? "," : "") + row[j];
+			expected += "\n";
+		}
+
+		Server server;
+		Server::Options options;
+		options.dataFile = filename;
+		options.port = 0;
+		options.socketPath = "checkserver.sock";
+		options.threads = 2;
+		std::ostringstream log;
+		std::string serverProblem;
+		bool served = false;
+		std::thread serving([&] { served = server.run(options, log, serverProblem); });
+
+		sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strncpy(addr.sun_path, options.socketPath.c_str(), sizeof(addr.sun_path) - 1);
+		int fd = -1;
+		for (int tries = 0; tries < 1000 && fd < 0; tries++)  // until it is listening
+		{
+			fd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+			{
+				close(fd);
+				fd = -1;
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+		}
+		if (fd < 0)
+		{
+			serving.join();  // (run only returns early if it could not start)
+			problem = "cannot connect to server: " + serverProblem;
+			return false;
+		}
+
+		std::string requests = "qparam: lastname,F,\ncount\n"
+			"qparam: GPA,3,4,\nexecute\n"
+			"qparam: GPA,3.5,4\nsparam: lastname,ascending\nsparam: firstname,ascending\n"
+			"sparam: ID,ascending\nexecute\n";
+		bool sent = write(fd, requests.data(), requests.size()) == (ssize_t)requests.size();
+		shutdown(fd, SHUT_WR);
+		std::string replies;
+		char buffer[4096];
+		for (ssize_t n; (n = read(fd, buffer, sizeof(buffer))) > 0; )
+			replies.append(buffer, n);
+		close(fd);
+		server.stop();
+		serving.join();
+
+		if (!sent || !served)
+		{
+			problem = "server failed: " + serverProblem;
+			return false;
+		}
+		if (replies != expected)
+		{
+			problem = "server replied\n" + replies + "instead of\n" + expected;
+			return false;
+		}
+		return true;
+	}
+#endif
+
 	void printRows(const std::vector<int>& rowNums) const
 	{
 		for (size_t i = 0; i < rowNums.size(); i++)
@@ -158,29 +729,65 @@ private:
 		}
 	}
 
+	void printStats(const Database::QueryStats& stats) const
+	{
+		if (stats.cacheHit)
+		{
+			std::cout << "cache hit: " << stats.results << " rows" << std::endl;
+			return;
+		}
+		for (size_t i = 0; i < stats.criteria.size(); i++)
+		{
+			const Database::QueryStats::Criterion& c = stats.criteria[i];
+			std::cout << (i == 0 ? "drive " : "check ") << c.fieldName << " by " << c.access
+				<< ": estimate " << c.estimate << ", checked " << c.checked
+				<< ", passed " << c.passed << std::endl;
+		}
+		std::cout << "keys walked " << stats.nodesVisited << ", rows examined " << stats.rowsExamined
+			<< ", blocks skipped " << stats.blocksSkipped << ", comparisons " << stats.comparisons
+			<< ", results " << stats.results << std::endl;
+		std::cout << "plan " << stats.planSeconds * 1000 << " ms, scan " << stats.scanSeconds * 1000
+			<< " ms, sort " << stats.sortSeconds * 1000 << " ms" << std::endl;
+	}
+
 	bool setSchema(const std::vector<std::string>& tokens)
 	{
 		std::vector<Database::FieldDescriptor> schema;
+		std::vector<std::vector<std::string> > composites;
 
 		for (size_t i = 0; i < tokens.size(); i++)
 		{
-			Database::FieldDescriptor fd;
-
-			if (tokens[i].find('*') != std::string::npos)
+			if (!tokens[i].empty() && tokens[i][0] == '(')  // composite index
 			{
-				fd.name = tokens[i].substr(0, tokens[i].size() - 1);
-				fd.index = Database::it_indexed;
+				std::vector<std::string> fields(1, tokens[i].substr(1));
+				while (fields.back().find(')') == std::string::npos && ++i < tokens.size())
+					fields.push_back(tokens[i]);
+				std::string& last = fields.back();
+				if (last.size() < 2 || last.substr(last.size() - 2) != ")*")
+					return false;
+				last.erase(last.size() - 2);
+				composites.push_back(fields);
+				continue;
 			}
+
+			Database::FieldDescriptor fd;
+
+			// '*' = indexed, '#' = hashed, both = both
+			size_t marks = tokens[i].find_first_of("*#");
+			if (marks == std::string::npos)
+				marks = tokens[i].size();
+			fd.name = tokens[i].substr(0, marks);
+			bool tree = tokens[i].find('*', marks) != std::string::npos,
+				hashed = tokens[i].find('#', marks) != std::string::npos;
+			if (tree)
+				fd.index = hashed ? Database::it_both : Database::it_indexed;
 			else
-			{
-				fd.name = tokens[i];
-				fd.index = Database::it_none;
-			}
+				fd.index = hashed ? Database::it_hashed : Database::it_none;
 
 			schema.push_back(fd);
 		}
 
-		return m_db.specifySchema(schema);
+		return m_db.specifySchema(schema, composites);
 	}
 
 	Command tokenize(std::string line, std::vector<std::string>& tokens)
@@ -191,6 +798,16 @@ private:
 
 		if (line == "execute")
 			return cmd_execute;
+		if (line == "or")
+			return cmd_or;
+		if (line == "explain")
+			return cmd_explain;
+		if (line == "batch")
+			return cmd_batch;
+		if (line == "cachestats")
+			return cmd_cache_stats;
+		if (line == "compact")
+			return cmd_compact;
 
 		size_t colonPos = line.find(':');
 		if (colonPos == std::string::npos)
@@ -212,6 +829,22 @@ private:
 			cmd = cmd_query_param;
 		else if (command == "sparam")
 			cmd = cmd_sort_param;
+		else if (command == "check")
+			cmd = cmd_check;
+		else if (command == "cache")
+			cmd = cmd_cache;
+		else if (command == "expect")
+			cmd = cmd_expect;
+		else if (command == "aggregate")
+			cmd = cmd_aggregate;
+		else if (command == "cursor")
+			cmd = cmd_cursor;
+		else if (command == "delete")
+			cmd = cmd_delete;
+		else if (command == "update")
+			cmd = cmd_update;
+		else if (command == "row")
+			cmd = cmd_row;
 		else
 			return cmd_error;
 
@@ -256,6 +889,8 @@ private:
 	Database                                m_db;
 	std::vector<Database::SearchCriterion>  m_searchCriteria;
 	std::vector<Database::SortCriterion>    m_sortCriteria;
+	std::vector<std::vector<Database::SearchCriterion> > m_alternatives;
+	std::string                             m_lastValue;	// what the last command found, for expect
 };
 
 #endif // TEST_INCLUDED